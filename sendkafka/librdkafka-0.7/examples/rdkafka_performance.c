@@ -47,6 +47,17 @@ static void stop (int sig) {
 	run = 0;
 }
 
+static uint64_t released;
+
+/**
+ * Payload release callback for -D: all messages share the same buffer,
+ * just count the releases.
+ */
+static void release_cb (rd_kafka_t *rk, void *payload, size_t len,
+			void *opaque) {
+	__sync_add_and_fetch(&released, 1);
+}
+
 
 
 int main (int argc, char **argv) {
@@ -95,7 +106,7 @@ int main (int argc, char **argv) {
 			msgcnt = atoi(optarg);
 			break;
 		case 'D':
-			sendflags |= RD_KAFKA_OP_F_FREE;
+			sendflags |= RD_KAFKA_OP_F_FREE_CB;
 			break;
 		case 'i':
 			dispintvl = atoi(optarg);
@@ -118,7 +129,8 @@ int main (int argc, char **argv) {
 			"  -b <broker>  Broker address (localhost:9092)\n"
 			"  -s <size>    Message size (producer)\n"
 			"  -c <cnt>     Messages to transmit/receive\n"
-			"  -D           Copy/Duplicate data buffer (producer)\n"
+			"  -D           Zero-copy with release callback "
+			"(producer)\n"
 			"  -i <ms>      Display interval\n"
 			"\n"
 			" In Consumer mode:\n"
@@ -144,6 +156,8 @@ int main (int argc, char **argv) {
 		 * Producer
 		 */
 		char *sbuf = malloc(msgsize);
+		rd_kafka_conf_t conf = rd_kafka_defaultconf;
+		rd_kafka_topic_t *rkt;
 		int endwait;
 		int outq;
 		int i;
@@ -158,25 +172,21 @@ int main (int argc, char **argv) {
 			       msgcnt ,msgsize);
 
 		/* Create Kafka handle */
-		if (!(rk = rd_kafka_new(RD_KAFKA_PRODUCER, broker, NULL))) {
+		conf.producer.free_cb = release_cb;
+
+		if (!(rk = rd_kafka_new(RD_KAFKA_PRODUCER, broker, &conf))) {
 			perror("kafka_new producer");
 			exit(1);
 		}
 
+		rkt = rd_kafka_topic_new(rk, topic);
+
 		cnt.t_start = rd_clock();
 
 		while (run && (msgcnt == -1 || cnt.msgs < msgcnt)) {
-			char *pbuf = sbuf;
 			/* Send/Produce message. */
-
-			if (sendflags & RD_KAFKA_OP_F_FREE) {
-				/* Duplicate memory */
-				pbuf = malloc(msgsize);
-				memcpy(pbuf, sbuf, msgsize);
-			}
-
-			rd_kafka_produce(rk, topic, partition,
-					 sendflags, pbuf, msgsize);
+			rd_kafka_topic_produce(rkt, partition,
+					       sendflags, sbuf, msgsize);
 			cnt.msgs++;
 			cnt.bytes += msgsize;
 			
@@ -232,6 +242,12 @@ int main (int argc, char **argv) {
 			endwait -= 10000;
 		}
 
+		printf("%% Op pool: %"PRIu64" hits, %"PRIu64" misses\n",
+		       rk->rk_op_pool.hits, rk->rk_op_pool.misses);
+
+		if (sendflags & RD_KAFKA_OP_F_FREE_CB)
+			printf("%% %"PRIu64" payloads released\n", released);
+
 		/* Destroy the handle */
 		rd_kafka_destroy(rk);
 
@@ -323,6 +339,9 @@ int main (int argc, char **argv) {
 		}
 		cnt.t_end = rd_clock();
 
+		printf("%% Op pool: %"PRIu64" hits, %"PRIu64" misses\n",
+		       rk->rk_op_pool.hits, rk->rk_op_pool.misses);
+
 		/* Destroy the handle */
 		rd_kafka_destroy(rk);
 
@@ -89,6 +89,8 @@
 #define rd_atomic_add_prev(PTR,VAL)  __sync_fetch_and_add(PTR,VAL)
 #define rd_atomic_sub_prev(PTR,VAL)  __sync_fetch_and_sub(PTR,VAL)
 
+#define rd_atomic_get(PTR)  __sync_fetch_and_add(PTR,0)
+
 
 
 #ifndef be64toh
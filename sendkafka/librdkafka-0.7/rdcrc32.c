@@ -16,6 +16,16 @@
 #include "rdcrc32.h"     /* include the header file generated with pycrc */
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RD_CRC32_WITH_CLMUL 1
+#include <cpuid.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
 
 /**
  * Static table used for the table_driven implementation.
@@ -108,6 +118,268 @@ rd_crc32_t rd_crc32_reflect(rd_crc32_t data, size_t data_len)
 }
 
 
+/**
+ * Slice-by-16 tables: crc_tables[0] is crc_table, crc_tables[k][i] is the
+ * crc of byte i followed by k zero bytes.
+ * Set up by rd_crc32_resolve().
+ *****************************************************************************/
+static rd_crc32_t crc_tables[16][256];
+
+
+/**
+ * Byte-at-a-time update, for the head and tail of the buffer.
+ * Copies \a data to \a dst unless \a dst is NULL.
+ *****************************************************************************/
+static inline rd_crc32_t rd_crc32_update_bytes(rd_crc32_t crc,
+                                               unsigned char *dst,
+                                               const unsigned char *data,
+                                               size_t data_len)
+{
+    while (data_len--) {
+        if (dst)
+            *(dst++) = *data;
+        crc = crc_table[(crc ^ *data) & 0xff] ^ (crc >> 8);
+        data++;
+    }
+    return crc;
+}
+
+
+/**
+ * Portable slice-by-16 update: 16 bytes per iteration with 16 independent
+ * table lookups. Copies \a data to \a dst unless \a dst is NULL.
+ *****************************************************************************/
+static rd_crc32_t rd_crc32_update_slice16(rd_crc32_t crc,
+                                          unsigned char *dst,
+                                          const unsigned char *data,
+                                          size_t data_len)
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    const rd_crc32_t (*t)[256] = (const rd_crc32_t (*)[256])crc_tables;
+
+    while (data_len >= 16) {
+        uint32_t w[4];
+
+        memcpy(w, data, sizeof(w));
+        if (dst) {
+            memcpy(dst, w, sizeof(w));
+            dst += 16;
+        }
+        w[0] ^= crc;
+
+        crc = t[15][w[0] & 0xff] ^ t[14][(w[0] >> 8) & 0xff] ^
+              t[13][(w[0] >> 16) & 0xff] ^ t[12][w[0] >> 24] ^
+              t[11][w[1] & 0xff] ^ t[10][(w[1] >> 8) & 0xff] ^
+              t[9][(w[1] >> 16) & 0xff] ^ t[8][w[1] >> 24] ^
+              t[7][w[2] & 0xff] ^ t[6][(w[2] >> 8) & 0xff] ^
+              t[5][(w[2] >> 16) & 0xff] ^ t[4][w[2] >> 24] ^
+              t[3][w[3] & 0xff] ^ t[2][(w[3] >> 8) & 0xff] ^
+              t[1][(w[3] >> 16) & 0xff] ^ t[0][w[3] >> 24];
+
+        data += 16;
+        data_len -= 16;
+    }
+#endif
+
+    return rd_crc32_update_bytes(crc, dst, data, data_len);
+}
+
+
+#ifdef RD_CRC32_WITH_CLMUL
+/**
+ * Carry-less multiplication folding update (Intel's "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction", bit-reflected),
+ * four 128-bit lanes are folded 64 bytes at a time, then reduced to 32 bits
+ * with Barrett reduction.
+ * Handles buffers of at least 64 bytes, the remainder after the last full
+ * 16-byte block is left to the slice-by-16 path.
+ * Copies \a data to \a dst unless \a dst is NULL.
+ *****************************************************************************/
+__attribute__((target("pclmul,sse4.1")))
+static rd_crc32_t rd_crc32_update_clmul(rd_crc32_t crc,
+                                        unsigned char *dst,
+                                        const unsigned char *data,
+                                        size_t data_len)
+{
+    static const uint64_t __attribute__((aligned(16)))
+        k1k2[] = { 0x0154442bd4ULL, 0x01c6e41596ULL },
+        k3k4[] = { 0x01751997d0ULL, 0x00ccaa009eULL },
+        k5k0[] = { 0x0163cd6124ULL, 0x0000000000ULL },
+        poly[] = { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    if (data_len < 64)
+        return rd_crc32_update_slice16(crc, dst, data, data_len);
+
+    x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+    if (dst) {
+        _mm_storeu_si128((__m128i *)(dst + 0x00), x1);
+        _mm_storeu_si128((__m128i *)(dst + 0x10), x2);
+        _mm_storeu_si128((__m128i *)(dst + 0x20), x3);
+        _mm_storeu_si128((__m128i *)(dst + 0x30), x4);
+        dst += 64;
+    }
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+
+    data += 64;
+    data_len -= 64;
+
+    /* Fold 64 bytes at a time into the four lanes. */
+    while (data_len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+        if (dst) {
+            _mm_storeu_si128((__m128i *)(dst + 0x00), y5);
+            _mm_storeu_si128((__m128i *)(dst + 0x10), y6);
+            _mm_storeu_si128((__m128i *)(dst + 0x20), y7);
+            _mm_storeu_si128((__m128i *)(dst + 0x30), y8);
+            dst += 64;
+        }
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        data += 64;
+        data_len -= 64;
+    }
+
+    /* Fold the four lanes into one. */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* Fold the remaining full 16 byte blocks. */
+    while (data_len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)data);
+        if (dst) {
+            _mm_storeu_si128((__m128i *)dst, x2);
+            dst += 16;
+        }
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        data += 16;
+        data_len -= 16;
+    }
+
+    /* Fold 128 to 64 bits. */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits. */
+    x0 = _mm_load_si128((const __m128i *)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = _mm_extract_epi32(x1, 1);
+
+    return rd_crc32_update_slice16(crc, dst, data, data_len);
+}
+#endif
+
+
+static rd_crc32_t rd_crc32_resolve(rd_crc32_t crc, unsigned char *dst,
+                                   const unsigned char *data, size_t data_len);
+
+/**
+ * The update implementation, chosen on first use by rd_crc32_resolve().
+ *****************************************************************************/
+static rd_crc32_t (*rd_crc32_update_impl)(rd_crc32_t crc, unsigned char *dst,
+                                          const unsigned char *data,
+                                          size_t data_len) = rd_crc32_resolve;
+static const char *rd_crc32_impl_name = "slice-by-16";
+static pthread_once_t rd_crc32_once = PTHREAD_ONCE_INIT;
+
+
+static void rd_crc32_init_impl(void)
+{
+    int k, i;
+
+    memcpy(crc_tables[0], crc_table, sizeof(crc_table));
+    for (k = 1; k < 16; k++)
+        for (i = 0; i < 256; i++)
+            crc_tables[k][i] = (crc_tables[k-1][i] >> 8) ^
+                crc_table[crc_tables[k-1][i] & 0xff];
+
+#ifdef RD_CRC32_WITH_CLMUL
+    {
+        unsigned int eax, ebx, ecx, edx;
+
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+            (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1)) {
+            rd_crc32_update_impl = rd_crc32_update_clmul;
+            rd_crc32_impl_name = "pclmulqdq";
+            return;
+        }
+    }
+#endif
+    rd_crc32_update_impl = rd_crc32_update_slice16;
+}
+
+
+/**
+ * First call: set up the tables, pick the implementation for this CPU
+ * and pass the call on to it.
+ *****************************************************************************/
+static rd_crc32_t rd_crc32_resolve(rd_crc32_t crc, unsigned char *dst,
+                                   const unsigned char *data, size_t data_len)
+{
+    pthread_once(&rd_crc32_once, rd_crc32_init_impl);
+    return rd_crc32_update_impl(crc, dst, data, data_len);
+}
+
+
+const char *rd_crc32_impl(void)
+{
+    pthread_once(&rd_crc32_once, rd_crc32_init_impl);
+    return rd_crc32_impl_name;
+}
+
+
 /**
  * Update the crc value with new data.
  *
@@ -118,15 +390,24 @@ rd_crc32_t rd_crc32_reflect(rd_crc32_t data, size_t data_len)
  *****************************************************************************/
 rd_crc32_t rd_crc32_update(rd_crc32_t crc, const unsigned char *data, size_t data_len)
 {
-    unsigned int tbl_idx;
+    return rd_crc32_update_impl(crc, NULL, data, data_len);
+}
 
-    while (data_len--) {
-        tbl_idx = (crc ^ *data) & 0xff;
-        crc = (crc_table[tbl_idx] ^ (crc >> 8)) & 0xffffffff;
 
-        data++;
-    }
-    return crc & 0xffffffff;
+/**
+ * Copy \a data to \a dst and update the crc value with it in one pass.
+ *
+ * \param crc      The current crc value.
+ * \param dst      Pointer to a buffer of at least \a data_len bytes,
+ *                 must not overlap \a data.
+ * \param data     Pointer to a buffer of \a data_len bytes.
+ * \param data_len Number of bytes in the \a data buffer.
+ * \return         The updated crc value.
+ *****************************************************************************/
+rd_crc32_t rd_crc32_copy_update(rd_crc32_t crc, unsigned char *dst,
+                                const unsigned char *data, size_t data_len)
+{
+    return rd_crc32_update_impl(crc, dst, data, data_len);
 }
 
 
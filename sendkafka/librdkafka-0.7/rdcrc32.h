@@ -8,6 +8,9 @@
  * NOTE: Contains librd modifications:
  *       - rd_crc32() helper.
  *       - __RDCRC32___H__ define (was missing the '32' part).
+ *       - slice-by-16 and PCLMULQDQ folding update implementations,
+ *         chosen at runtime.
+ *       - rd_crc32_copy_update() and rd_crc32_copy() helpers.
  *
  * using the configuration:
  *    Width        = 32
@@ -75,6 +78,27 @@ static inline rd_crc32_t rd_crc32_init(void)
 rd_crc32_t rd_crc32_update(rd_crc32_t crc, const unsigned char *data, size_t data_len);
 
 
+/**
+ * Copy new data to \a dst and update the crc value with it in one pass.
+ *
+ * \param crc      The current crc value.
+ * \param dst      Pointer to a buffer of at least \a data_len bytes,
+ *                 must not overlap \a data.
+ * \param data     Pointer to a buffer of \a data_len bytes.
+ * \param data_len Number of bytes in the \a data buffer.
+ * \return         The updated crc value.
+ *****************************************************************************/
+rd_crc32_t rd_crc32_copy_update(rd_crc32_t crc, unsigned char *dst,
+                                const unsigned char *data, size_t data_len);
+
+
+/**
+ * Name of the update implementation used on this CPU,
+ * "pclmulqdq" or "slice-by-16".
+ *****************************************************************************/
+const char *rd_crc32_impl(void);
+
+
 /**
  * Calculate the final crc value.
  *
@@ -96,6 +120,17 @@ static inline rd_crc32_t rd_crc32 (const char *data, size_t data_len) {
 						 data_len));
 }
 
+/**
+ * Wrapper for copying the provided buffer and performing CRC32 on it.
+ */
+static inline rd_crc32_t rd_crc32_copy (char *dst, const char *data,
+					size_t data_len) {
+	return rd_crc32_finalize(rd_crc32_copy_update(rd_crc32_init(),
+						      (unsigned char *)dst,
+						      (const unsigned char *)
+						      data, data_len));
+}
+
 #ifdef __cplusplus
 }           /* closing brace for extern "C" */
 #endif
@@ -119,3 +119,63 @@ fail:
 		free(decompressed);
 	return NULL;
 }
+
+
+
+struct rd_gz_s {
+	z_stream strm;
+};
+
+
+rd_gz_t *rd_gz_new (int level) {
+	rd_gz_t *rgz = calloc(1, sizeof(*rgz));
+
+	/* windowBits 15+16: gzip header and trailer instead of zlib's. */
+	if (deflateInit2(&rgz->strm, level, Z_DEFLATED, 15+16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(rgz);
+		return NULL;
+	}
+
+	return rgz;
+}
+
+
+void rd_gz_destroy (rd_gz_t *rgz) {
+	deflateEnd(&rgz->strm);
+	free(rgz);
+}
+
+
+size_t rd_gz_compress_bound (rd_gz_t *rgz, size_t len) {
+	return deflateBound(&rgz->strm, len);
+}
+
+
+ssize_t rd_gz_compress (rd_gz_t *rgz, const struct iovec *iov, int iovcnt,
+			void *out, size_t outsize) {
+	z_stream *strm = &rgz->strm;
+	ssize_t len = -1;
+	int i;
+
+	strm->next_out = out;
+	strm->avail_out = outsize;
+
+	for (i = 0 ; i < iovcnt ; i++) {
+		if (!iov[i].iov_len)
+			continue;
+
+		strm->next_in = iov[i].iov_base;
+		strm->avail_in = iov[i].iov_len;
+
+		if (deflate(strm, Z_NO_FLUSH) != Z_OK || strm->avail_in > 0)
+			goto done; /* Output buffer exhausted */
+	}
+
+	if (deflate(strm, Z_FINISH) == Z_STREAM_END)
+		len = strm->total_out;
+
+done:
+	deflateReset(strm);
+	return len;
+}
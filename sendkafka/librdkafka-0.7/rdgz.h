@@ -28,6 +28,8 @@
 
 #pragma once
 
+#include <sys/uio.h>
+
 /**
  * Simple gzip decompression returning the inflated data
  * in a malloced buffer.
@@ -40,3 +42,38 @@
  */
 void *rd_gz_decompress (void *compressed, int compressed_len,
 			uint64_t *decompressed_lenp);
+
+
+
+/**
+ * Reusable gzip compressor.
+ * The deflate state is set up once by rd_gz_new() and then reset
+ * between compressions, avoiding its (costly) setup for every call.
+ * A compressor must only be used by one thread at a time.
+ */
+typedef struct rd_gz_s rd_gz_t;
+
+/**
+ * Creates a new gzip compressor with compression 'level' (0..9,
+ * or -1 for zlib's default level).
+ * Returns NULL if the level is invalid or on memory shortage.
+ */
+rd_gz_t *rd_gz_new (int level);
+
+void rd_gz_destroy (rd_gz_t *rgz);
+
+/**
+ * Returns the maximum compressed size of 'len' bytes of input.
+ */
+size_t rd_gz_compress_bound (rd_gz_t *rgz, size_t len);
+
+/**
+ * Compresses the 'iovcnt' buffers in 'iov', as one gzip member,
+ * into 'out' which is 'outsize' bytes large.
+ * An 'outsize' of rd_gz_compress_bound() of the total input length
+ * will always suffice.
+ *
+ * Returns the compressed length, or -1 on failure (e.g., 'out' too small).
+ */
+ssize_t rd_gz_compress (rd_gz_t *rgz, const struct iovec *iov, int iovcnt,
+			void *out, size_t outsize);
@@ -38,6 +38,7 @@
 #include <sys/types.h>
 #include <limits.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <errno.h>
 #include <string.h>
@@ -46,6 +47,12 @@
 #include <pthread.h>
 #include <poll.h>
 #include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
 #define __need_IOV_MAX
 #include <stdio.h>
 #include <sys/socket.h>
@@ -61,16 +68,18 @@
 #include "rdkafka.h"
 
 #ifndef WITH_LIBRD
-#include "rdcrc32.h"
 #include "rdgz.h"
 #include "rdfile.h"
 #include "rdtime.h"
+#include "rdrand.h"
 #else
-#include <librd/rdcrc32.h>
 #include <librd/rdgz.h>
 #include <librd/rdfile.h>
 #include <librd/rdtime.h>
+#include <librd/rdrand.h>
 #endif
+#include "rdcrc32.h"
+#include "rdsnappy.h"
 
 
 
@@ -113,7 +122,18 @@ const rd_kafka_conf_t rd_kafka_defaultconf = {
 		replyq_low_thres: 1,
 		max_size: 500000,
 	},
+	producer: {
+		linger_ms: 0,
+		batch_msg_cnt: 10000,
+		batch_size: 1000000,
+		compression_codec: RD_KAFKA_COMPRESSION_NONE,
+		compression_level: -1,
+	},
 	max_msg_size: 4000000,
+	op_pool_max: 32768,
+	connect_timeout_ms: 1000,
+	reconnect_backoff_ms: 100,
+	reconnect_backoff_max_ms: 10000,
 };
 
 
@@ -122,6 +142,11 @@ static void (*rd_kafka_log_cb) (const rd_kafka_t *rk, int level,
 				const char *buf) = rd_kafka_log_print;
 
 static int rd_kafka_recv (rd_kafka_t *rk);
+static void rd_kafka_batch_destroy (struct rd_kafka_batch_s *rkb);
+static void rd_kafka_q_yield (rd_kafka_q_t *rkq);
+static void rd_kafka_obuf_reset (rd_kafka_obuf_t *rkob);
+static void rd_kafka_unref (rd_kafka_t *rk);
+static void rd_kafka_outq_release (rd_kafka_t *rk, int64_t bytes);
 static void rd_kafka_op_reply (rd_kafka_t *rk,
 			       rd_kafka_op_type_t type,
 			       rd_kafka_resp_err_t err, uint8_t compression,
@@ -145,30 +170,35 @@ static char *rd_tsprintf (const char *fmt, ...) {
 
 
 /**
- * Wrapper for pthread_cond_timedwait() that makes it simpler to use
- * for delta timeouts.
- * `timeout_ms' is the delta timeout in milliseconds.
+ * Blocks until '*uaddr' is no longer 'val', a wakeup is issued on
+ * 'uaddr', or 'timeout_ms' (RD_POLL_INFINITE or milliseconds) expires.
+ * Spurious returns are possible, the caller must recheck its condition.
  */
-static int pthread_cond_timedwait_ms (pthread_cond_t *cond,
-				      pthread_mutex_t *mutex,
-				      int timeout_ms) {
-	struct timeval tv;
-	struct timespec ts;
+static void rd_futex_wait_ms (int *uaddr, int val, int timeout_ms) {
+	struct timespec ts, *tsp = NULL;
 
-	gettimeofday(&tv, NULL);
-	TIMEVAL_TO_TIMESPEC(&tv, &ts);
-
-	ts.tv_sec  += timeout_ms / 1000;
-	ts.tv_nsec += (timeout_ms % 1000) * 1000000;
-
-	if (ts.tv_nsec > 1000000000) {
-		ts.tv_sec++;
-		ts.tv_nsec -= 1000000000;
+	if (timeout_ms != RD_POLL_INFINITE) {
+		ts.tv_sec  = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+		tsp = &ts;
 	}
 
-	return pthread_cond_timedwait(cond, mutex, &ts);
+	syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, tsp, NULL, 0);
+}
+
+/**
+ * Wakes up all threads blocking in rd_futex_wait_ms() on 'uaddr'.
+ */
+static void rd_futex_wake (int *uaddr) {
+	syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
 }
 
+#if defined(__i386__) || defined(__x86_64__)
+#define rd_cpu_relax()  __asm__ __volatile__("pause" ::: "memory")
+#else
+#define rd_cpu_relax()  __asm__ __volatile__("" ::: "memory")
+#endif
+
 
 static void rd_kafka_log (const rd_kafka_t *rk, int level,
 			  const char *fac, const char *fmt, ...) {
@@ -217,13 +247,74 @@ void rd_kafka_set_logger (void (*func) (const rd_kafka_t *rk, int level,
 }
 
 
+/**
+ * Producer handles sharing their load, see rd_kafka_peers_set().
+ * A handle leaves (its slot is cleared) when it is destroyed, the set
+ * is freed along with the last of its handles.
+ */
+typedef struct rd_kafka_peers_s {
+	pthread_mutex_t     lock;   /* Protects rks[] and the peers
+				     * listed in it from going away */
+	int                 refcnt; /* Handles (not yet freed) */
+	int                 next;   /* Peer to look at first */
+	int                 cnt;
+	rd_kafka_t         *rks[0];
+} rd_kafka_peers_t;
+
+
+/**
+ * Take the handle out of its set of peers.
+ *
+ * Locality: application thread
+ */
+static void rd_kafka_peers_leave (rd_kafka_t *rk) {
+	rd_kafka_peers_t *rkp = rk->rk_peers;
+	int i;
+
+	pthread_mutex_lock(&rkp->lock);
+	for (i = 0 ; i < rkp->cnt ; i++)
+		if (rkp->rks[i] == rk)
+			rkp->rks[i] = NULL;
+	pthread_mutex_unlock(&rkp->lock);
+}
+
+
 static void rd_kafka_destroy0 (rd_kafka_t *rk) {
+	rd_kafka_topic_t *rkt;
+	rd_kafka_op_t *rko;
+	uint32_t i;
+
 	if (rk->rk_broker.s != -1)
 		close(rk->rk_broker.s);
 
+	if (rk->rk_io.efd != -1)
+		close(rk->rk_io.efd);
+
+	if (rk->rk_broker.obuf.rkob_iov)
+		free(rk->rk_broker.obuf.rkob_iov);
+
 	if (rk->rk_broker.rsal)
 		rd_sockaddr_list_destroy(rk->rk_broker.rsal);
 
+	if (rk->rk_batch)
+		rd_kafka_batch_destroy(rk->rk_batch);
+
+	while ((rkt = rk->rk_topics)) {
+		rk->rk_topics = rkt->rkt_next;
+		for (i = 0 ; i < rkt->rkt_part_cnt ; i++)
+			if (rkt->rkt_parts[i])
+				free(rkt->rkt_parts[i]);
+		if (rkt->rkt_parts)
+			free(rkt->rkt_parts);
+		free(rkt->rkt_topic);
+		free(rkt);
+	}
+
+	while ((rko = rk->rk_op_pool.free)) {
+		rk->rk_op_pool.free = rko->rko_link.tqe_next;
+		free(rko);
+	}
+
 	switch (rk->rk_type)
 	{
 	case RD_KAFKA_CONSUMER:
@@ -238,15 +329,120 @@ static void rd_kafka_destroy0 (rd_kafka_t *rk) {
 		break;
 	}
 
+	if (rk->rk_conns)
+		free(rk->rk_conns);
+
+	/* Connection handles hold a reference to their owner. */
+	if (rk->rk_parent)
+		rd_kafka_unref(rk->rk_parent);
+
+	if (rk->rk_peers && rd_atomic_sub(&rk->rk_peers->refcnt, 1) == 0) {
+		pthread_mutex_destroy(&rk->rk_peers->lock);
+		free(rk->rk_peers);
+	}
+
 	free(rk);
 }
 
 
+/**
+ * Drop a reference to the handle.
+ *
+ * Locality: any thread
+ */
+static void rd_kafka_unref (rd_kafka_t *rk) {
+	if (rd_atomic_sub(&rk->rk_refcnt, 1) == 0)
+		rd_kafka_destroy0(rk);
+}
+
+
 void rd_kafka_destroy (rd_kafka_t *rk) {
+	int i;
+
+	/* Peers no longer look at the handle once it left. */
+	if (rk->rk_peers)
+		rd_kafka_peers_leave(rk);
+
+	for (i = 1 ; i < rk->rk_conn_cnt ; i++)
+		rd_kafka_destroy(rk->rk_conns[i]);
+
 	rk->rk_terminate = 1;
+	rd_futex_wake(&rk->rk_terminate);
 
-	if (rd_atomic_sub(&rk->rk_refcnt, 1) == 0)
-		rd_kafka_destroy0(rk);
+	/* An I/O thread only looks at the handle when signalled. */
+	if (rk->rk_io.thr && !rk->rk_io.stopped)
+		rd_kafka_q_yield(&rk->rk_op);
+
+	rd_kafka_unref(rk);
+}
+
+
+void rd_kafka_stop (rd_kafka_t *rk) {
+	int i;
+
+	for (i = 1 ; i < rk->rk_conn_cnt ; i++)
+		rd_kafka_stop(rk->rk_conns[i]);
+
+	rk->rk_terminate = 1;
+	rd_futex_wake(&rk->rk_terminate);
+	rd_kafka_q_yield(&rk->rk_op);
+
+	if (!rk->rk_io.thr) {
+		pthread_join(rk->rk_thread, NULL);
+		return;
+	}
+
+	while (!rk->rk_io.stopped)
+		rd_futex_wait_ms(&rk->rk_io.stopped, 0, 100);
+}
+
+
+int rd_kafka_outq_drain (rd_kafka_t *rk, struct rd_kafka_op_head_s *rkoq) {
+	struct rd_kafka_op_head_s tmpq = TAILQ_HEAD_INITIALIZER(tmpq);
+	rd_kafka_op_t *rko;
+	int64_t bytes = 0;
+	int cnt = 0;
+	int i;
+
+	for (i = 0 ; i < rk->rk_conn_cnt ; i++)
+		cnt += rd_kafka_q_drain(&rk->rk_conns[i]->rk_op, &tmpq,
+					RD_POLL_NOWAIT);
+
+	if (rk->rk_conf.producer.max_outq_bytes)
+		TAILQ_FOREACH(rko, &tmpq, rko_link)
+			bytes += rko->rko_len;
+
+	TAILQ_CONCAT(rkoq, &tmpq, rko_link);
+
+	if (cnt > 0)
+		rd_kafka_outq_release(rk, bytes);
+
+	return cnt;
+}
+
+
+int rd_kafka_peers_set (rd_kafka_t **rks, int cnt) {
+	rd_kafka_peers_t *rkp;
+	int i;
+
+	for (i = 0 ; i < cnt ; i++) {
+		if (rks[i]->rk_type != RD_KAFKA_PRODUCER || rks[i]->rk_peers) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	rkp = calloc(1, sizeof(*rkp) + sizeof(*rkp->rks) * cnt);
+	pthread_mutex_init(&rkp->lock, NULL);
+	rkp->refcnt = cnt;
+	rkp->cnt = cnt;
+	memcpy(rkp->rks, rks, sizeof(*rks) * cnt);
+
+	__sync_synchronize();
+	for (i = 0 ; i < cnt ; i++)
+		rks[i]->rk_peers = rkp;
+
+	return 0;
 }
 
 
@@ -287,6 +483,8 @@ static void rd_kafka_fail (rd_kafka_t *rk, const char *fmt, ...) {
 		rk->rk_broker.s = -1;
 	}
 
+	rd_kafka_obuf_reset(&rk->rk_broker.obuf);
+
 	if (fmt) {
 		va_start(ap, fmt);
 		vsnprintf(rk->rk_err.msg, sizeof(rk->rk_err.msg), fmt, ap);
@@ -349,12 +547,6 @@ int rd_kafka_offset_store (rd_kafka_t *rk, uint64_t offset) {
 
 
 
-/**
- * Blocking connect attempt.
- *
- * Locality: Kafka thread
- */
-
 //  The getcurenttime for add time of log 	
 char  * getcurenttime()
 {
@@ -363,246 +555,965 @@ char  * getcurenttime()
      return  asctime(localtime(&t));
 }
 
-static int rd_kafka_connect (rd_kafka_t *rk) {
-	rd_sockaddr_inx_t *sinx = rd_sockaddr_list_next(rk->rk_broker.rsal);
-
-	if ((rk->rk_broker.s = socket(sinx->sinx_family,
-				      SOCK_STREAM, IPPROTO_TCP)) == -1) {
+static void rd_kafka_connect_failed (rd_kafka_t *rk,
+				     const rd_sockaddr_inx_t *sinx) {
+	/* Avoid duplicate log messages */
+	if (rk->rk_err.err == errno)
+		rd_kafka_fail(rk, NULL);
+	else
 		rd_kafka_fail(rk,
-			      "Failed to create %s socket: %s",
-			      rd_family2str(sinx->sinx_family),
+			      "Failed to connect to broker at %s|%s",
+			      rd_sockaddr2str(sinx, RD_SOCKADDR2STR_F_NICE),
 			      strerror(errno));
-		return -1;
-	}
-
-
-	rd_kafka_set_state(rk, RD_KAFKA_STATE_CONNECTING);
+}
 
-	if (connect(rk->rk_broker.s, (struct sockaddr *)sinx,
-		    RD_SOCKADDR_INX_LEN(sinx)) == -1) {
-		/* Avoid duplicate log messages */
-		if (rk->rk_err.err == errno)
-			rd_kafka_fail(rk, NULL);
-		else
-			rd_kafka_fail(rk,
-				      "Failed to connect to broker at %s|%s",
-				      rd_sockaddr2str(sinx,
-						      RD_SOCKADDR2STR_F_NICE),
-				      strerror(errno));
-		return -1;
-	}
 
+static void rd_kafka_connected (rd_kafka_t *rk,
+				const rd_sockaddr_inx_t *sinx) {
 	rd_kafka_dbg(rk, "CONNECTED", "connected to %s",
 		     rd_sockaddr2str(sinx, RD_SOCKADDR2STR_F_NICE));
 
 	rd_kafka_set_state(rk, RD_KAFKA_STATE_UP);
 	rk->rk_err.err = 0;
-
-	return 0;
+	rk->rk_broker.addr_tries = 0;
+	rk->rk_broker.connect_fails = 0;
 }
 
 
-void rd_kafka_op_destroy (rd_kafka_t *rk, rd_kafka_op_t *rko) {
-	
-	if (rko->rko_topic && rko->rko_flags & RD_KAFKA_OP_F_FREE_TOPIC)
-		free(rko->rko_topic);
+/**
+ * Returns how long to wait (microseconds) before the next connection
+ * attempt after a failed one: not at all while some of the broker's
+ * addresses are yet to be tried in this round, else an exponential
+ * backoff with jitter.
+ *
+ * Locality: Kafka thread
+ */
+static rd_ts_t rd_kafka_connect_backoff (rd_kafka_t *rk) {
+	rd_ts_t backoff;
 
-	if (rko->rko_payload && rko->rko_flags & RD_KAFKA_OP_F_FREE)
-		free(rko->rko_payload);
-	
-	free(rko);
-}
+	if (++rk->rk_broker.addr_tries < rk->rk_broker.rsal->rsal_cnt)
+		return 0;
 
+	rk->rk_broker.addr_tries = 0;
 
-static int rd_kafka_send (rd_kafka_t *rk, const struct msghdr *msg) {
-	int r;
+	backoff = (rd_ts_t)rk->rk_conf.reconnect_backoff_ms <<
+		RD_MIN(rk->rk_broker.connect_fails, 16);
+	if (backoff > rk->rk_conf.reconnect_backoff_max_ms)
+		backoff = rk->rk_conf.reconnect_backoff_max_ms;
 
-	r = sendmsg(rk->rk_broker.s, msg, 0);
-	if (r == -1) {
-		rd_kafka_fail(rk, "Send failed: %s", strerror(errno));
-		return -1;
-	} else {
-        
-		//rd_kafka_dbg(rk, "Send succeed to"," ");
-	}
+	if (rk->rk_broker.connect_fails < 16)
+		rk->rk_broker.connect_fails++;
 
-	rk->rk_broker.stats.tx_bytes += r;
-	rk->rk_broker.stats.tx++;
-	return r;
+	/* Somewhere between half and all of it. */
+	backoff = backoff / 2 + rd_jitter(0, backoff / 2);
+
+	return backoff * 1000;
 }
 
 
-#define RD_KAFKA_SEND_END -1
-//void  1
-static int  rd_kafka_send_request (rd_kafka_t *rk,
-				   uint16_t msgtype,
-				   struct rd_kafkap_topicpart *topicpart,
-				   ...) {
-	va_list ap;
-	int sz;
-	void *ptr;
-	const int iov_begin = 2; /* Request header + topic&partition */
-	struct iovec iov[IOV_MAX];
-	struct msghdr msg = {
-	msg_iov: iov,
-	msg_iovlen: iov_begin,
-	};
-	struct rd_kafkap_req req = {
-	rkpr_type: htons(msgtype),
+/**
+ * Applies the conf.socket options to a new broker socket, before
+ * connecting so that the buffer sizes take part in the TCP window
+ * negotiation. Failures are logged but otherwise ignored.
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_socket_opts (rd_kafka_t *rk) {
+	const struct {
+		int level, name, val;
+		const char *str;
+	} opts[] = {
+#define _OPT(LEVEL,NAME,VAL) { LEVEL, NAME, VAL, # NAME }
+		_OPT(SOL_SOCKET, SO_SNDBUF, rk->rk_conf.socket.sndbuf_size),
+		_OPT(SOL_SOCKET, SO_RCVBUF, rk->rk_conf.socket.rcvbuf_size),
+		_OPT(IPPROTO_TCP, TCP_NODELAY, !!rk->rk_conf.socket.nodelay),
+		_OPT(SOL_SOCKET, SO_KEEPALIVE, !!rk->rk_conf.socket.keepalive),
+		_OPT(IPPROTO_TCP, TCP_KEEPIDLE,
+		     rk->rk_conf.socket.keepalive ?
+		     rk->rk_conf.socket.keepalive_idle : 0),
+		_OPT(IPPROTO_TCP, TCP_KEEPINTVL,
+		     rk->rk_conf.socket.keepalive ?
+		     rk->rk_conf.socket.keepalive_intvl : 0),
+		_OPT(IPPROTO_TCP, TCP_KEEPCNT,
+		     rk->rk_conf.socket.keepalive ?
+		     rk->rk_conf.socket.keepalive_cnt : 0),
+#undef _OPT
 	};
-	int len = 0;
-	int hdr_len;
+	int i;
 
+	for (i = 0 ; i < RD_ARRAYSIZE(opts) ; i++) {
+		if (opts[i].val <= 0)
+			continue; /* System default */
 
-	/* Request header */
-	iov[0].iov_base = &req;
-	iov[0].iov_len  = sizeof(req);
-	iov[1].iov_base = topicpart->rkptp_buf;
-	iov[1].iov_len  = topicpart->rkptp_len;
-	hdr_len = iov[0].iov_len - sizeof(req.rkpr_len) + iov[1].iov_len;
+		if (setsockopt(rk->rk_broker.s, opts[i].level, opts[i].name,
+			       &opts[i].val, sizeof(opts[i].val)) == -1)
+			rd_kafka_log(rk, LOG_WARNING, "SOCKOPT",
+				     "Failed to set %s=%i: %s",
+				     opts[i].str, opts[i].val,
+				     strerror(errno));
+	}
+}
 
-	va_start(ap, topicpart);
-	while ((sz = va_arg(ap, int)) != RD_KAFKA_SEND_END) {
-		ptr = va_arg(ap, void *);
 
-		iov[msg.msg_iovlen].iov_len = sz;
-		iov[msg.msg_iovlen++].iov_base = ptr;
-		len += sz;
+/**
+ * Cork (on=1) or uncork (on=0) the broker socket around produce
+ * request writes if conf.socket.cork is set, uncorking pushes out
+ * what is left in the socket as a partial segment.
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_cork (rd_kafka_t *rk, int on) {
+	if (!rk->rk_conf.socket.cork || rk->rk_broker.s == -1)
+		return;
 
-		if (msg.msg_iovlen == IOV_MAX) {
-			req.rkpr_len = htonl(hdr_len + len);
-			req.rkpr_topic_len = htons(topicpart->rkptp_len - 4);
-			if (rd_kafka_send(rk, &msg) == -1)
-				break; /* Send failed, socket failure. */
+	setsockopt(rk->rk_broker.s, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
 
-			msg.msg_iovlen = iov_begin;
-		}
+
+/**
+ * Non-blocking connect attempt, leaves the handle CONNECTING
+ * if the connection is not established right away, see
+ * rd_kafka_connect_check().
+ *
+ * Locality: Kafka thread
+ */
+static int rd_kafka_connect_nb (rd_kafka_t *rk) {
+	rd_sockaddr_inx_t *sinx = rd_sockaddr_list_next(rk->rk_broker.rsal);
+
+	if ((rk->rk_broker.s = socket(sinx->sinx_family,
+				      SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+				      IPPROTO_TCP)) == -1) {
+		rd_kafka_fail(rk,
+			      "Failed to create %s socket: %s",
+			      rd_family2str(sinx->sinx_family),
+			      strerror(errno));
+		return -1;
 	}
-	va_end(ap);
 
-	if (msg.msg_iovlen > iov_begin) {
-		req.rkpr_len = htonl(hdr_len + len);
-		req.rkpr_topic_len = htons(topicpart->rkptp_len - 4);
+	rd_kafka_socket_opts(rk);
 
-		if(rd_kafka_send(rk, &msg)==-1)
-                {
-		       return -1;
-                }
+	rd_kafka_set_state(rk, RD_KAFKA_STATE_CONNECTING);
+
+	if (connect(rk->rk_broker.s, (struct sockaddr *)sinx,
+		    RD_SOCKADDR_INX_LEN(sinx)) == -1) {
+		if (errno == EINPROGRESS)
+			return 0;
+		rd_kafka_connect_failed(rk, sinx);
+		return -1;
 	}
-       
+
+	rd_kafka_connected(rk, sinx);
+
 	return 0;
 }
 
 
 /**
- * Serialize a topic+partition combo into a temporary buffer.
+ * Outcome of a non-blocking connect attempt, once the socket
+ * became writable, or ETIMEDOUT if 'timedout'.
+ *
+ * Locality: Kafka thread
  */
-static struct rd_kafkap_topicpart *
-rd_kafka_topicpart_serialize (const char *topic, uint32_t partition) {
-	static __thread union {
-		struct rd_kafkap_topicpart topicpart;
-		char buf[sizeof(struct rd_kafkap_topicpart) +
-			 RD_KAFKA_TOPIC_MAXLEN + sizeof(partition)];
-	} u;
-	int len;
+static int rd_kafka_connect_check (rd_kafka_t *rk, int timedout) {
+	rd_sockaddr_list_t *rsal = rk->rk_broker.rsal;
+	rd_sockaddr_inx_t *sinx = &rsal->rsal_addr[rsal->rsal_curr];
+	socklen_t len = sizeof(int);
+	int err;
 
-	len = strlen(topic);
-	if (len > RD_KAFKA_TOPIC_MAXLEN) {
-		/* This may look silly, but it saves us from mallocs,
-		 * and it should suffice for most uses, if not, increase it! */
-		fprintf(stderr,
-			"RD-KAFKA-FIXME: Topic name (%s) is too long (max %i),"
-			" will truncate it (increase in rdkafka.h)\n",
-		       topic, RD_KAFKA_TOPIC_MAXLEN);
-		len = RD_KAFKA_TOPIC_MAXLEN;
+	if (timedout)
+		err = ETIMEDOUT;
+	else if (getsockopt(rk->rk_broker.s, SOL_SOCKET, SO_ERROR,
+			    &err, &len) == -1)
+		err = errno;
+
+	if (err) {
+		errno = err;
+		rd_kafka_connect_failed(rk, sinx);
+		return -1;
 	}
 
-	partition = htonl(partition);
-	
-	memcpy(u.topicpart.rkptp_buf, topic, len);
-	memcpy(u.topicpart.rkptp_buf+len, &partition, sizeof(partition));
-	u.topicpart.rkptp_len = len + sizeof(partition);
+	rd_kafka_connected(rk, sinx);
 
-	return &u.topicpart;
+	return 0;
 }
 
 
 /**
- * Initialize a queue.
+ * Connect attempt, blocking for up to conf.connect_timeout_ms.
+ * The socket is left in blocking mode.
+ *
+ * Locality: Kafka thread
  */
-static void rd_kafka_q_init (rd_kafka_q_t *rkq) {
-	TAILQ_INIT(&rkq->rkq_q);
-	rkq->rkq_qlen = 0;
-	
-	pthread_mutex_init(&rkq->rkq_lock, NULL);
-	pthread_cond_init(&rkq->rkq_cond, NULL);
+static int rd_kafka_connect (rd_kafka_t *rk) {
+	struct pollfd pfd;
+	int r;
+
+	if (rd_kafka_connect_nb(rk) == -1)
+		return -1;
+
+	if (rk->rk_state == RD_KAFKA_STATE_CONNECTING) {
+		pfd.fd = rk->rk_broker.s;
+		pfd.events = POLLOUT;
+
+		while ((r = poll(&pfd, 1, rk->rk_conf.connect_timeout_ms)) ==
+		       -1 && errno == EINTR)
+			;
+
+		if (rd_kafka_connect_check(rk, r <= 0) == -1)
+			return -1;
+	}
+
+	fcntl(rk->rk_broker.s, F_SETFL,
+	      fcntl(rk->rk_broker.s, F_GETFL) & ~O_NONBLOCK);
+
+	return 0;
 }
 
 
 /**
- * Enqueue the 'rko' op at the tail of the queue 'rkq'.
+ * Sleep 'backoff' microseconds, or until the handle is terminated.
  *
- * Locality: any thread.
+ * Locality: Kafka thread
  */
-static inline void rd_kafka_q_enq (rd_kafka_q_t *rkq, rd_kafka_op_t *rko) {
-	pthread_mutex_lock(&rkq->rkq_lock);
-	TAILQ_INSERT_TAIL(&rkq->rkq_q, rko, rko_link);
-	(void)rd_atomic_add(&rkq->rkq_qlen, 1);
-	pthread_cond_signal(&rkq->rkq_cond);
-	pthread_mutex_unlock(&rkq->rkq_lock);
+static void rd_kafka_connect_wait (rd_kafka_t *rk, rd_ts_t backoff) {
+	rd_ts_t until = rd_clock() + backoff;
+	rd_ts_t now;
+
+	while (!rk->rk_terminate && (now = rd_clock()) < until)
+		rd_futex_wait_ms(&rk->rk_terminate, 0,
+				 (int)((until - now + 999) / 1000));
 }
 
 
 /**
- * Pop an op from a queue.
+ * Op allocation.
  *
- * Locality: any thread.
+ * Freed ops are kept in a per-thread cache which spills over to, and is
+ * refilled from, the handle's op pool (rk_op_pool) in batches.
+ * This way the steady state of the produce and reply paths, where ops
+ * are allocated in one thread and freed in another, does no
+ * malloc()/free() for ops and only takes the pool lock once per batch.
+ *
+ * The per-thread cache is not tied to any handle, an op is an op.
+ * Free ops are linked through rko_link.tqe_next.
  */
-static rd_kafka_op_t *rd_kafka_q_pop (rd_kafka_q_t *rkq, int timeout_ms) {
-	rd_kafka_op_t *rko;
-	rd_ts_t last;
+#define RD_KAFKA_OP_CACHE_MAX    256  /* Max ops in a thread's cache */
+#define RD_KAFKA_OP_CACHE_BATCH  128  /* Ops moved to/from the pool at once */
 
-	pthread_mutex_lock(&rkq->rkq_lock);
-	
-	while (!(rko = TAILQ_FIRST(&rkq->rkq_q)) &&
-	       (timeout_ms == RD_POLL_INFINITE || timeout_ms > 0)) {
-
-		if (timeout_ms != RD_POLL_INFINITE) {
-			last = rd_clock();
-			if (pthread_cond_timedwait_ms(&rkq->rkq_cond,
-						      &rkq->rkq_lock,
-						      timeout_ms) ==
-			    ETIMEDOUT) {
-				pthread_mutex_unlock(&rkq->rkq_lock);
-				return NULL;
-			}
-			timeout_ms -= (rd_clock() - last) / 1000;
-		} else
-			pthread_cond_wait(&rkq->rkq_cond, &rkq->rkq_lock);
-	}
+static __thread struct {
+	rd_kafka_op_t *free;
+	int            cnt;
+	int            registered;  /* Thread exit destructor registered */
+} rd_kafka_op_cache;
 
-	if (rko) {
-		TAILQ_REMOVE(&rkq->rkq_q, rko, rko_link);
-		(void)rd_atomic_sub(&rkq->rkq_qlen, 1);
-	}
+static pthread_key_t  rd_kafka_op_cache_key;
+static pthread_once_t rd_kafka_op_cache_once = PTHREAD_ONCE_INIT;
 
-	pthread_mutex_unlock(&rkq->rkq_lock);
 
-	return rko;
+/**
+ * Frees the thread's cached ops on thread exit.
+ */
+static void rd_kafka_op_cache_destroy (void *arg) {
+	rd_kafka_op_t *rko;
+
+	while ((rko = rd_kafka_op_cache.free)) {
+		rd_kafka_op_cache.free = rko->rko_link.tqe_next;
+		free(rko);
+	}
+	rd_kafka_op_cache.cnt = 0;
 }
 
+static void rd_kafka_op_cache_key_create (void) {
+	pthread_key_create(&rd_kafka_op_cache_key, rd_kafka_op_cache_destroy);
+}
 
 
 /**
- * Send an op back to the application.
- *
- * Locality: Kafka threads
+ * Refill the thread's cache with a batch of ops from the handle's pool.
  */
-static void rd_kafka_op_reply0 (rd_kafka_t *rk, rd_kafka_op_t *rko,
-				rd_kafka_op_type_t type,
-				rd_kafka_resp_err_t err, uint8_t compression,
-				void *payload, int len,
-				uint64_t offset_len) {
+static void rd_kafka_op_pool_get (rd_kafka_t *rk) {
+	rd_kafka_op_t *first, *last;
+	int cnt = 0;
+
+	pthread_mutex_lock(&rk->rk_op_pool.lock);
+	if (!(first = last = rk->rk_op_pool.free)) {
+		pthread_mutex_unlock(&rk->rk_op_pool.lock);
+		return;
+	}
+
+	while (++cnt < RD_KAFKA_OP_CACHE_BATCH && last->rko_link.tqe_next)
+		last = last->rko_link.tqe_next;
+
+	rk->rk_op_pool.free = last->rko_link.tqe_next;
+	rk->rk_op_pool.cnt -= cnt;
+	pthread_mutex_unlock(&rk->rk_op_pool.lock);
+
+	last->rko_link.tqe_next = rd_kafka_op_cache.free;
+	rd_kafka_op_cache.free = first;
+	rd_kafka_op_cache.cnt += cnt;
+}
+
+
+/**
+ * Move a batch of ops from the thread's cache to the handle's pool,
+ * or free them if the pool is full.
+ */
+static void rd_kafka_op_pool_put (rd_kafka_t *rk) {
+	rd_kafka_op_t *first, *last;
+	int cnt = 1;
+
+	first = last = rd_kafka_op_cache.free;
+	while (cnt < RD_KAFKA_OP_CACHE_BATCH && last->rko_link.tqe_next) {
+		last = last->rko_link.tqe_next;
+		cnt++;
+	}
+
+	rd_kafka_op_cache.free = last->rko_link.tqe_next;
+	rd_kafka_op_cache.cnt -= cnt;
+
+	pthread_mutex_lock(&rk->rk_op_pool.lock);
+	if (rk->rk_op_pool.cnt + cnt <= rk->rk_conf.op_pool_max) {
+		last->rko_link.tqe_next = rk->rk_op_pool.free;
+		rk->rk_op_pool.free = first;
+		rk->rk_op_pool.cnt += cnt;
+		first = NULL;
+	}
+	pthread_mutex_unlock(&rk->rk_op_pool.lock);
+
+	if (first) {
+		last->rko_link.tqe_next = NULL;
+		while ((last = first)) {
+			first = first->rko_link.tqe_next;
+			free(last);
+		}
+	}
+}
+
+
+/**
+ * Returns a new zeroed op.
+ *
+ * Locality: any thread
+ */
+static rd_kafka_op_t *rd_kafka_op_new (rd_kafka_t *rk) {
+	rd_kafka_op_t *rko;
+
+	if (!rd_kafka_op_cache.free && rk->rk_op_pool.cnt > 0)
+		rd_kafka_op_pool_get(rk);
+
+	if (!(rko = rd_kafka_op_cache.free)) {
+		(void)rd_atomic_add(&rk->rk_op_pool.misses, 1);
+		return calloc(1, sizeof(*rko));
+	}
+
+	rd_kafka_op_cache.free = rko->rko_link.tqe_next;
+	rd_kafka_op_cache.cnt--;
+	(void)rd_atomic_add(&rk->rk_op_pool.hits, 1);
+
+	memset(rko, 0, sizeof(*rko));
+	return rko;
+}
+
+
+/**
+ * Returns an op to the thread's cache.
+ *
+ * Locality: any thread
+ */
+static void rd_kafka_op_free (rd_kafka_t *rk, rd_kafka_op_t *rko) {
+
+	if (!rk->rk_conf.op_pool_max) {
+		free(rko);
+		return;
+	}
+
+	if (unlikely(!rd_kafka_op_cache.registered)) {
+		pthread_once(&rd_kafka_op_cache_once,
+			     rd_kafka_op_cache_key_create);
+		pthread_setspecific(rd_kafka_op_cache_key, &rd_kafka_op_cache);
+		rd_kafka_op_cache.registered = 1;
+	}
+
+	rko->rko_link.tqe_next = rd_kafka_op_cache.free;
+	rd_kafka_op_cache.free = rko;
+
+	if (++rd_kafka_op_cache.cnt > RD_KAFKA_OP_CACHE_MAX)
+		rd_kafka_op_pool_put(rk);
+}
+
+
+void rd_kafka_op_destroy (rd_kafka_t *rk, rd_kafka_op_t *rko) {
+	
+	if (rko->rko_topic && rko->rko_flags & RD_KAFKA_OP_F_FREE_TOPIC)
+		free(rko->rko_topic);
+
+	if (rko->rko_payload) {
+		if (rko->rko_flags & RD_KAFKA_OP_F_FREE)
+			free(rko->rko_payload);
+		else if (rko->rko_flags & RD_KAFKA_OP_F_FREE_CB &&
+			 rko->rko_free_cb)
+			rko->rko_free_cb(rk->rk_parent ? : rk,
+					 rko->rko_payload, rko->rko_len,
+					 rko->rko_opaque);
+	}
+	
+	rd_kafka_op_free(rk, rko);
+}
+
+
+/**
+ * Reserve room for 'cnt' more iovecs at the tail of the output buffer.
+ * Returns the first of them for the caller to fill in and queue with
+ * rd_kafka_obuf_commit(). Earlier pointers into the ring are invalidated.
+ *
+ * Locality: Kafka thread
+ */
+static struct iovec *rd_kafka_obuf_reserve (rd_kafka_obuf_t *rkob, int cnt) {
+	if (rkob->rkob_head + rkob->rkob_cnt + cnt > rkob->rkob_size) {
+		/* Compact: move the unwritten iovecs to the front. */
+		if (rkob->rkob_head > 0) {
+			memmove(rkob->rkob_iov,
+				rkob->rkob_iov + rkob->rkob_head,
+				sizeof(*rkob->rkob_iov) * rkob->rkob_cnt);
+			rkob->rkob_head = 0;
+		}
+
+		if (rkob->rkob_cnt + cnt > rkob->rkob_size) {
+			rkob->rkob_size = RD_MAX(rkob->rkob_size * 2,
+						 rkob->rkob_cnt + cnt);
+			rkob->rkob_iov = realloc(rkob->rkob_iov,
+						 sizeof(*rkob->rkob_iov) *
+						 rkob->rkob_size);
+		}
+	}
+
+	return rkob->rkob_iov + rkob->rkob_head + rkob->rkob_cnt;
+}
+
+
+/**
+ * Queue the first 'cnt' of the reserved iovecs, holding 'len' bytes.
+ * The memory they reference must stay put until written.
+ *
+ * Locality: Kafka thread
+ */
+static inline void rd_kafka_obuf_commit (rd_kafka_obuf_t *rkob,
+					 int cnt, size_t len) {
+	rkob->rkob_cnt += cnt;
+	rkob->rkob_queued += len;
+}
+
+
+/**
+ * Queue a single buffer.
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_obuf_push (rd_kafka_obuf_t *rkob,
+				void *ptr, size_t len) {
+	struct iovec *iov = rd_kafka_obuf_reserve(rkob, 1);
+
+	iov->iov_base = ptr;
+	iov->iov_len  = len;
+	rd_kafka_obuf_commit(rkob, 1, len);
+}
+
+
+/**
+ * Drop whatever is left unwritten, i.e., when the connection is gone.
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_obuf_reset (rd_kafka_obuf_t *rkob) {
+	rkob->rkob_head = 0;
+	rkob->rkob_cnt = 0;
+	rkob->rkob_off = 0;
+	rkob->rkob_queued = rkob->rkob_written;
+}
+
+
+/**
+ * Write out the output buffer to the broker, resuming after partial
+ * writes, with rkob_cnt iovecs (which may be more than IOV_MAX) left.
+ * With MSG_DONTWAIT in 'flags' this returns when the socket buffer is
+ * full, else it blocks until everything is written.
+ * Returns 1 once the buffer is empty, 0 if a non-blocking write would
+ * block, or -1 on failure (the connection is torn down).
+ *
+ * Locality: Kafka thread
+ */
+static int rd_kafka_obuf_write (rd_kafka_t *rk, int flags) {
+	rd_kafka_obuf_t *rkob = &rk->rk_broker.obuf;
+	struct msghdr msg = {};
+	ssize_t r;
+
+	while (rkob->rkob_cnt > 0) {
+		struct iovec *iov = rkob->rkob_iov + rkob->rkob_head;
+
+		/* Apply the offset cursor to the head iovec for the
+		 * duration of the write, the ring itself is left as is. */
+		iov->iov_base = (char *)iov->iov_base + rkob->rkob_off;
+		iov->iov_len -= rkob->rkob_off;
+
+		msg.msg_iov = iov;
+		msg.msg_iovlen = RD_MIN(rkob->rkob_cnt, IOV_MAX);
+		r = sendmsg(rk->rk_broker.s, &msg, flags|MSG_NOSIGNAL);
+
+		iov->iov_base = (char *)iov->iov_base - rkob->rkob_off;
+		iov->iov_len += rkob->rkob_off;
+
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if ((flags & MSG_DONTWAIT) &&
+			    (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 0;
+			rd_kafka_fail(rk, "Send failed: %s", strerror(errno));
+			return -1;
+		}
+
+		rk->rk_broker.stats.tx_bytes += r;
+		rk->rk_broker.stats.tx++;
+		rkob->rkob_written += r;
+
+		/* Move the cursor past what was written. */
+		r += rkob->rkob_off;
+		while (rkob->rkob_cnt > 0 && r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			rkob->rkob_head++;
+			rkob->rkob_cnt--;
+		}
+		rkob->rkob_off = r;
+	}
+
+	rkob->rkob_head = 0;
+
+	return 1;
+}
+
+
+#define RD_KAFKA_SEND_END -1
+
+/**
+ * Send a request made up of the request header, 'topicpart' and the
+ * size+pointer pairs that follow, terminated by RD_KAFKA_SEND_END.
+ * Blocks until the request is written.
+ *
+ * Locality: Kafka thread
+ */
+static int rd_kafka_send_request (rd_kafka_t *rk,
+				  uint16_t msgtype,
+				  struct rd_kafkap_topicpart *topicpart,
+				  ...) {
+	rd_kafka_obuf_t *rkob = &rk->rk_broker.obuf;
+	va_list ap;
+	int sz;
+	void *ptr;
+	struct rd_kafkap_req req = {
+	rkpr_type: htons(msgtype),
+	};
+	int len = sizeof(req) - sizeof(req.rkpr_len) + topicpart->rkptp_len;
+
+	rd_kafka_obuf_push(rkob, &req, sizeof(req));
+	rd_kafka_obuf_push(rkob, topicpart->rkptp_buf, topicpart->rkptp_len);
+
+	va_start(ap, topicpart);
+	while ((sz = va_arg(ap, int)) != RD_KAFKA_SEND_END) {
+		ptr = va_arg(ap, void *);
+		rd_kafka_obuf_push(rkob, ptr, sz);
+		len += sz;
+	}
+	va_end(ap);
+
+	req.rkpr_len = htonl(len);
+	req.rkpr_topic_len = htons(topicpart->rkptp_len - 4);
+
+	if (rd_kafka_obuf_write(rk, 0) == -1)
+		return -1;
+
+	return 0;
+}
+
+
+/**
+ * Serialize a topic+partition combo into a temporary buffer.
+ */
+static struct rd_kafkap_topicpart *
+rd_kafka_topicpart_serialize (const char *topic, uint32_t partition) {
+	static __thread union {
+		struct rd_kafkap_topicpart topicpart;
+		char buf[sizeof(struct rd_kafkap_topicpart) +
+			 RD_KAFKA_TOPIC_MAXLEN + sizeof(partition)];
+	} u;
+	int len;
+
+	len = strlen(topic);
+	if (len > RD_KAFKA_TOPIC_MAXLEN) {
+		/* This may look silly, but it saves us from mallocs,
+		 * and it should suffice for most uses, if not, increase it! */
+		fprintf(stderr,
+			"RD-KAFKA-FIXME: Topic name (%s) is too long (max %i),"
+			" will truncate it (increase in rdkafka.h)\n",
+		       topic, RD_KAFKA_TOPIC_MAXLEN);
+		len = RD_KAFKA_TOPIC_MAXLEN;
+	}
+
+	partition = htonl(partition);
+	
+	memcpy(u.topicpart.rkptp_buf, topic, len);
+	memcpy(u.topicpart.rkptp_buf+len, &partition, sizeof(partition));
+	u.topicpart.rkptp_len = len + sizeof(partition);
+
+	return &u.topicpart;
+}
+
+
+/**
+ * Op queues.
+ *
+ * Producers (rd_kafka_q_enq()) push ops lock-free on the 'rkq_lifo'
+ * stack. Consumers grab the entire stack with a single exchange and
+ * move it, in enqueue order, to the consumer-side 'rkq_q' list.
+ * 'rkq_lock' only serializes consumers (there is usually one) and
+ * is never taken by producers.
+ *
+ * rkq_qlen is incremented before an op is pushed and decremented when
+ * it is dequeued, so it never under-counts. Idle consumers park on the
+ * wake sequence rkq_wseq after spinning briefly: a producer bumps it
+ * and wakes them only on the empty to non-empty transition, and only
+ * if a consumer is parked; rd_kafka_q_yield() bumps it too.
+ */
+#define RD_KAFKA_Q_SPIN  200  /* Spin iterations before parking */
+
+static void rd_kafka_q_init (rd_kafka_q_t *rkq) {
+	TAILQ_INIT(&rkq->rkq_q);
+	rkq->rkq_lifo = NULL;
+	rkq->rkq_qcnt = 0;
+	rkq->rkq_qlen = 0;
+	rkq->rkq_waiters = 0;
+	rkq->rkq_wseq = 0;
+	rkq->rkq_yield = 0;
+	rkq->rkq_efd = -1;
+	
+	pthread_mutex_init(&rkq->rkq_lock, NULL);
+}
+
+
+/**
+ * Signals the eventfd 'efd'.
+ */
+static inline void rd_kafka_efd_signal (int efd) {
+	uint64_t one = 1;
+	int r RD_UNUSED;
+
+	r = write(efd, &one, sizeof(one));
+}
+
+
+/**
+ * Clears the (non-blocking) eventfd 'efd'.
+ */
+static inline void rd_kafka_efd_clear (int efd) {
+	uint64_t cnt;
+	int r RD_UNUSED;
+
+	r = read(efd, &cnt, sizeof(cnt));
+}
+
+
+/**
+ * Bump the wake sequence and wake up the consumers parked on it.
+ */
+static inline void rd_kafka_q_wake0 (rd_kafka_q_t *rkq) {
+	(void)rd_atomic_add(&rkq->rkq_wseq, 1);
+	rd_futex_wake(&rkq->rkq_wseq);
+}
+
+
+/**
+ * Wake up parked consumers if the queue just became non-empty.
+ * 'prev' is the queue length prior to adding ops.
+ * A consumer that does not park (an I/O thread) is signalled through
+ * rkq_efd instead.
+ */
+static inline void rd_kafka_q_wake (rd_kafka_q_t *rkq, int prev) {
+	/* The full barriers of the rkq_qlen and rkq_waiters atomic updates
+	 * make sure either we see the waiter or it sees the new qlen. */
+	if (prev == 0 && rkq->rkq_waiters > 0)
+		rd_kafka_q_wake0(rkq);
+	if (prev == 0 && rkq->rkq_efd != -1)
+		rd_kafka_efd_signal(rkq->rkq_efd);
+}
+
+
+/**
+ * Enqueue 'cnt' ops at the tail of the queue 'rkq' in one operation.
+ * The ops are linked through rko_link.tqe_next in reverse order:
+ * from the last op, 'newest', to the first op, 'oldest'.
+ *
+ * Locality: any thread.
+ */
+static inline void rd_kafka_q_enq_list (rd_kafka_q_t *rkq,
+					rd_kafka_op_t *newest,
+					rd_kafka_op_t *oldest, int cnt) {
+	rd_kafka_op_t *head;
+	int prev;
+
+	prev = rd_atomic_add_prev(&rkq->rkq_qlen, cnt);
+
+	do {
+		head = rkq->rkq_lifo;
+		oldest->rko_link.tqe_next = head;
+	} while (!__sync_bool_compare_and_swap(&rkq->rkq_lifo, head, newest));
+
+	rd_kafka_q_wake(rkq, prev);
+}
+
+
+/**
+ * Enqueue the 'rko' op at the tail of the queue 'rkq'.
+ *
+ * Locality: any thread.
+ */
+static inline void rd_kafka_q_enq (rd_kafka_q_t *rkq, rd_kafka_op_t *rko) {
+	rd_kafka_q_enq_list(rkq, rko, rko, 1);
+}
+
+
+/**
+ * Move all pushed ops to the consumer-side list, in enqueue order.
+ *
+ * Locality: consumer, rkq_lock held.
+ */
+static void rd_kafka_q_grab (rd_kafka_q_t *rkq) {
+	struct rd_kafka_op_head_s tmpq = TAILQ_HEAD_INITIALIZER(tmpq);
+	rd_kafka_op_t *rko, *next;
+
+	if (!rkq->rkq_lifo)
+		return;
+
+	/* The stack is in reverse order: insert each op at the head. */
+	rko = __sync_lock_test_and_set(&rkq->rkq_lifo, NULL);
+	for ( ; rko ; rko = next) {
+		next = rko->rko_link.tqe_next;
+		TAILQ_INSERT_HEAD(&tmpq, rko, rko_link);
+		rkq->rkq_qcnt++;
+	}
+
+	TAILQ_CONCAT(&rkq->rkq_q, &tmpq, rko_link);
+}
+
+
+/**
+ * Converts a relative 'timeout_ms' to an absolute timeout for
+ * rd_kafka_q_wait(), RD_POLL_INFINITE and RD_POLL_NOWAIT are retained.
+ */
+static inline rd_ts_t rd_kafka_q_abs_timeout (int timeout_ms) {
+	if (timeout_ms == RD_POLL_INFINITE || timeout_ms == RD_POLL_NOWAIT)
+		return timeout_ms;
+	return rd_clock() + (timeout_ms * 1000);
+}
+
+
+/**
+ * Wait for the queue to become non-empty, spinning briefly before
+ * parking, until 'abs_timeout' (see rd_kafka_q_abs_timeout()).
+ * Returns 1 if there are ops in the queue, or 0 on timeout or if the
+ * wait was interrupted by rd_kafka_q_yield().
+ *
+ * Locality: consumer
+ */
+static int rd_kafka_q_wait (rd_kafka_q_t *rkq, rd_ts_t abs_timeout) {
+	int spins = 0;
+
+	while (rkq->rkq_qlen == 0) {
+		int timeout_ms = RD_POLL_INFINITE;
+		int wseq;
+
+		if (rkq->rkq_yield) {
+			rkq->rkq_yield = 0;
+			return 0;
+		}
+
+		if (abs_timeout == RD_POLL_NOWAIT)
+			return 0;
+
+		if (spins++ < RD_KAFKA_Q_SPIN) {
+			rd_cpu_relax();
+			continue;
+		}
+
+		if (abs_timeout != RD_POLL_INFINITE) {
+			rd_ts_t now = rd_clock();
+			if (now >= abs_timeout)
+				return 0;
+			timeout_ms = (abs_timeout - now + 999) / 1000;
+		}
+
+		/* The wake sequence is read before registering, and the
+		 * queue and yield flag checked again after: a wakeup or
+		 * yield in between changes rkq_wseq and the wait returns
+		 * at once. */
+		wseq = rkq->rkq_wseq;
+		(void)rd_atomic_add(&rkq->rkq_waiters, 1);
+		if (rkq->rkq_qlen == 0 && !rkq->rkq_yield)
+			rd_futex_wait_ms(&rkq->rkq_wseq, wseq, timeout_ms);
+		(void)rd_atomic_sub(&rkq->rkq_waiters, 1);
+	}
+
+	return 1;
+}
+
+
+/**
+ * Interrupt a consumer waiting on the queue, or the next one to wait,
+ * making it return as on timeout.
+ *
+ * Locality: any thread.
+ */
+static void rd_kafka_q_yield (rd_kafka_q_t *rkq) {
+	rkq->rkq_yield = 1;
+	rd_kafka_q_wake0(rkq);
+	if (rkq->rkq_efd != -1)
+		rd_kafka_efd_signal(rkq->rkq_efd);
+}
+
+
+/**
+ * Back off while an op is counted in rkq_qlen but not yet visible,
+ * i.e., its producer is between the two steps of rd_kafka_q_enq().
+ */
+static inline void rd_kafka_q_backoff (int *spinsp) {
+	if ((*spinsp)++ < RD_KAFKA_Q_SPIN)
+		rd_cpu_relax();
+	else
+		sched_yield();
+}
+
+
+/**
+ * Pop an op from a queue.
+ *
+ * Locality: any thread.
+ */
+static rd_kafka_op_t *rd_kafka_q_pop (rd_kafka_q_t *rkq, int timeout_ms) {
+	rd_ts_t abs_timeout = rd_kafka_q_abs_timeout(timeout_ms);
+	rd_kafka_op_t *rko;
+	int spins = 0;
+
+	while (rd_kafka_q_wait(rkq, abs_timeout)) {
+		pthread_mutex_lock(&rkq->rkq_lock);
+		if (!(rko = TAILQ_FIRST(&rkq->rkq_q))) {
+			rd_kafka_q_grab(rkq);
+			rko = TAILQ_FIRST(&rkq->rkq_q);
+		}
+		if (rko) {
+			TAILQ_REMOVE(&rkq->rkq_q, rko, rko_link);
+			rkq->rkq_qcnt--;
+			(void)rd_atomic_sub(&rkq->rkq_qlen, 1);
+		}
+		pthread_mutex_unlock(&rkq->rkq_lock);
+
+		if (rko)
+			return rko;
+
+		/* Not yet pushed by its producer,
+		 * or taken by another consumer: retry. */
+		rd_kafka_q_backoff(&spins);
+	}
+
+	return NULL;
+}
+
+
+int rd_kafka_q_drain (rd_kafka_q_t *rkq, struct rd_kafka_op_head_s *rkoq,
+		      int timeout_ms) {
+	rd_ts_t abs_timeout = rd_kafka_q_abs_timeout(timeout_ms);
+	int spins = 0;
+	int cnt;
+
+	while (rd_kafka_q_wait(rkq, abs_timeout)) {
+		pthread_mutex_lock(&rkq->rkq_lock);
+		rd_kafka_q_grab(rkq);
+		if ((cnt = rkq->rkq_qcnt) > 0) {
+			TAILQ_CONCAT(rkoq, &rkq->rkq_q, rko_link);
+			rkq->rkq_qcnt = 0;
+			(void)rd_atomic_sub(&rkq->rkq_qlen, cnt);
+		}
+		pthread_mutex_unlock(&rkq->rkq_lock);
+
+		if (cnt > 0)
+			return cnt;
+
+		rd_kafka_q_backoff(&spins);
+	}
+
+	return 0;
+}
+
+
+/**
+ * Moves up to 'max' ops from the head of the queue to the tail of
+ * 'rkoq', without waiting.
+ * Returns the number of ops moved.
+ *
+ * Locality: any thread
+ */
+static int rd_kafka_q_steal (rd_kafka_q_t *rkq,
+			     struct rd_kafka_op_head_s *rkoq, int max) {
+	rd_kafka_op_t *rko;
+	int cnt = 0;
+
+	pthread_mutex_lock(&rkq->rkq_lock);
+	rd_kafka_q_grab(rkq);
+	while (cnt < max && (rko = TAILQ_FIRST(&rkq->rkq_q))) {
+		TAILQ_REMOVE(&rkq->rkq_q, rko, rko_link);
+		TAILQ_INSERT_TAIL(rkoq, rko, rko_link);
+		cnt++;
+	}
+	if (cnt > 0) {
+		rkq->rkq_qcnt -= cnt;
+		(void)rd_atomic_sub(&rkq->rkq_qlen, cnt);
+	}
+	pthread_mutex_unlock(&rkq->rkq_lock);
+
+	return cnt;
+}
+
+
+/**
+ * Put the 'cnt' ops in 'rkoq' back at the head of the queue 'rkq',
+ * in order. 'rkoq' is left empty.
+ *
+ * Locality: any thread.
+ */
+static void rd_kafka_q_prepend (rd_kafka_q_t *rkq,
+				struct rd_kafka_op_head_s *rkoq, int cnt) {
+	int prev;
+
+	pthread_mutex_lock(&rkq->rkq_lock);
+	TAILQ_CONCAT(rkoq, &rkq->rkq_q, rko_link);
+	TAILQ_CONCAT(&rkq->rkq_q, rkoq, rko_link);
+	rkq->rkq_qcnt += cnt;
+	prev = rd_atomic_add_prev(&rkq->rkq_qlen, cnt);
+	pthread_mutex_unlock(&rkq->rkq_lock);
+
+	rd_kafka_q_wake(rkq, prev);
+}
+
+
+
+/**
+ * Send an op back to the application.
+ *
+ * Locality: Kafka threads
+ */
+static void rd_kafka_op_reply0 (rd_kafka_t *rk, rd_kafka_op_t *rko,
+				rd_kafka_op_type_t type,
+				rd_kafka_resp_err_t err, uint8_t compression,
+				void *payload, int len,
+				uint64_t offset_len) {
 
 	rko->rko_type        = type;
 	rko->rko_flags      |= RD_KAFKA_OP_F_FREE;
@@ -615,408 +1526,1588 @@ static void rd_kafka_op_reply0 (rd_kafka_t *rk, rd_kafka_op_t *rko,
 
 
 /**
- * Send an op back to the application.
+ * Send an op back to the application.
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_op_reply (rd_kafka_t *rk,
+			       rd_kafka_op_type_t type,
+			       rd_kafka_resp_err_t err, uint8_t compression,
+			       void *payload, int len,
+			       uint64_t offset_len) {
+	rd_kafka_op_t *rko;
+
+	rko = rd_kafka_op_new(rk);
+
+	if (err && !payload) {
+		/* Provide human readable error string if not provided. */
+
+		/* Provide more info for some errors. */
+		if (err == RD_KAFKA_RESP_ERR_OFFSET_OUT_OF_RANGE)
+			payload =
+				strdup(rd_tsprintf("%s (%"PRIu64")",
+						   rd_kafka_err2str(err),
+						   rk->rk_consumer.offset));
+		else
+			payload = strdup(rd_kafka_err2str(err));
+
+		len = strlen(payload);
+	}
+
+	rd_kafka_op_reply0(rk, rko, type, err, compression,
+			   payload, len, offset_len);
+
+	/* A connection's replies go to the handle the application knows. */
+	rd_kafka_q_enq(&(rk->rk_parent ? : rk)->rk_rep, rko);
+}
+
+
+
+
+/**
+ * Receive and purge data.
+ */
+static void rd_kafka_recv_null (rd_kafka_t *rk, int total_len) {
+	char buf[256];
+
+	while (total_len > 0) {
+		int len = total_len < sizeof(buf) ? total_len : sizeof(buf);
+		int r;
+
+		if ((r = recv(rk->rk_broker.s, buf, len, MSG_DONTWAIT)) < 1)
+			return;
+
+		total_len -= r;
+	}
+}
+
+
+/**
+ * Read data from socket.
+ */
+static int rd_kafka_recv0 (rd_kafka_t *rk, const char *what,
+			   void *data, int len, int partial_ok) {
+	int r;
+
+	if ((r = recv(rk->rk_broker.s, data, len,
+		      partial_ok ? 0 : MSG_WAITALL)) != len) {
+		if (r > 0) {
+			if (partial_ok)
+				return r;
+			else
+				rd_kafka_fail(rk, "Partial %s response "
+					      "(%i<%i bytes)",
+					      what, r, len);
+		} else if (r == 0)
+			rd_kafka_fail(rk, "No more data while expecting %s "
+				      "(%i bytes)", what, len);
+		else
+			rd_kafka_fail(rk, "Failed to recv %i bytes for %s: %s",
+				      len, what, strerror(errno));
+		return -1;
+	}
+
+	return r;
+}
+
+
+/**
+ * Parse a single message from buf and passes it to the application.
+ * 'rko' is optional and will be used, without enqueuing, instead of
+ * creating and enqueuing a new op, if non-NULL.
+ *
+ * 'offset' is the op's rko_offset: the offset following the message,
+ * or 0 if the application offset should not be advanced by it.
+ *
+ * Returns -1 on failure or the consumed data length on success.
+ */
+static int rd_kafka_msg_parse (rd_kafka_t *rk, char *buf, int len,
+			       rd_kafka_op_t *rko, uint64_t offset) {
+	struct rd_kafkap_msg *msg;
+	rd_kafka_resp_err_t err = 0;
+	char *payload = NULL;
+	int msglen = 0;
+	int r = -1;
+
+	msg = (struct rd_kafkap_msg *)buf;
+
+	if (len < sizeof(*msg) ||
+	    (msglen = ntohl(msg->rkpm_len)) <
+	    sizeof(*msg) - sizeof(msg->rkpm_len) ||
+	    msglen > len - sizeof(msg->rkpm_len)) {
+		/* Formatting error. */
+		err = RD_KAFKA_RESP_ERR__BAD_MSG;
+		msglen = 0;
+	} else {
+		r = msglen + sizeof(msg->rkpm_len);
+		msglen -= sizeof(*msg) - sizeof(msg->rkpm_len);
+
+		payload = malloc(msglen);
+		memcpy(payload, msg+1, msglen);
+	}
+
+	if (rko)
+		rd_kafka_op_reply0(rk, rko, RD_KAFKA_OP_FETCH, err,
+				   err ? 0 : msg->rkpm_compression,
+				   payload, msglen, offset);
+	else
+		rd_kafka_op_reply(rk, RD_KAFKA_OP_FETCH, err,
+				  err ? 0 : msg->rkpm_compression,
+				  payload, msglen, offset);
+
+	return r;
+}
+
+
+/**
+ * Decompress a compressed (wrapper) message's payload.
+ * Returns the malloc()ed message set with its length in '*declenp',
+ * or NULL on failure.
+ */
+static char *rd_kafka_decompress (rd_kafka_t *rk, int compression,
+				  const char *payload, int len,
+				  uint64_t *declenp) {
+	char *buf;
+
+	*declenp = 0;
+
+	switch (compression)
+	{
+	case RD_KAFKAP_MSG_COMPRESSION_GZIP:
+		if (!(buf = rd_gz_decompress((void *)payload, len, declenp)))
+			rd_kafka_log(rk, LOG_WARNING, "GUNZIP",
+				     "GZ-decompression of %i bytes failed for "
+				     "message payload", len);
+		return buf;
+
+	case RD_KAFKAP_MSG_COMPRESSION_SNAPPY:
+		if (!(buf = rd_snappy_decompress(payload, len, declenp)))
+			rd_kafka_log(rk, LOG_WARNING, "UNSNAPPY",
+				     "Snappy-decompression of %i bytes failed "
+				     "for message payload", len);
+		return buf;
+
+	default:
+		rd_kafka_log(rk, LOG_WARNING, "INFLATE",
+			     "Unknown compression type %i: "
+			     "dropping message", compression);
+		return NULL;
+	}
+}
+
+
+/**
+ * Decompress a received wrapper message and pass its messages
+ * to the application, in order.
+ * The application offset is advanced to 'offset' (following the wrapper
+ * message) by the last message only, since messages within a
+ * compressed message set are not individually addressable.
+ *
+ * Returns the number of reply ops created.
+ *
+ * Locality: Kafka thread
+ */
+static int rd_kafka_recv_inflate (rd_kafka_t *rk, int compression,
+				  const char *payload, int len,
+				  uint64_t offset) {
+	uint64_t declen;
+	char *buf, *origbuf;
+	int replycnt = 0;
+
+	if (!(origbuf = rd_kafka_decompress(rk, compression, payload, len,
+					    &declen))) {
+		rd_kafka_op_reply(rk, RD_KAFKA_OP_FETCH,
+				  RD_KAFKA_RESP_ERR__BAD_COMPRESSION, 0,
+				  NULL, 0, offset);
+		return 1;
+	}
+
+	buf = origbuf;
+	len = declen;
+
+	while (len > 0) {
+		uint32_t msglen;
+		int r;
+
+		if (len >= sizeof(msglen)) {
+			memcpy(&msglen, buf, sizeof(msglen));
+			msglen = ntohl(msglen) + sizeof(msglen);
+		} else
+			msglen = len;
+
+		replycnt++;
+
+		/* Message formatting errors are serious, we cant
+		 * decode the rest of the buffer now. */
+		if ((r = rd_kafka_msg_parse(rk, buf, len, NULL,
+					    msglen >= len ?
+					    offset : 0)) == -1)
+			break;
+
+		len -= r;
+		buf += r;
+	}
+
+	free(origbuf);
+
+	return replycnt;
+}
+
+
+
+/**
+ * Receive an entire message from the broker.
+ *
+ * Returns the number of data reply ops created.
+ *
+ * Locality: Kafka thread
+ */
+static int rd_kafka_recv (rd_kafka_t *rk) {
+	struct rd_kafkap_resp resp;
+	int replycnt = 0;
+
+	if (rd_kafka_recv0(rk, "response header",
+			   &resp, sizeof(resp), 0) == -1)
+		return 0;
+
+	resp.rkprp_len = ntohl(resp.rkprp_len);
+	resp.rkprp_error = ntohs(resp.rkprp_error);
+
+	/* Error from broker? */
+	if (resp.rkprp_error != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		rd_kafka_op_reply(rk, RD_KAFKA_OP_FETCH, resp.rkprp_error, 0,
+				  NULL, 0, 0);
+		/* Consume remaining buffer */
+		if (resp.rkprp_len)
+			rd_kafka_recv_null(rk, resp.rkprp_len - 4);
+		return 0;
+	}
+
+	if (resp.rkprp_len < sizeof(resp.rkprp_error) ||
+	    resp.rkprp_len > rk->rk_conf.max_msg_size) {
+		rd_kafka_fail(rk, "Invalid (or too long) response length %lu",
+			      resp.rkprp_len);
+		return 0;
+	}
+
+	resp.rkprp_len -= sizeof(resp.rkprp_error);
+
+	/* Start chewing off messages, send one op back to application
+	 * for each message parsed. */
+	while (resp.rkprp_len >= sizeof(struct rd_kafkap_msg)) {
+		struct rd_kafkap_msg msg;
+		char *buf;
+		
+		/* Transmissions may be terminated mid-message, this is
+		 * a soft-error that should be ignored and the client
+		 * should try again at a later offset. */
+		if (rd_kafka_recv0(rk, "message",
+				   &msg, sizeof(msg), 0) == -1)
+			return replycnt;
+
+		msg.rkpm_len = ntohl(msg.rkpm_len);
+		resp.rkprp_len -= sizeof(msg);
+
+		if (msg.rkpm_len < sizeof(msg) - sizeof(msg.rkpm_len))
+			return replycnt;
+
+		if (msg.rkpm_len > rk->rk_conf.max_msg_size) {
+			rd_kafka_fail(rk, "Invalid (or too long) response "
+				      "message length %lu",
+				      msg.rkpm_len);
+			return replycnt;
+		}
+
+		msg.rkpm_len -= sizeof(msg) - 4;
+
+		if (msg.rkpm_len > resp.rkprp_len) {
+			/* Partial message, drop it. */
+			if (resp.rkprp_len)
+				rd_kafka_recv_null(rk, resp.rkprp_len);
+			return replycnt;
+		}
+
+		/*
+		 * Message payload
+		 */
+		resp.rkprp_len -= msg.rkpm_len;
+
+		buf = malloc(msg.rkpm_len);
+		
+		if (rd_kafka_recv0(rk, "message payload",
+				   buf, msg.rkpm_len, 0) == -1) {
+			free(buf);
+			return replycnt;
+		}
+
+		rk->rk_consumer.offset += msg.rkpm_len + sizeof(msg);
+
+		if (msg.rkpm_compression != RD_KAFKAP_MSG_COMPRESSION_NONE) {
+			replycnt += rd_kafka_recv_inflate(rk,
+							  msg.rkpm_compression,
+							  buf, msg.rkpm_len,
+							  rk->rk_consumer.offset);
+			free(buf);
+			continue;
+		}
+
+		rd_kafka_op_reply(rk, RD_KAFKA_OP_FETCH, 0,
+				  msg.rkpm_compression,
+				  buf, msg.rkpm_len, rk->rk_consumer.offset);
+
+		replycnt++;
+	}
+
+	/* Drop padding */
+	if (resp.rkprp_len > 0)
+		rd_kafka_recv_null(rk, resp.rkprp_len);
+
+	return replycnt;
+}
+
+
+
+
+/**
+ * One topic+partition's message set in a produce batch.
+ * Messages are added with rd_kafka_mset_add() which builds each
+ * message's protocol header as it goes.
+ */
+typedef struct rd_kafka_mset_s {
+	rd_kafka_topic_t         *rkms_rkt;
+	uint32_t                  rkms_partition;
+	rd_kafka_topic_part_t    *rkms_part;    /* Header template */
+	struct rd_kafka_op_head_s rkms_ops;
+	int                       rkms_len;     /* Message set length */
+	int                       rkms_msgcnt;
+	int                       rkms_msgsize; /* rkms_msghdrs allocated */
+	struct rd_kafkap_msg     *rkms_msghdrs; /* One per op, in op order */
+	uint32_t                  rkms_msgs_len; /* Encoded MESSAGES_LEN,
+						  * follows rkms_part's hdr */
+	/* Compressed message set, sent as a single wrapper message. */
+	struct rd_kafkap_msg      rkms_wrapper;
+	char                     *rkms_cbuf;
+	size_t                    rkms_cbuf_size;
+	int                       rkms_clen;    /* 0 if not compressed */
+	rd_kafka_compression_t    rkms_codec;   /* Topic's compression codec */
+} rd_kafka_mset_t;
+
+
+/**
+ * Produce batch: the per topic+partition message sets that will make
+ * up the next (MULTI)PRODUCE request.
  *
  * Locality: Kafka thread
  */
-static void rd_kafka_op_reply (rd_kafka_t *rk,
-			       rd_kafka_op_type_t type,
-			       rd_kafka_resp_err_t err, uint8_t compression,
-			       void *payload, int len,
-			       uint64_t offset_len) {
+typedef struct rd_kafka_batch_s {
+	rd_kafka_mset_t     **rkb_msets;
+	int                   rkb_mset_cnt;   /* Message sets in use */
+	int                   rkb_mset_size;  /* Message sets allocated */
+	int                   rkb_msgcnt;
+	int                   rkb_len;        /* Total message set length */
+	rd_ts_t               rkb_ts_first;   /* First message added */
+	rd_gz_t              *rkb_gz;         /* Long-lived gzip compressor */
+	int                   rkb_gz_failed;  /* rkb_gz could not be set up */
+	char                 *rkb_sbuf;       /* Contiguous message set to */
+	size_t                rkb_sbuf_size;  /* feed the snappy compressor */
+	struct rd_kafkap_multireq rkb_req;    /* Request header */
+	uint64_t              rkb_req_end;    /* Request is written when the
+					       * output buffer's rkob_written
+					       * reaches this, 0: not built */
+	rd_ts_t               rkb_ts_req;     /* Request was built */
+} rd_kafka_batch_t;
+
+
+static void rd_kafka_batch_destroy (rd_kafka_batch_t *rkb) {
+	int i;
+
+	for (i = 0 ; i < rkb->rkb_mset_size ; i++) {
+		if (rkb->rkb_msets[i]->rkms_msghdrs)
+			free(rkb->rkb_msets[i]->rkms_msghdrs);
+		if (rkb->rkb_msets[i]->rkms_cbuf)
+			free(rkb->rkb_msets[i]->rkms_cbuf);
+		free(rkb->rkb_msets[i]);
+	}
+	if (rkb->rkb_msets)
+		free(rkb->rkb_msets);
+	if (rkb->rkb_gz)
+		rd_gz_destroy(rkb->rkb_gz);
+	if (rkb->rkb_sbuf)
+		free(rkb->rkb_sbuf);
+	free(rkb);
+}
+
+
+/**
+ * Returns the message set header template for 'partition' of 'rkt',
+ * setting it up on first use.
+ *
+ * Locality: Kafka thread
+ */
+static rd_kafka_topic_part_t *rd_kafka_topic_part_get0 (rd_kafka_topic_t *rkt,
+							uint32_t partition) {
+	rd_kafka_topic_part_t *rktp;
+	uint16_t topic_len;
+	uint32_t i;
+
+	if (partition >= rkt->rkt_part_cnt) {
+		rkt->rkt_parts = realloc(rkt->rkt_parts,
+					 sizeof(*rkt->rkt_parts) *
+					 (partition + 1));
+		for (i = rkt->rkt_part_cnt ; i <= partition ; i++)
+			rkt->rkt_parts[i] = NULL;
+		rkt->rkt_part_cnt = partition + 1;
+	}
+
+	if ((rktp = rkt->rkt_parts[partition]))
+		return rktp;
+
+	rktp = malloc(sizeof(*rktp));
+	topic_len = htons(rkt->rkt_topic_len);
+	memcpy(rktp->rktp_hdr, &topic_len, sizeof(topic_len));
+	memcpy(rktp->rktp_hdr+sizeof(topic_len),
+	       rkt->rkt_topic, rkt->rkt_topic_len);
+	partition = htonl(partition);
+	memcpy(rktp->rktp_hdr+sizeof(topic_len)+rkt->rkt_topic_len,
+	       &partition, sizeof(partition));
+	rktp->rktp_hdr_len = sizeof(topic_len) + rkt->rkt_topic_len +
+		sizeof(partition);
+
+	return (rkt->rkt_parts[ntohl(partition)] = rktp);
+}
+
+
+static rd_kafka_topic_part_t *rd_kafka_topic_part_get (rd_kafka_topic_t *rkt,
+						       uint32_t partition) {
+	rd_kafka_topic_part_t *rktp;
+
+	/* The topic is shared by the connections of its handle. */
+	pthread_mutex_lock(&rkt->rkt_rk->rk_lock);
+	rktp = rd_kafka_topic_part_get0(rkt, partition);
+	pthread_mutex_unlock(&rkt->rkt_rk->rk_lock);
+
+	return rktp;
+}
+
+
+/**
+ * Returns the batch's message set for 'rkt'+'partition',
+ * a new one is set up if not already in the batch.
+ */
+static rd_kafka_mset_t *rd_kafka_batch_mset_get (rd_kafka_batch_t *rkb,
+						 rd_kafka_topic_t *rkt,
+						 uint32_t partition) {
+	rd_kafka_mset_t *rkms;
+	int i;
+
+	/* Consecutive messages are likely to go to the same partition
+	 * so search backwards from the last added message set. */
+	for (i = rkb->rkb_mset_cnt - 1 ; i >= 0 ; i--) {
+		rkms = rkb->rkb_msets[i];
+		if (rkms->rkms_rkt == rkt && rkms->rkms_partition == partition)
+			return rkms;
+	}
+
+	if (rkb->rkb_mset_cnt == rkb->rkb_mset_size) {
+		rkb->rkb_mset_size = rkb->rkb_mset_size ?
+			rkb->rkb_mset_size * 2 : 8;
+		rkb->rkb_msets = realloc(rkb->rkb_msets,
+					 sizeof(*rkb->rkb_msets) *
+					 rkb->rkb_mset_size);
+		for (i = rkb->rkb_mset_cnt ; i < rkb->rkb_mset_size ; i++)
+			rkb->rkb_msets[i] = calloc(1, sizeof(*rkms));
+	}
+
+	rkms = rkb->rkb_msets[rkb->rkb_mset_cnt++];
+	rkms->rkms_rkt       = rkt;
+	rkms->rkms_partition = partition;
+	rkms->rkms_part      = rd_kafka_topic_part_get(rkt, partition);
+	rkms->rkms_len       = 0;
+	rkms->rkms_msgcnt    = 0;
+	rkms->rkms_codec     = rkt->rkt_compression;
+	TAILQ_INIT(&rkms->rkms_ops);
+
+	return rkms;
+}
+
+
+/**
+ * Append a PRODUCE op's message to the message set.
+ * Returns the message's length in the message set.
+ */
+static int rd_kafka_mset_add (rd_kafka_mset_t *rkms, rd_kafka_op_t *rko) {
+	struct rd_kafkap_msg *msg;
+
+	if (rkms->rkms_msgcnt == rkms->rkms_msgsize) {
+		rkms->rkms_msgsize = rkms->rkms_msgsize ?
+			rkms->rkms_msgsize * 2 : 64;
+		rkms->rkms_msghdrs = realloc(rkms->rkms_msghdrs,
+					     sizeof(*rkms->rkms_msghdrs) *
+					     rkms->rkms_msgsize);
+	}
+
+	msg = &rkms->rkms_msghdrs[rkms->rkms_msgcnt++];
+	msg->rkpm_len = htonl(sizeof(*msg) - sizeof(msg->rkpm_len) +
+			      rko->rko_len);
+	msg->rkpm_magic = RD_KAFKAP_MSG_MAGIC_COMPRESSION_ATTR;
+	msg->rkpm_compression = RD_KAFKAP_MSG_COMPRESSION_NONE;
+	/* Snappy message sets are copied for compression anyway,
+	 * their checksums are calculated while copying. */
+	if (rkms->rkms_codec != RD_KAFKA_COMPRESSION_SNAPPY)
+		msg->rkpm_cksum = htonl(rd_crc32(rko->rko_payload,
+						 rko->rko_len));
+
+	TAILQ_INSERT_TAIL(&rkms->rkms_ops, rko, rko_link);
+	rkms->rkms_len += sizeof(*msg) + rko->rko_len;
+
+	return sizeof(*msg) + rko->rko_len;
+}
+
+
+/**
+ * Add a PRODUCE op to the batch.
+ * Returns 1 if the batch is full after adding the op, else 0.
+ */
+static int rd_kafka_batch_add (rd_kafka_t *rk, rd_kafka_batch_t *rkb,
+			       rd_kafka_op_t *rko) {
+	rd_kafka_mset_t *rkms;
+
+	if (rkb->rkb_msgcnt == 0)
+		rkb->rkb_ts_first = rd_clock();
+
+	rkms = rd_kafka_batch_mset_get(rkb, rko->rko_rkt, rko->rko_partition);
+	rkb->rkb_len += rd_kafka_mset_add(rkms, rko);
+	rkb->rkb_msgcnt++;
+	(void)rd_atomic_add(&rk->rk_batch_msgcnt, 1);
+
+	return (rkb->rkb_msgcnt >= rk->rk_conf.producer.batch_msg_cnt ||
+		rkb->rkb_len >= rk->rk_conf.producer.batch_size);
+}
+
+
+/**
+ * Moves all ops in the batch to 'rkoq' (message set by message set)
+ * and resets the batch.
+ */
+static void rd_kafka_batch_purge (rd_kafka_t *rk, rd_kafka_batch_t *rkb,
+				  struct rd_kafka_op_head_s *rkoq) {
+	int i;
+
+	for (i = 0 ; i < rkb->rkb_mset_cnt ; i++)
+		TAILQ_CONCAT(rkoq, &rkb->rkb_msets[i]->rkms_ops, rko_link);
+
+	if (rkb->rkb_msgcnt > 0)
+		(void)rd_atomic_sub(&rk->rk_batch_msgcnt, rkb->rkb_msgcnt);
+	rkb->rkb_mset_cnt = 0;
+	rkb->rkb_msgcnt = 0;
+	rkb->rkb_len = 0;
+}
+
+
+/**
+ * Compress the message set into a single wrapper message using
+ * the message set's codec, with 'iov' as scratch space for the
+ * message set's iovecs.
+ * Returns 0 on success or -1 if the message set should be sent
+ * uncompressed.
+ *
+ * Locality: Kafka thread
+ */
+static int rd_kafka_mset_compress (rd_kafka_t *rk, rd_kafka_batch_t *rkb,
+				   rd_kafka_mset_t *rkms, struct iovec *iov) {
+	struct rd_kafkap_msg *msg = rkms->rkms_msghdrs;
 	rd_kafka_op_t *rko;
+	size_t size;
+	ssize_t r;
+	int iovcnt = 0;
 
-	rko = calloc(1, sizeof(*rko));
+	switch (rkms->rkms_codec)
+	{
+	case RD_KAFKA_COMPRESSION_GZIP:
+		if (rkb->rkb_gz_failed)
+			return -1;
 
-	if (err && !payload) {
-		/* Provide human readable error string if not provided. */
+		if (!rkb->rkb_gz &&
+		    !(rkb->rkb_gz =
+		      rd_gz_new(rk->rk_conf.producer.compression_level))) {
+			rd_kafka_log(rk, LOG_WARNING, "GZIP",
+				     "Failed to set up gzip compression "
+				     "(level %i): sending uncompressed",
+				     rk->rk_conf.producer.compression_level);
+			rkb->rkb_gz_failed = 1;
+			return -1;
+		}
 
-		/* Provide more info for some errors. */
-		if (err == RD_KAFKA_RESP_ERR_OFFSET_OUT_OF_RANGE)
-			payload =
-				strdup(rd_tsprintf("%s (%"PRIu64")",
-						   rd_kafka_err2str(err),
-						   rk->rk_consumer.offset));
-		else
-			payload = strdup(rd_kafka_err2str(err));
+		TAILQ_FOREACH(rko, &rkms->rkms_ops, rko_link) {
+			iov[iovcnt].iov_base = msg++;
+			iov[iovcnt++].iov_len = sizeof(*msg);
+			iov[iovcnt].iov_base = rko->rko_payload;
+			iov[iovcnt++].iov_len = rko->rko_len;
+		}
 
-		len = strlen(payload);
+		size = rd_gz_compress_bound(rkb->rkb_gz, rkms->rkms_len);
+		if (size > rkms->rkms_cbuf_size) {
+			rkms->rkms_cbuf_size = size;
+			rkms->rkms_cbuf = realloc(rkms->rkms_cbuf, size);
+		}
+
+		if ((r = rd_gz_compress(rkb->rkb_gz, iov, iovcnt,
+					rkms->rkms_cbuf,
+					rkms->rkms_cbuf_size)) == -1) {
+			rd_kafka_log(rk, LOG_WARNING, "GZIP",
+				     "GZ-compression of %i bytes failed for "
+				     "message set: sending uncompressed",
+				     rkms->rkms_len);
+			return -1;
+		}
+		rkms->rkms_wrapper.rkpm_compression =
+			RD_KAFKAP_MSG_COMPRESSION_GZIP;
+		break;
+
+	case RD_KAFKA_COMPRESSION_SNAPPY:
+	{
+		char *p;
+
+		/* The snappy compressor needs contiguous input. */
+		if (rkms->rkms_len > rkb->rkb_sbuf_size) {
+			rkb->rkb_sbuf_size = rkms->rkms_len;
+			rkb->rkb_sbuf = realloc(rkb->rkb_sbuf,
+						rkb->rkb_sbuf_size);
+		}
+
+		p = rkb->rkb_sbuf;
+		TAILQ_FOREACH(rko, &rkms->rkms_ops, rko_link) {
+			char *hdr = p;
+
+			p += sizeof(*msg);
+			msg->rkpm_cksum = htonl(rd_crc32_copy(p,
+							      rko->rko_payload,
+							      rko->rko_len));
+			memcpy(hdr, msg++, sizeof(*msg));
+			p += rko->rko_len;
+		}
+
+		size = rd_snappy_max_compressed_length(rkms->rkms_len);
+		if (size > rkms->rkms_cbuf_size) {
+			rkms->rkms_cbuf_size = size;
+			rkms->rkms_cbuf = realloc(rkms->rkms_cbuf, size);
+		}
+
+		r = rd_snappy_compress(rkb->rkb_sbuf, rkms->rkms_len,
+				       rkms->rkms_cbuf);
+		rkms->rkms_wrapper.rkpm_compression =
+			RD_KAFKAP_MSG_COMPRESSION_SNAPPY;
+		break;
 	}
 
-	rd_kafka_op_reply0(rk, rko, type, err, compression,
-			   payload, len, offset_len);
-	rd_kafka_q_enq(&rk->rk_rep, rko);
+	default:
+		return -1;
+	}
+
+	rkms->rkms_clen = r;
+	rkms->rkms_wrapper.rkpm_len = htonl(sizeof(rkms->rkms_wrapper) -
+					    sizeof(rkms->rkms_wrapper.rkpm_len)
+					    + r);
+	rkms->rkms_wrapper.rkpm_magic = RD_KAFKAP_MSG_MAGIC_COMPRESSION_ATTR;
+	rkms->rkms_wrapper.rkpm_cksum = htonl(rd_crc32(rkms->rkms_cbuf, r));
+
+	return 0;
+}
+
+
+/**
+ * Queue the batch's single request on the connection's output buffer:
+ * a PRODUCE request if all messages are destined for the same
+ * topic+partition, else a MULTIPRODUCE request.
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_produce_build (rd_kafka_t *rk, rd_kafka_batch_t *rkb) {
+	rd_kafka_obuf_t *rkob = &rk->rk_broker.obuf;
+	struct rd_kafkap_multireq *req = &rkb->rkb_req;
+	struct iovec *iov, *iov0;
+	rd_kafka_op_t *rko;
+	int iovcnt;
+	int len;
+	int i;
+
+	/* Request header + header template and MESSAGES_LEN per message set +
+	 * header and payload for each message. */
+	iovcnt = 1 + (rkb->rkb_mset_cnt * 2) + (rkb->rkb_msgcnt * 2);
+	iov = iov0 = rd_kafka_obuf_reserve(rkob, iovcnt);
+
+	if (rkb->rkb_mset_cnt == 1) {
+		req->rkpmr_type = htons(RD_KAFKAP_PRODUCE);
+		iov->iov_len = sizeof(struct rd_kafkap_req) -
+			sizeof(((struct rd_kafkap_req *)NULL)->rkpr_topic_len);
+	} else {
+		req->rkpmr_type = htons(RD_KAFKAP_MULTIPRODUCE);
+		req->rkpmr_topicpart_cnt = htons(rkb->rkb_mset_cnt);
+		iov->iov_len = sizeof(*req);
+	}
+	iov->iov_base = req;
+	len = iov->iov_len;
+	iov++;
+
+	for (i = 0 ; i < rkb->rkb_mset_cnt ; i++) {
+		rd_kafka_mset_t *rkms = rkb->rkb_msets[i];
+		struct rd_kafkap_msg *msg = rkms->rkms_msghdrs;
+		uint32_t msgs_len;
+
+		rkms->rkms_clen = 0;
+		if (rkms->rkms_codec != RD_KAFKA_COMPRESSION_NONE)
+			rd_kafka_mset_compress(rk, rkb, rkms, iov + 2);
+
+		msgs_len = rkms->rkms_clen ?
+			sizeof(rkms->rkms_wrapper) + rkms->rkms_clen :
+			rkms->rkms_len;
+		len += rkms->rkms_part->rktp_hdr_len + sizeof(msgs_len) +
+			msgs_len;
+
+		rkms->rkms_msgs_len = htonl(msgs_len);
+		iov->iov_base = rkms->rkms_part->rktp_hdr;
+		iov->iov_len  = rkms->rkms_part->rktp_hdr_len;
+		iov++;
+		iov->iov_base = &rkms->rkms_msgs_len;
+		iov->iov_len  = sizeof(rkms->rkms_msgs_len);
+		iov++;
+
+		if (rkms->rkms_clen) {
+			iov->iov_base = &rkms->rkms_wrapper;
+			iov->iov_len  = sizeof(rkms->rkms_wrapper);
+			iov++;
+			iov->iov_base = rkms->rkms_cbuf;
+			iov->iov_len  = rkms->rkms_clen;
+			iov++;
+			continue;
+		}
+
+		TAILQ_FOREACH(rko, &rkms->rkms_ops, rko_link) {
+			iov->iov_base = msg++;
+			iov->iov_len  = sizeof(*msg);
+			iov++;
+			iov->iov_base = rko->rko_payload;
+			iov->iov_len  = rko->rko_len;
+			iov++;
+		}
+	}
+
+	req->rkpmr_len = htonl(len - sizeof(req->rkpmr_len));
+
+	rd_kafka_obuf_commit(rkob, iov - iov0, len);
+	rkb->rkb_req_end = rkob->rkob_queued;
+	rkb->rkb_ts_req = rd_clock();
+}
+
+
+/**
+ * Returns 1 if the batch's request has been written in full.
+ */
+static inline int rd_kafka_batch_written (rd_kafka_t *rk,
+					  const rd_kafka_batch_t *rkb) {
+	return rkb->rkb_req_end &&
+		rk->rk_broker.obuf.rkob_written >= rkb->rkb_req_end;
+}
+
+
+/**
+ * The batch's request was sent: destroy its ops and reset the batch.
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_batch_done (rd_kafka_t *rk, rd_kafka_batch_t *rkb) {
+	struct rd_kafka_op_head_s rkoq = TAILQ_HEAD_INITIALIZER(rkoq);
+	rd_kafka_op_t *rko, *next;
+
+	int64_t bytes = 0;
+
+	/* Moving average over the last 8 or so requests. */
+	if (rkb->rkb_req_end) {
+		rd_ts_t now = rd_clock();
+		rk->rk_broker.stats.tx_latency +=
+			((int64_t)(now - rkb->rkb_ts_req) -
+			 rk->rk_broker.stats.tx_latency) / 8;
+		rk->rk_broker.stats.ts_tx_latency = now;
+	}
+
+	rd_kafka_batch_purge(rk, rkb, &rkoq);
+	rkb->rkb_req_end = 0;
+
+	for (rko = TAILQ_FIRST(&rkoq) ; rko ; rko = next) {
+		next = TAILQ_NEXT(rko, rko_link);
+		bytes += rko->rko_len;
+		rd_kafka_op_destroy(rk, rko);
+	}
+
+	if (rk->rk_conf.producer.max_outq_bytes)
+		rd_kafka_outq_release(rk, bytes);
+}
+
+
+/**
+ * The batch's request could not be sent: put its ops, followed by
+ * the ops in rk_opq that were dequeued after them, back at the head
+ * of the op queue for the next connection, and reset the batch.
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_batch_requeue (rd_kafka_t *rk, rd_kafka_batch_t *rkb) {
+	struct rd_kafka_op_head_s rkoq = TAILQ_HEAD_INITIALIZER(rkoq);
+	int cnt = rkb->rkb_msgcnt + rk->rk_opq_cnt;
+
+	rd_kafka_batch_purge(rk, rkb, &rkoq);
+	rkb->rkb_req_end = 0;
+
+	TAILQ_CONCAT(&rkoq, &rk->rk_opq, rko_link);
+	rk->rk_opq_cnt = 0;
+
+	if (cnt > 0)
+		rd_kafka_q_prepend(&rk->rk_op, &rkoq, cnt);
+}
+
+
+/**
+ * Send the batch and destroy its ops, or, if sending fails,
+ * requeue them (see rd_kafka_batch_requeue()).
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_batch_send (rd_kafka_t *rk, rd_kafka_batch_t *rkb) {
+	if (rk->rk_state != RD_KAFKA_STATE_UP) {
+		rd_kafka_batch_requeue(rk, rkb);
+		return;
+	}
+
+	rd_kafka_produce_build(rk, rkb);
+
+	rd_kafka_cork(rk, 1);
+
+	if (rd_kafka_obuf_write(rk, 0) == -1)
+		rd_kafka_batch_requeue(rk, rkb);
+	else {
+		rd_kafka_cork(rk, 0);
+		rd_kafka_batch_done(rk, rkb);
+	}
+}
+
+
+/**
+ * Move ops from rk_opq to the batch until it is full.
+ * Returns 1 if the batch is full.
+ *
+ * Locality: Kafka thread
+ */
+static int rd_kafka_batch_fill (rd_kafka_t *rk, rd_kafka_batch_t *rkb) {
+	rd_kafka_op_t *rko;
+	int full = 0;
+
+	while (!full && (rko = TAILQ_FIRST(&rk->rk_opq))) {
+		TAILQ_REMOVE(&rk->rk_opq, rko, rko_link);
+		full = rd_kafka_batch_add(rk, rkb, rko);
+		rk->rk_opq_cnt--;
+	}
+
+	return full;
+}
+
+
+/**
+ * Don't hold on to lingering ops when the connection goes down
+ * or the handle is terminating: send what is in the batch and put
+ * the remaining dequeued ops back on the op queue.
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_batch_flush (rd_kafka_t *rk, rd_kafka_batch_t *rkb) {
+	if (rkb->rkb_msgcnt > 0)
+		rd_kafka_batch_send(rk, rkb);
+	if (rk->rk_opq_cnt > 0)
+		rd_kafka_batch_requeue(rk, rkb);
+}
+
+
+/**
+ * Send FETCH message
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_fetch_send (rd_kafka_t *rk, uint64_t offset,
+				 uint32_t max_size) {
+	struct rd_kafkap_fetch_req freq = {
+	rkpfr_offset: htobe64(offset),
+	rkpfr_max_size: htonl(max_size),
+	};
+
+	rd_kafka_send_request(rk,
+			      RD_KAFKAP_FETCH,
+			      rd_kafka_topicpart_serialize(rk->
+							   rk_consumer.topic,
+							   rk->
+							   rk_consumer.
+							   partition),
+			      sizeof(freq), &freq,
+			      RD_KAFKA_SEND_END);
+}
+
+
+
+/**
+ * Producer: take over ops queued on the connections of the handle's
+ * peers (see rd_kafka_peers_set()) that are not up, or that are up but
+ * backed up by more than a produce request, into rk_opq: up to
+ * batch_msg_cnt ops, and at most half of a backlog.
+ * Returns the number of ops taken.
+ *
+ * Locality: Kafka thread
+ */
+static int rd_kafka_steal (rd_kafka_t *rk) {
+	struct rd_kafka_op_head_s rkoq = TAILQ_HEAD_INITIALIZER(rkoq);
+	rd_kafka_t *owner = rk->rk_parent ? : rk;
+	rd_kafka_peers_t *rkp = owner->rk_peers;
+	int max = rk->rk_conf.producer.batch_msg_cnt;
+	int cnt = 0;
+	int i, j;
+
+	pthread_mutex_lock(&rkp->lock);
+
+	/* Thieves start with different peers. */
+	rkp->next = (rkp->next + 1) % rkp->cnt;
+
+	for (i = 0 ; i < rkp->cnt && cnt < max ; i++) {
+		rd_kafka_t *peer = rkp->rks[(rkp->next + i) % rkp->cnt];
+
+		if (!peer || peer == owner)
+			continue;
+
+		for (j = 0 ; j < peer->rk_conn_cnt && cnt < max ; j++) {
+			rd_kafka_t *rkc = peer->rk_conns[j];
+			int64_t bytes = 0;
+			rd_kafka_topic_t *rkt = NULL, *myrkt = NULL;
+			rd_kafka_op_t *rko;
+			int qlen = rkc->rk_op.rkq_qlen;
+			int n;
+
+			if (rkc->rk_terminate || qlen == 0)
+				continue;
+
+			if (rkc->rk_state == RD_KAFKA_STATE_UP) {
+				if (qlen <= max)
+					continue; /* Keeping up */
+				qlen /= 2;
+			}
+
+			if (!(n = rd_kafka_q_steal(&rkc->rk_op, &rkoq,
+						   RD_MIN(qlen, max - cnt))))
+				continue;
+
+			/* The ops' topic handles belong to the peer,
+			 * which may go away: move them to the owner's.
+			 * The ops were appended to rkoq's tail. */
+			for (rko = TAILQ_LAST(&rkoq, rd_kafka_op_head_s) ;
+			     n-- > 0 ;
+			     rko = TAILQ_PREV(rko, rd_kafka_op_head_s,
+					      rko_link)) {
+				if (rko->rko_rkt != rkt) {
+					rkt = rko->rko_rkt;
+					myrkt = rd_kafka_topic_new(
+						owner, rkt->rkt_topic);
+				}
+				rko->rko_rkt = myrkt;
+				bytes += rko->rko_len;
+				cnt++;
+			}
+
+			if (peer->rk_conf.producer.max_outq_bytes)
+				rd_kafka_outq_release(peer, bytes);
+			if (owner->rk_conf.producer.max_outq_bytes)
+				(void)rd_atomic_add(&owner->rk_outq_bytes,
+						    bytes);
+		}
+	}
+
+	pthread_mutex_unlock(&rkp->lock);
+
+	if (cnt > 0) {
+		TAILQ_CONCAT(&rk->rk_opq, &rkoq, rko_link);
+		rk->rk_opq_cnt += cnt;
+	}
+
+	return cnt;
 }
 
 
+/**
+ * Producer: Wait for PRODUCE events from application.
+ * The op queue is drained as a whole to rk_opq, the ops of
+ * which are collected in the produce batch until the batch is full,
+ * or the op queue runs dry and the first op in the batch has lingered
+ * for conf.producer.linger_ms, and then sent in one request.
+ *
+ * Locality: Kafka thread
+ */
+static void rd_kafka_wait_op (rd_kafka_t *rk) {
+	rd_kafka_t *owner = rk->rk_parent ? : rk;
+	rd_kafka_batch_t *rkb;
+	rd_ts_t linger = (rd_ts_t)rk->rk_conf.producer.linger_ms * 1000;
+
+	if (!(rkb = rk->rk_batch))
+		rkb = rk->rk_batch = calloc(1, sizeof(*rkb));
+
+	while (!rk->rk_terminate && rk->rk_state == RD_KAFKA_STATE_UP) {
+		int full;
+
+		if (rk->rk_opq_cnt == 0) {
+			int timeout_ms = owner->rk_peers ?
+				RD_KAFKA_STEAL_INTERVAL_MS : RD_POLL_INFINITE;
+
+			if (rkb->rkb_msgcnt > 0) {
+				rd_ts_t elapsed = rd_clock() -
+					rkb->rkb_ts_first;
+				timeout_ms = elapsed >= linger ?
+					RD_POLL_NOWAIT :
+					(int)((linger - elapsed + 999) / 1000);
+			}
+
+			rk->rk_opq_cnt = rd_kafka_q_drain(&rk->rk_op,
+							  &rk->rk_opq,
+							  timeout_ms);
+			if (rk->rk_opq_cnt > 0)
+				rd_kafka_outq_release(rk, 0);
+			else if (rkb->rkb_msgcnt == 0 && owner->rk_peers)
+				rd_kafka_steal(rk);
+		}
+
+		full = rd_kafka_batch_fill(rk, rkb);
+
+		/* Not full: top up from the op queue before sending. */
+		if (rkb->rkb_msgcnt == 0 ||
+		    (!full && (rk->rk_op.rkq_qlen > 0 ||
+			       rd_clock() < rkb->rkb_ts_first + linger)))
+			continue;
+
+		rd_kafka_batch_send(rk, rkb);
+	}
+
+	rd_kafka_batch_flush(rk, rkb);
+}
+
 
 
 /**
- * Receive and purge data.
+ * Consumer: Wait for IO from broker.
+ *
+ * Locality: Kafka thread
  */
-static void rd_kafka_recv_null (rd_kafka_t *rk, int total_len) {
-	char buf[256];
-
-	while (total_len > 0) {
-		int len = total_len < sizeof(buf) ? total_len : sizeof(buf);
+static void rd_kafka_consumer_wait_io (rd_kafka_t *rk) {
+	while (!rk->rk_terminate && rk->rk_state == RD_KAFKA_STATE_UP) {
 		int r;
 
-		if ((r = recv(rk->rk_broker.s, buf, len, MSG_DONTWAIT)) < 1)
-			return;
+		if (rd_kafka_replyq_len(rk) <
+		    rk->rk_conf.consumer.replyq_low_thres) {
+			/* Below low watermark, fetch more messages. */
+			rd_kafka_fetch_send(rk,
+					    rk->rk_consumer.offset,
+					    rk->rk_conf.consumer.max_size);
+		} else {
+			struct pollfd pfd = { fd: rk->rk_broker.s,
+					      events: POLLIN };
+			/* We have messages, wait for more data from broker,
+			 * if any. */
+			r = poll(&pfd, 1, rk->rk_conf.consumer.poll_interval);
 
-		total_len -= r;
+			if (r == -1) { /* Error */
+				if (errno == EINTR)
+					continue;
+
+				rd_kafka_fail(rk,
+					      "Failed to poll socket %i: %s",
+					      rk->rk_broker.s,
+					      strerror(errno));
+				break;
+			} else if (r == 0) /* Timeout */
+				continue;
+		}
+
+		/* Blocking receive of message. */
+		r = rd_kafka_recv(rk);
+
+		/* No messages received? Wait a while before retrying. */
+		if (!r)
+			usleep(rk->rk_conf.consumer.poll_interval * 1000);
 	}
-}
+}		
 
 
 /**
- * Read data from socket.
+ * Kafka thread's main loop.
+ *
+ * Locality: Kafka thread.
  */
-static int rd_kafka_recv0 (rd_kafka_t *rk, const char *what,
-			   void *data, int len, int partial_ok) {
-	int r;
+static void *rd_kafka_thread_main (void *arg) {
+	rd_kafka_t *rk = arg;
 
-	if ((r = recv(rk->rk_broker.s, data, len,
-		      partial_ok ? 0 : MSG_WAITALL)) != len) {
-		if (r > 0) {
-			if (partial_ok)
-				return r;
+	while (!rk->rk_terminate) {
+		switch (rk->rk_state)
+		{
+		case RD_KAFKA_STATE_DOWN:
+			/* ..connect() will block until done (or failure) */
+			if (rd_kafka_connect(rk) == -1)
+				rd_kafka_connect_wait(rk,
+						      rd_kafka_connect_backoff(rk));
+			break;
+		case RD_KAFKA_STATE_CONNECTING:
+			break;
+		case RD_KAFKA_STATE_UP:
+			/* .._wait_*() blocks for as long as the
+			 * state remains UP. */
+			if (rk->rk_type == RD_KAFKA_PRODUCER)
+				rd_kafka_wait_op(rk);
 			else
-				rd_kafka_fail(rk, "Partial %s response "
-					      "(%i<%i bytes)",
-					      what, r, len);
-		} else if (r == 0)
-			rd_kafka_fail(rk, "No more data while expecting %s "
-				      "(%i bytes)", what, len);
-		else
-			rd_kafka_fail(rk, "Failed to recv %i bytes for %s: %s",
-				      len, what, strerror(errno));
-		return -1;
+				rd_kafka_consumer_wait_io(rk);
+			break;
+		}
 	}
 
-	return r;
+	rd_kafka_unref(rk);
+
+	return NULL;
 }
 
 
+
 /**
- * Parse a single message from buf and passes it to the application.
- * 'rko' is optional and will be used, without enqueuing, instead of
- * creating a new op, if non-NULL.
+ * I/O threads.
  *
- * If 'offset_len' is non-zero it depicts the outer (compressed) message's
- * offset length.
+ * A producer handle created with conf.producer.io_threads > 0 has no
+ * Kafka thread of its own, it is instead served by one of a
+ * process-wide pool of I/O threads, each of which drives the
+ * non-blocking broker sockets of many handles from a single epoll set.
+ * A handle's op queue signals the handle's eventfd (rkq_efd) when
+ * it becomes non-empty, which is also how rd_kafka_stop() and
+ * rd_kafka_destroy() get the I/O thread's attention.
  *
- * Returns -1 on failure or the consumed data length on success.
+ * The handle state (batch, rk_opq, socket) is owned by the I/O thread
+ * just like it is owned by the Kafka thread in the threaded model,
+ * so the batching code is shared between the two.
  */
-static int rd_kafka_msg_parse (rd_kafka_t *rk, char *buf, int len,
-			       rd_kafka_op_t *rko, uint64_t offset_len) {
-	struct rd_kafkap_msg *msg;
-	char *payload;
-
-	/* Transmissions may be terminated mid-message, this is
-	 * a soft-error that should be ignored and the client
-	 * should try again. */
-	msg = (struct rd_kafkap_msg *)buf;
+typedef struct rd_kafka_io_thread_s {
+	pthread_t         thread;
+	int               epfd;
+	pthread_mutex_t   lock;         /* Protects handles */
+	TAILQ_HEAD(, rd_kafka_s) handles;
+	int               handle_cnt;
+} rd_kafka_io_thread_t;
 
-	msg->rkpm_len = ntohl(msg->rkpm_len);
-		
-	if (msg->rkpm_len < sizeof(*msg) - sizeof(msg->rkpm_len)) {
-		/* Formatting error. */
-		rd_kafka_op_reply0(rk, rko, RD_KAFKA_OP_FETCH,
-				   RD_KAFKA_RESP_ERR__BAD_MSG,
-				   0, NULL, 0, 0);
-		return -1;
-	}
+static rd_kafka_io_thread_t rd_kafka_io_threads[RD_KAFKA_IO_THREADS_MAX];
+static int                  rd_kafka_io_thread_cnt = 0;
+static pthread_mutex_t      rd_kafka_io_lock = PTHREAD_MUTEX_INITIALIZER;
 
+#define RD_KAFKA_IO_EV_OP     0x40000000  /* rk_io.revents: eventfd */
+#define RD_KAFKA_IO_TAG_EFD   0x1         /* epoll data tag: eventfd */
+#define RD_KAFKA_IO_EVENTS    64          /* epoll_wait() batch */
+#define RD_KAFKA_IO_FLUSH_TIMEOUT_MS 1000 /* Detach: per stalled write */
 
-	if (!offset_len)
-		offset_len = msg->rkpm_len + sizeof(msg->rkpm_len);
 
-	if (msg->rkpm_len > 4000000) {
-		rd_kafka_op_reply0(rk, rko, RD_KAFKA_OP_FETCH,
-				   RD_KAFKA_RESP_ERR__BAD_MSG,
-				   0, NULL, 0, offset_len);
-		return msg->rkpm_len + sizeof(msg->rkpm_len);
+/**
+ * Register the socket for the events its state calls for:
+ * connection completion, or broker disconnect plus writability while
+ * a request is in flight.
+ *
+ * Locality: I/O thread
+ */
+static void rd_kafka_io_events_set (rd_kafka_io_thread_t *thr,
+				    rd_kafka_t *rk) {
+	struct epoll_event ev = { data: { ptr: rk } };
+
+	if (rk->rk_state == RD_KAFKA_STATE_CONNECTING)
+		ev.events = EPOLLOUT;
+	else {
+		ev.events = EPOLLIN|EPOLLRDHUP;
+		if (rk->rk_broker.obuf.rkob_cnt > 0)
+			ev.events |= EPOLLOUT;
 	}
 
-	msg->rkpm_len -= sizeof(*msg) - sizeof(msg->rkpm_len);
-
-	payload = malloc(msg->rkpm_len);
-	memcpy(payload, msg+1, msg->rkpm_len);
+	if (ev.events == rk->rk_io.events)
+		return;
 
-	rd_kafka_op_reply0(rk, rko, RD_KAFKA_OP_FETCH, 0,
-			   msg->rkpm_compression,
-			   payload, msg->rkpm_len, offset_len);
+	if (epoll_ctl(thr->epfd,
+		      rk->rk_io.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		      rk->rk_broker.s, &ev) == -1) {
+		rd_kafka_fail(rk, "epoll_ctl of socket %i failed: %s",
+			      rk->rk_broker.s, strerror(errno));
+		return;
+	}
 
-	return sizeof(*msg) + msg->rkpm_len;
+	rk->rk_io.events = ev.events;
 }
 
 
-
 /**
- * Receive an entire message from the broker.
+ * Nothing is expected from the broker, a readable socket means the
+ * broker closed the connection (or is misbehaving).
  *
- * Returns the number of data reply ops created.
- *
- * Locality: Kafka thread
+ * Locality: I/O thread
  */
-static int rd_kafka_recv (rd_kafka_t *rk) {
-	struct rd_kafkap_resp resp;
-	int replycnt = 0;
+static void rd_kafka_io_recv (rd_kafka_t *rk) {
+	char buf[512];
+	ssize_t r;
 
-	if (rd_kafka_recv0(rk, "response header",
-			   &resp, sizeof(resp), 0) == -1)
-		return 0;
+	while ((r = recv(rk->rk_broker.s, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+		rk->rk_broker.stats.rx_bytes += r;
 
-	resp.rkprp_len = ntohl(resp.rkprp_len);
-	resp.rkprp_error = ntohs(resp.rkprp_error);
+	if (r == 0)
+		rd_kafka_fail(rk, "Connection closed by broker");
+	else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		rd_kafka_fail(rk, "Receive failed: %s", strerror(errno));
+}
 
-	/* Error from broker? */
-	if (resp.rkprp_error != RD_KAFKA_RESP_ERR_NO_ERROR) {
-		rd_kafka_op_reply(rk, RD_KAFKA_OP_FETCH, resp.rkprp_error, 0,
-				  NULL, 0, 0);
-		/* Consume remaining buffer */
-		if (resp.rkprp_len)
-			rd_kafka_recv_null(rk, resp.rkprp_len - 4);
-		return 0;
-	}
 
-	if (resp.rkprp_len < sizeof(resp.rkprp_error) ||
-	    resp.rkprp_len > rk->rk_conf.max_msg_size) {
-		rd_kafka_fail(rk, "Invalid (or too long) response length %lu",
-			      resp.rkprp_len);
-		return 0;
-	}
+/**
+ * Producer: The non-blocking counterpart of rd_kafka_wait_op():
+ * finish writing the request in flight, then batch and build the
+ * next request, until the socket buffer fills up, the op queue runs
+ * dry, or the batch has to linger (rk_io.ts_timer).
+ * The socket is corked once a second request is built, so that the
+ * requests of one pass go out in full segments.
+ * Returns the number of requests built.
+ *
+ * Locality: I/O thread
+ */
+static int rd_kafka_io_produce0 (rd_kafka_t *rk) {
+	rd_kafka_batch_t *rkb;
+	rd_ts_t linger = (rd_ts_t)rk->rk_conf.producer.linger_ms * 1000;
+	int built = 0;
 
-	resp.rkprp_len -= sizeof(resp.rkprp_error);
+	if (!(rkb = rk->rk_batch))
+		rkb = rk->rk_batch = calloc(1, sizeof(*rkb));
 
-	/* Start chewing off messages, send one op back to application
-	 * for each message parsed. */
-	while (resp.rkprp_len >= sizeof(struct rd_kafkap_msg)) {
-		struct rd_kafkap_msg msg;
-		char *buf;
-		
-		/* Transmissions may be terminated mid-message, this is
-		 * a soft-error that should be ignored and the client
-		 * should try again at a later offset. */
-		if (rd_kafka_recv0(rk, "message",
-				   &msg, sizeof(msg), 0) == -1)
-			return replycnt;
+	while (rk->rk_state == RD_KAFKA_STATE_UP) {
+		int full;
 
-		msg.rkpm_len = ntohl(msg.rkpm_len);
-		resp.rkprp_len -= sizeof(msg);
+		if (rd_kafka_obuf_write(rk, MSG_DONTWAIT) <= 0)
+			return built; /* Socket buffer full, or failure */
 
-		if (msg.rkpm_len < sizeof(msg) - sizeof(msg.rkpm_len))
-			return replycnt;
+		if (rd_kafka_batch_written(rk, rkb))
+			rd_kafka_batch_done(rk, rkb);
 
-		if (msg.rkpm_len > rk->rk_conf.max_msg_size) {
-			rd_kafka_fail(rk, "Invalid (or too long) response "
-				      "message length %lu",
-				      msg.rkpm_len);
-			return replycnt;
-		}
+		if (rk->rk_opq_cnt == 0 &&
+		    (rk->rk_opq_cnt = rd_kafka_q_drain(&rk->rk_op,
+						       &rk->rk_opq,
+						       RD_POLL_NOWAIT)) > 0)
+			rd_kafka_outq_release(rk, 0);
 
-		msg.rkpm_len -= sizeof(msg) - 4;
+		full = rd_kafka_batch_fill(rk, rkb);
 
-		if (msg.rkpm_len > resp.rkprp_len) {
-			/* Partial message, drop it. */
-			if (resp.rkprp_len)
-				rd_kafka_recv_null(rk, resp.rkprp_len);
-			return replycnt;
+		if (rkb->rkb_msgcnt == 0) {
+			if ((rk->rk_parent ? : rk)->rk_peers &&
+			    rd_kafka_steal(rk) > 0)
+				continue;
+			return built;
 		}
 
-		/*
-		 * Message payload
-		 */
-		resp.rkprp_len -= msg.rkpm_len;
+		if (!full) {
+			/* Top up from the op queue before sending. */
+			if (rk->rk_op.rkq_qlen > 0)
+				continue;
 
-		buf = malloc(msg.rkpm_len);
-		
-		if (rd_kafka_recv0(rk, "message payload",
-				   buf, msg.rkpm_len, 0) == -1) {
-			free(buf);
-			return replycnt;
+			if (rd_clock() < rkb->rkb_ts_first + linger) {
+				rk->rk_io.ts_timer = rkb->rkb_ts_first +
+					linger;
+				return built;
+			}
 		}
 
-		rk->rk_consumer.offset += msg.rkpm_len + sizeof(msg);
-
-		rd_kafka_op_reply(rk, RD_KAFKA_OP_FETCH, 0,
-				  msg.rkpm_compression,
-				  buf, msg.rkpm_len, rk->rk_consumer.offset);
-
-		replycnt++;
+		if (built++ == 1)
+			rd_kafka_cork(rk, 1);
+		rd_kafka_produce_build(rk, rkb);
 	}
 
-	/* Drop padding */
-	if (resp.rkprp_len > 0)
-		rd_kafka_recv_null(rk, resp.rkprp_len);
-
-	return replycnt;
+	return built;
 }
 
-
-
-
 /**
- * Send PRODUCE message.
+ * rd_kafka_io_produce0(), uncorking the socket if it corked it.
  *
- * Locality: Kafka thread
+ * Locality: I/O thread
  */
-// void 2
-static int  rd_kafka_produce_send (rd_kafka_t *rk, rd_kafka_op_t *rko) {
-	struct rd_kafkap_msg msg = {
-	rkpm_len: htonl(sizeof(msg) - sizeof(msg.rkpm_len) + rko->rko_len),
-	rkpm_magic: RD_KAFKAP_MSG_MAGIC_COMPRESSION_ATTR,
-	rkpm_compression: RD_KAFKAP_MSG_COMPRESSION_NONE,
-	rkpm_cksum: htonl(rd_crc32(rko->rko_payload, rko->rko_len)),
-	};
-	struct rd_kafkap_produce prod = {
-	rkpp_msgs_len: htonl(sizeof(msg) + rko->rko_len),
-	
-	};
-
-	if(-1==rd_kafka_send_request(rk,
-			      RD_KAFKAP_PRODUCE,
-			      rd_kafka_topicpart_serialize(rko->rko_topic,
-							   rko->rko_partition),
-			      sizeof(prod), &prod,
-			      sizeof(msg), &msg,
-			      rko->rko_len, rko->rko_payload,
-			      RD_KAFKA_SEND_END))
-        {
-		return -1;
-        }
-        
-	return 0;
+static void rd_kafka_io_produce (rd_kafka_t *rk) {
+	if (rd_kafka_io_produce0(rk) > 1)
+		rd_kafka_cork(rk, 0);
 }
 
 
 /**
- * Send FETCH message
+ * Detach a terminating handle, already off the I/O thread's handles,
+ * sending what it was holding as rd_kafka_wait_op() does on
+ * termination, and drop the I/O thread's reference.
+ * This is done without thr->lock held, and a write stalled for
+ * RD_KAFKA_IO_FLUSH_TIMEOUT_MS fails the connection, leaving the
+ * unsent ops on the op queue, so that a stalled broker holds up
+ * neither the other handles nor the application for long.
  *
- * Locality: Kafka thread
+ * Locality: I/O thread
  */
-static void rd_kafka_fetch_send (rd_kafka_t *rk, uint64_t offset,
-				 uint32_t max_size) {
-	struct rd_kafkap_fetch_req freq = {
-	rkpfr_offset: htobe64(offset),
-	rkpfr_max_size: htonl(max_size),
+static void rd_kafka_io_detach (rd_kafka_io_thread_t *thr, rd_kafka_t *rk) {
+	rd_kafka_batch_t *rkb = rk->rk_batch;
+	struct timeval tv = {
+		tv_sec: RD_KAFKA_IO_FLUSH_TIMEOUT_MS / 1000,
+		tv_usec: (RD_KAFKA_IO_FLUSH_TIMEOUT_MS % 1000) * 1000,
 	};
 
-	rd_kafka_send_request(rk,
-			      RD_KAFKAP_FETCH,
-			      rd_kafka_topicpart_serialize(rk->
-							   rk_consumer.topic,
-							   rk->
-							   rk_consumer.
-							   partition),
-			      sizeof(freq), &freq,
-			      RD_KAFKA_SEND_END);
-}
+	epoll_ctl(thr->epfd, EPOLL_CTL_DEL, rk->rk_io.efd, NULL);
+
+	if (rk->rk_broker.s != -1) {
+		if (rk->rk_io.events)
+			epoll_ctl(thr->epfd, EPOLL_CTL_DEL, rk->rk_broker.s,
+				  NULL);
+		rk->rk_io.events = 0;
+		/* Finish off with blocking writes, bounded. */
+		fcntl(rk->rk_broker.s, F_SETFL,
+		      fcntl(rk->rk_broker.s, F_GETFL) & ~O_NONBLOCK);
+		setsockopt(rk->rk_broker.s, SOL_SOCKET, SO_SNDTIMEO,
+			   &tv, sizeof(tv));
+	}
+
+	if (rkb) {
+		if (rkb->rkb_req_end) {
+			if (rk->rk_state == RD_KAFKA_STATE_UP &&
+			    rd_kafka_obuf_write(rk, 0) != -1)
+				rd_kafka_batch_done(rk, rkb);
+			else
+				rd_kafka_batch_requeue(rk, rkb);
+		}
+		rd_kafka_batch_flush(rk, rkb);
+	}
 
+	rk->rk_io.stopped = 1;
+	rd_futex_wake(&rk->rk_io.stopped);
+
+	rd_kafka_unref(rk);
+}
 
 
 /**
- * Producer: Wait for PRODUCE events from application.
+ * Serve a handle that was signalled, whose socket has events, or
+ * whose timer expired.
+ * Returns -1 if the handle is terminating, it is then to be taken
+ * off the I/O thread's handles and detached, else 0.
  *
- * Locality: Kafka thread
+ * Locality: I/O thread
  */
-static void rd_kafka_wait_op (rd_kafka_t *rk) {
-	
-	while (!rk->rk_terminate && rk->rk_state == RD_KAFKA_STATE_UP) {
-		rd_kafka_op_t *rko =
-			rd_kafka_q_pop(&rk->rk_op, RD_POLL_INFINITE);
-		
-	     if(-1==rd_kafka_produce_send(rk, rko))
-             {
-                  rd_kafka_q_enq(&rk->rk_op,rko);
- 	     }
-             else
-             {
-                rd_kafka_op_destroy(rk, rko);
-	     }
-      }
-}		
+static int rd_kafka_io_serve (rd_kafka_io_thread_t *thr, rd_kafka_t *rk,
+			      rd_ts_t now) {
+	int revents = rk->rk_io.revents;
+
+	rk->rk_io.revents = 0;
+	rk->rk_io.ts_timer = 0;
 
+	if (rk->rk_terminate)
+		return -1;
+
+	switch (rk->rk_state)
+	{
+	case RD_KAFKA_STATE_DOWN:
+		if (now < rk->rk_io.ts_retry)
+			break;
+		if (rd_kafka_connect_nb(rk) == -1)
+			rk->rk_io.ts_retry = now + rd_kafka_connect_backoff(rk);
+		else
+			rk->rk_io.ts_connect = now +
+				(rd_ts_t)rk->rk_conf.connect_timeout_ms * 1000;
+		break;
+	case RD_KAFKA_STATE_CONNECTING:
+		if (!(revents & (EPOLLOUT|EPOLLERR|EPOLLHUP)) &&
+		    now < rk->rk_io.ts_connect)
+			break;
+		if (rd_kafka_connect_check(rk, !(revents &
+						 (EPOLLOUT|EPOLLERR|
+						  EPOLLHUP))) == -1)
+			rk->rk_io.ts_retry = now + rd_kafka_connect_backoff(rk);
+		break;
+	case RD_KAFKA_STATE_UP:
+		if (revents & (EPOLLIN|EPOLLRDHUP|EPOLLERR|EPOLLHUP))
+			rd_kafka_io_recv(rk);
+		break;
+	}
+
+	if (rk->rk_state == RD_KAFKA_STATE_UP)
+		rd_kafka_io_produce(rk);
+
+	if (rk->rk_state != RD_KAFKA_STATE_DOWN)
+		rd_kafka_io_events_set(thr, rk);
+
+	if (rk->rk_state == RD_KAFKA_STATE_CONNECTING)
+		rk->rk_io.ts_timer = rk->rk_io.ts_connect;
+
+	/* Idle: look for peers' ops to take over now and then. */
+	if (rk->rk_state == RD_KAFKA_STATE_UP && !rk->rk_io.ts_timer &&
+	    (rk->rk_parent ? : rk)->rk_peers)
+		rk->rk_io.ts_timer = now +
+			RD_KAFKA_STEAL_INTERVAL_MS * 1000;
+
+	if (rk->rk_state == RD_KAFKA_STATE_DOWN) {
+		/* The socket, if any, was closed by rd_kafka_fail(),
+		 * which also took it out of the epoll set.
+		 * A connection lost while UP is retried right away. */
+		rk->rk_io.events = 0;
+		if (rk->rk_batch)
+			rd_kafka_batch_requeue(rk, rk->rk_batch);
+		rk->rk_io.ts_timer = RD_MAX(rk->rk_io.ts_retry, now);
+	}
+
+	return 0;
+}
 
 
 /**
- * Consumer: Wait for IO from broker.
+ * I/O thread's main loop.
  *
- * Locality: Kafka thread
+ * Locality: I/O thread
  */
-static void rd_kafka_consumer_wait_io (rd_kafka_t *rk) {
-	while (!rk->rk_terminate && rk->rk_state == RD_KAFKA_STATE_UP) {
-		int r;
+static void *rd_kafka_io_thread_main (void *arg) {
+	rd_kafka_io_thread_t *thr = arg;
+	struct epoll_event evs[RD_KAFKA_IO_EVENTS];
+	int timeout_ms = -1;
+
+	while (1) {
+		TAILQ_HEAD(, rd_kafka_s) detached =
+			TAILQ_HEAD_INITIALIZER(detached);
+		rd_kafka_t *rk, *next;
+		rd_ts_t now, ts_next = 0;
+		int r, i;
+
+		if ((r = epoll_wait(thr->epfd, evs, RD_KAFKA_IO_EVENTS,
+				    timeout_ms)) == -1)
+			r = 0; /* EINTR */
+
+		for (i = 0 ; i < r ; i++) {
+			uintptr_t u = (uintptr_t)evs[i].data.ptr;
+
+			rk = (rd_kafka_t *)(u & ~(uintptr_t)RD_KAFKA_IO_TAG_EFD);
+			if (u & RD_KAFKA_IO_TAG_EFD) {
+				rd_kafka_efd_clear(rk->rk_io.efd);
+				rk->rk_io.revents |= RD_KAFKA_IO_EV_OP;
+			} else
+				rk->rk_io.revents |= evs[i].events;
+		}
 
-		if (rd_kafka_replyq_len(rk) <
-		    rk->rk_conf.consumer.replyq_low_thres) {
-			/* Below low watermark, fetch more messages. */
-			rd_kafka_fetch_send(rk,
-					    rk->rk_consumer.offset,
-					    rk->rk_conf.consumer.max_size);
-		} else {
-			struct pollfd pfd = { fd: rk->rk_broker.s,
-					      events: POLLIN };
-			/* We have messages, wait for more data from broker,
-			 * if any. */
-			r = poll(&pfd, 1, rk->rk_conf.consumer.poll_interval);
+		now = rd_clock();
 
-			if (r == -1) { /* Error */
-				if (errno == EINTR)
-					continue;
+		pthread_mutex_lock(&thr->lock);
+		for (rk = TAILQ_FIRST(&thr->handles) ; rk ; rk = next) {
+			next = TAILQ_NEXT(rk, rk_io.link);
 
-				rd_kafka_fail(rk,
-					      "Failed to poll socket %i: %s",
-					      rk->rk_broker.s,
-					      strerror(errno));
-				break;
-			} else if (r == 0) /* Timeout */
+			if ((rk->rk_io.revents || rk->rk_terminate ||
+			     (rk->rk_io.ts_timer &&
+			      rk->rk_io.ts_timer <= now)) &&
+			    rd_kafka_io_serve(thr, rk, now) == -1) {
+				TAILQ_REMOVE(&thr->handles, rk, rk_io.link);
+				thr->handle_cnt--;
+				TAILQ_INSERT_TAIL(&detached, rk, rk_io.link);
 				continue;
+			}
+
+			if (rk->rk_io.ts_timer &&
+			    (!ts_next || rk->rk_io.ts_timer < ts_next))
+				ts_next = rk->rk_io.ts_timer;
 		}
+		pthread_mutex_unlock(&thr->lock);
 
-		/* Blocking receive of message. */
-		r = rd_kafka_recv(rk);
+		/* Flush the terminating handles without the lock held. */
+		for (rk = TAILQ_FIRST(&detached) ; rk ; rk = next) {
+			next = TAILQ_NEXT(rk, rk_io.link);
+			rd_kafka_io_detach(thr, rk);
+		}
 
-		/* No messages received? Wait a while before retrying. */
-		if (!r)
-			usleep(rk->rk_conf.consumer.poll_interval * 1000);
+		if (!ts_next)
+			timeout_ms = -1;
+		else if ((now = rd_clock()) >= ts_next)
+			timeout_ms = 0;
+		else
+			timeout_ms = (int)((ts_next - now + 999) / 1000);
 	}
-}		
+
+	return NULL;
+}
 
 
 /**
- * Kafka thread's main loop.
+ * Attach a new producer handle to the least loaded of the first
+ * conf.producer.io_threads I/O threads, starting I/O threads as needed.
+ * Returns 0 on success or -1 on failure (errno is set).
  *
- * Locality: Kafka thread.
+ * Locality: application thread
  */
-static void *rd_kafka_thread_main (void *arg) {
-	rd_kafka_t *rk = arg;
+static int rd_kafka_io_attach (rd_kafka_t *rk) {
+	rd_kafka_io_thread_t *thr = NULL;
+	struct epoll_event ev = {
+	events: EPOLLIN,
+	data: { ptr: (void *)((uintptr_t)rk | RD_KAFKA_IO_TAG_EFD) },
+	};
+	int n = RD_MIN(rk->rk_conf.producer.io_threads,
+		       RD_KAFKA_IO_THREADS_MAX);
+	int errno_save = 0;
+	int i;
 
-	while (!rk->rk_terminate) {
-		switch (rk->rk_state)
-		{
-		case RD_KAFKA_STATE_DOWN:
-			/* ..connect() will block until done (or failure) */
-			if (rd_kafka_connect(rk) == -1)
-				sleep(1); /*Sleep between connection attempts*/
-			break;
-		case RD_KAFKA_STATE_CONNECTING:
+	if ((rk->rk_io.efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1)
+		return -1;
+
+	pthread_mutex_lock(&rd_kafka_io_lock);
+
+	while (rd_kafka_io_thread_cnt < n) {
+		rd_kafka_io_thread_t *t =
+			&rd_kafka_io_threads[rd_kafka_io_thread_cnt];
+
+		if ((t->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			errno_save = errno;
 			break;
-		case RD_KAFKA_STATE_UP:
-			/* .._wait_*() blocks for as long as the
-			 * state remains UP. */
-			if (rk->rk_type == RD_KAFKA_PRODUCER)
-				rd_kafka_wait_op(rk);
-			else
-				rd_kafka_consumer_wait_io(rk);
+		}
+		pthread_mutex_init(&t->lock, NULL);
+		TAILQ_INIT(&t->handles);
+
+		if ((errno_save = pthread_create(&t->thread, NULL,
+						 rd_kafka_io_thread_main,
+						 t))) {
+			close(t->epfd);
 			break;
 		}
+		pthread_detach(t->thread);
+		rd_kafka_io_thread_cnt++;
+	}
+
+	n = RD_MIN(n, rd_kafka_io_thread_cnt);
+	for (i = 0 ; i < n ; i++)
+		if (!thr ||
+		    rd_kafka_io_threads[i].handle_cnt < thr->handle_cnt)
+			thr = &rd_kafka_io_threads[i];
+
+	if (thr) {
+		pthread_mutex_lock(&thr->lock);
+		if (epoll_ctl(thr->epfd, EPOLL_CTL_ADD, rk->rk_io.efd,
+			      &ev) == -1)
+			errno_save = errno;
+		else {
+			rk->rk_op.rkq_efd = rk->rk_io.efd;
+			rk->rk_io.thr = thr;
+			TAILQ_INSERT_TAIL(&thr->handles, rk, rk_io.link);
+			thr->handle_cnt++;
+		}
+		pthread_mutex_unlock(&thr->lock);
 	}
 
-	rd_kafka_destroy(rk);
+	pthread_mutex_unlock(&rd_kafka_io_lock);
 
-	return NULL;
+	if (!rk->rk_io.thr) {
+		close(rk->rk_io.efd);
+		rk->rk_io.efd = -1;
+		errno = errno_save;
+		return -1;
+	}
+
+	/* First serve: connect to the broker. */
+	rd_kafka_efd_signal(rk->rk_io.efd);
+
+	return 0;
 }
 
 
@@ -1056,8 +3147,49 @@ const char *rd_kafka_err2str (rd_kafka_resp_err_t err) {
 }
 
 
-rd_kafka_t *rd_kafka_new (rd_kafka_type_t type, const char *broker,
-			  const rd_kafka_conf_t *conf) {
+static rd_kafka_t *rd_kafka_new0 (rd_kafka_type_t type, const char *broker,
+				   const rd_kafka_conf_t *conf,
+				   rd_kafka_t *parent);
+
+/**
+ * Set up the producer's additional connections to its broker
+ * (conf.producer.connections), as handles of their own.
+ * Fewer connections are used if some can't be set up.
+ *
+ * Locality: application thread
+ */
+static void rd_kafka_conns_new (rd_kafka_t *rk, const char *broker) {
+	rd_kafka_conf_t conf = rk->rk_conf;
+	int cnt = RD_MIN(rk->rk_conf.producer.connections,
+			 RD_KAFKA_CONNECTIONS_MAX);
+	int i;
+
+	conf.producer.connections = 1;
+
+	for (i = 1 ; i < cnt ; i++) {
+		rd_kafka_t *rkc;
+
+		if (!(rkc = rd_kafka_new0(RD_KAFKA_PRODUCER, broker, &conf,
+					  rk))) {
+			rd_kafka_log(rk, LOG_WARNING, "CONN",
+				     "Failed to set up connection %i/%i: %s",
+				     i + 1, cnt, strerror(errno));
+			break;
+		}
+
+		rk->rk_conns[i] = rkc;
+	}
+
+	rk->rk_conn_cnt = i;
+}
+
+
+/**
+ * Creates a handle, a connection handle of 'parent' if not NULL.
+ */
+static rd_kafka_t *rd_kafka_new0 (rd_kafka_type_t type, const char *broker,
+				   const rd_kafka_conf_t *conf,
+				   rd_kafka_t *parent) {
 	rd_kafka_t *rk;
 	rd_sockaddr_list_t *rsal;
 	const char *errstr;
@@ -1091,17 +3223,51 @@ rd_kafka_t *rd_kafka_new (rd_kafka_type_t type, const char *broker,
 	else
 		rk->rk_conf = rd_kafka_defaultconf;
 
+	if (rk->rk_conf.producer.batch_msg_cnt <= 0)
+		rk->rk_conf.producer.batch_msg_cnt =
+			rd_kafka_defaultconf.producer.batch_msg_cnt;
+	if (rk->rk_conf.producer.batch_size <= 0)
+		rk->rk_conf.producer.batch_size =
+			rd_kafka_defaultconf.producer.batch_size;
+	if (rk->rk_conf.connect_timeout_ms <= 0)
+		rk->rk_conf.connect_timeout_ms =
+			rd_kafka_defaultconf.connect_timeout_ms;
+	if (rk->rk_conf.reconnect_backoff_ms <= 0)
+		rk->rk_conf.reconnect_backoff_ms =
+			rd_kafka_defaultconf.reconnect_backoff_ms;
+	if (rk->rk_conf.reconnect_backoff_max_ms <
+	    rk->rk_conf.reconnect_backoff_ms)
+		rk->rk_conf.reconnect_backoff_max_ms =
+			RD_MAX(rk->rk_conf.reconnect_backoff_ms,
+			       rd_kafka_defaultconf.reconnect_backoff_max_ms);
+
 	rk->rk_refcnt = 2; /* One for caller, one for us. */
 
 	if (rk->rk_type == RD_KAFKA_CONSUMER)
 		rk->rk_refcnt++; /* Add another refcount for recv thread */
 
+	/* A connection handle holds a reference to its owner.
+	 * Both are set up before its thread runs, which reads rk_parent. */
+	if (parent) {
+		rk->rk_parent = parent;
+		(void)rd_atomic_add(&parent->rk_refcnt, 1);
+	}
+
 	rd_kafka_set_state(rk, RD_KAFKA_STATE_DOWN);
 
 	pthread_mutex_init(&rk->rk_lock, NULL);
+	pthread_mutex_init(&rk->rk_op_pool.lock, NULL);
 
 	rd_kafka_q_init(&rk->rk_op);
 	rd_kafka_q_init(&rk->rk_rep);
+	TAILQ_INIT(&rk->rk_opq);
+	rk->rk_io.efd = -1;
+
+	rk->rk_conns = calloc(RD_MAX(1, RD_MIN(rk->rk_conf.producer.connections,
+					       RD_KAFKA_CONNECTIONS_MAX)),
+			      sizeof(*rk->rk_conns));
+	rk->rk_conns[0] = rk;
+	rk->rk_conn_cnt = 1;
 
 	switch (rk->rk_type)
 	{
@@ -1188,19 +3354,41 @@ rd_kafka_t *rd_kafka_new (rd_kafka_type_t type, const char *broker,
 	snprintf(rk->rk_broker.name, sizeof(rk->rk_broker.name), "%s#%s-%i",
 		 broker, rd_kafka_type2str(rk->rk_type), rkid++);
 
-	/* Start the Kafka thread. */
-	if ((err = pthread_create(&rk->rk_thread, NULL,
+	/* Hand the producer over to an I/O thread, if so configured,
+	 * else start the Kafka thread. */
+	if (rk->rk_type == RD_KAFKA_PRODUCER &&
+	    rk->rk_conf.producer.io_threads > 0 &&
+	    rd_kafka_io_attach(rk) == -1)
+		rd_kafka_log(rk, LOG_WARNING, "IOTHREAD",
+			     "Failed to attach to an I/O thread (%s): "
+			     "starting a dedicated Kafka thread",
+			     strerror(errno));
+
+	if (!rk->rk_io.thr &&
+	    (err = pthread_create(&rk->rk_thread, NULL,
 				  rd_kafka_thread_main, rk))) {
+		if (rk->rk_parent)
+			rd_kafka_unref(rk->rk_parent);
 		rd_sockaddr_list_destroy(rk->rk_broker.rsal);
+		free(rk->rk_conns);
 		free(rk);
 		return NULL;
 	}
 
+	if (rk->rk_type == RD_KAFKA_PRODUCER)
+		rd_kafka_conns_new(rk, broker);
+
 
 	return rk;
 }
 
 
+rd_kafka_t *rd_kafka_new (rd_kafka_type_t type, const char *broker,
+			  const rd_kafka_conf_t *conf) {
+	return rd_kafka_new0(type, broker, conf, NULL);
+}
+
+
 
 
 rd_kafka_t *rd_kafka_new_consumer (const char *broker,
@@ -1250,79 +3438,465 @@ rd_kafka_op_t *rd_kafka_consume (rd_kafka_t *rk, int timeout_ms) {
 
 
 
+rd_kafka_topic_t *rd_kafka_topic_new (rd_kafka_t *rk, const char *topic) {
+	rd_kafka_topic_t *rkt;
+
+	pthread_mutex_lock(&rk->rk_lock);
+
+	for (rkt = rk->rk_topics ; rkt ; rkt = rkt->rkt_next)
+		if (!strcmp(rkt->rkt_topic, topic))
+			break;
+
+	if (!rkt) {
+		rkt = calloc(1, sizeof(*rkt));
+		rkt->rkt_rk = rk;
+		rkt->rkt_topic = strdup(topic);
+		rkt->rkt_topic_len = strlen(topic);
+		if (rkt->rkt_topic_len > RD_KAFKA_TOPIC_MAXLEN) {
+			rd_kafka_log(rk, LOG_WARNING, "TOPIC",
+				     "Topic name (%s) is too long (max %i), "
+				     "will truncate it",
+				     topic, RD_KAFKA_TOPIC_MAXLEN);
+			rkt->rkt_topic_len = RD_KAFKA_TOPIC_MAXLEN;
+		}
+		rkt->rkt_compression = rk->rk_conf.producer.compression_codec;
+		rkt->rkt_partitioner = rk->rk_conf.producer.partitioner ? :
+			rd_kafka_partitioner_random;
+		rkt->rkt_partition_cnt =
+			RD_MAX(rk->rk_conf.producer.partition_cnt, 1);
+		/* Handles of different brokers start out on
+		 * different partitions. */
+		rkt->rkt_sticky.partition = rd_rand();
+		rkt->rkt_rr = rd_rand();
+		rkt->rkt_next = rk->rk_topics;
+		rk->rk_topics = rkt;
+	}
+
+	pthread_mutex_unlock(&rk->rk_lock);
+
+	return rkt;
+}
+
+
+void rd_kafka_topic_compression_set (rd_kafka_topic_t *rkt,
+				     rd_kafka_compression_t codec) {
+	rkt->rkt_compression = codec;
+}
+
+
+void rd_kafka_topic_partitioner_set (rd_kafka_topic_t *rkt,
+				     rd_kafka_partitioner_t *partitioner,
+				     uint32_t partition_cnt) {
+	if (partitioner)
+		rkt->rkt_partitioner = partitioner;
+	if (partition_cnt)
+		rkt->rkt_partition_cnt = partition_cnt;
+}
+
+
+uint32_t rd_kafka_partitioner_random (rd_kafka_topic_t *rkt,
+				      const void *key, size_t keylen,
+				      size_t len, uint32_t partition_cnt,
+				      void *opaque) {
+	return rd_rand() % partition_cnt;
+}
+
+
+uint32_t rd_kafka_partitioner_round_robin (rd_kafka_topic_t *rkt,
+					   const void *key, size_t keylen,
+					   size_t len, uint32_t partition_cnt,
+					   void *opaque) {
+	return rd_atomic_add(&rkt->rkt_rr, 1) % partition_cnt;
+}
+
+
+uint32_t rd_kafka_partitioner_sticky (rd_kafka_topic_t *rkt,
+				      const void *key, size_t keylen,
+				      size_t len, uint32_t partition_cnt,
+				      void *opaque) {
+	const rd_kafka_conf_t *conf = &rkt->rkt_rk->rk_conf;
+	uint32_t partition = rkt->rkt_sticky.partition;
+	int msgcnt = rd_atomic_add(&rkt->rkt_sticky.msgcnt, 1);
+	int64_t bytes = rd_atomic_add(&rkt->rkt_sticky.bytes, (int64_t)len);
+	rd_ts_t now = 0;
+
+	if (msgcnt > conf->producer.batch_msg_cnt ||
+	    bytes > conf->producer.batch_size ||
+	    (conf->producer.linger_ms > 0 &&
+	     (now = rd_clock()) >= rkt->rkt_sticky.ts_start +
+	     (rd_ts_t)conf->producer.linger_ms * 1000)) {
+		uint32_t next = partition % partition_cnt;
+
+		if (partition_cnt > 1)
+			next = (next + 1 + rd_rand() %
+				(partition_cnt - 1)) % partition_cnt;
+
+		/* The first thread to get here moves the topic on,
+		 * the counts are approximate with concurrent producers. */
+		if (__sync_bool_compare_and_swap(&rkt->rkt_sticky.partition,
+						 partition, next)) {
+			rkt->rkt_sticky.msgcnt = 1;
+			rkt->rkt_sticky.bytes = len;
+			rkt->rkt_sticky.ts_start = now ? : rd_clock();
+		}
+		partition = rkt->rkt_sticky.partition;
+	}
+
+	return partition % partition_cnt;
+}
+
+
+uint32_t rd_kafka_partitioner_consistent (rd_kafka_topic_t *rkt,
+					  const void *key, size_t keylen,
+					  size_t len, uint32_t partition_cnt,
+					  void *opaque) {
+	if (!key)
+		return rd_kafka_partitioner_random(rkt, key, keylen, len,
+						   partition_cnt, opaque);
+
+	return rd_crc32(key, keylen) % partition_cnt;
+}
+
+
+/**
+ * Returns the partition for a message produced with
+ * RD_KAFKA_PARTITION_UA.
+ *
+ * Locality: application thread
+ */
+static inline uint32_t rd_kafka_topic_partition (rd_kafka_topic_t *rkt,
+						 const void *key,
+						 size_t keylen, size_t len) {
+	return rkt->rkt_partitioner(rkt, key, keylen, len,
+				    rkt->rkt_partition_cnt,
+				    rkt->rkt_rk->rk_conf.producer.
+				    partitioner_opaque);
+}
+
+
+/**
+ * Returns the connection 'partition' is pinned to.
+ */
+static inline rd_kafka_t *rd_kafka_conn (rd_kafka_t *rk, uint32_t partition) {
+	return rk->rk_conns[partition % rk->rk_conn_cnt];
+}
+
+
+/**
+ * Returns the number of ops in the out queues of all connections.
+ */
+static inline int rd_kafka_op_qlen (rd_kafka_t *rk) {
+	int qlen = 0;
+	int i;
+
+	for (i = 0 ; i < rk->rk_conn_cnt ; i++)
+		qlen += rk->rk_conns[i]->rk_op.rkq_qlen;
+
+	return qlen;
+}
+
+
+/**
+ * Returns the number of leading messages in 'msgs' that fit in the
+ * handle's out queues under conf.producer.max_outq_msg_cnt and
+ * max_outq_bytes, or, with 'msgs' NULL, 1 if a single message of 'len'
+ * bytes does.
+ *
+ * Locality: application thread
+ */
+static int rd_kafka_outq_fits (rd_kafka_t *rk, const rd_kafka_message_t *msgs,
+			       size_t len, int cnt) {
+	int64_t max_bytes = rk->rk_conf.producer.max_outq_bytes;
+	int64_t bytes;
+	int i;
+
+	if (rk->rk_conf.producer.max_outq_msg_cnt) {
+		int avail = rk->rk_conf.producer.max_outq_msg_cnt -
+			rd_kafka_op_qlen(rk);
+		if (cnt > avail)
+			cnt = avail > 0 ? avail : 0;
+	}
+
+	if (!max_bytes || cnt == 0)
+		return cnt;
+
+	/* A message is always let into an empty queue so that one larger
+	 * than max_outq_bytes does not block forever. */
+	bytes = rk->rk_outq_bytes;
+	for (i = 0 ; i < cnt ; i++) {
+		bytes += msgs ? msgs[i].len : len;
+		if (bytes > max_bytes && (i > 0 || rk->rk_outq_bytes > 0))
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * Wakes up application threads blocking in rd_kafka_outq_wait() once
+ * ops left connection 'rk''s op queue, or, 'bytes' being their payload
+ * size, were written to the broker.
+ *
+ * Locality: any thread
+ */
+static void rd_kafka_outq_release (rd_kafka_t *rk, int64_t bytes) {
+	rk = rk->rk_parent ? : rk;
+
+	/* Atomic ops are full barriers: a waiter registering after this
+	 * sees the room that was just made. */
+	if (bytes)
+		(void)rd_atomic_sub(&rk->rk_outq_bytes, bytes);
+
+	if (rk->rk_outq_waiters > 0) {
+		(void)rd_atomic_add(&rk->rk_outq_space, 1);
+		rd_futex_wake(&rk->rk_outq_space);
+	}
+}
+
+
+int64_t rd_kafka_tx_latency (rd_kafka_t *rk) {
+	rd_ts_t now = rd_clock();
+	int64_t latency = 0;
+	int i;
+
+	for (i = 0 ; i < rk->rk_conn_cnt ; i++) {
+		const rd_kafka_t *rkc = rk->rk_conns[i];
+		int64_t l = rkc->rk_broker.stats.tx_latency;
+		rd_ts_t idle = now - rkc->rk_broker.stats.ts_tx_latency;
+
+		if (rkc->rk_broker.stats.ts_tx_latency == 0)
+			continue;
+
+		l >>= idle / 1000000 >= 63 ? 63 : idle / 1000000;
+		if (l > latency)
+			latency = l;
+	}
+
+	return latency;
+}
+
+
+/**
+ * Returns the number of leading messages that fit, as
+ * rd_kafka_outq_fits(), once at least one does, blocking for up to
+ * conf.producer.outq_block_ms for room to free up.
+ * Returns 0 on timeout.
+ *
+ * Locality: application thread
+ */
+static int rd_kafka_outq_wait (rd_kafka_t *rk, const rd_kafka_message_t *msgs,
+			       size_t len, int cnt) {
+	rd_ts_t abs_timeout;
+	int fits;
+
+	if ((fits = rd_kafka_outq_fits(rk, msgs, len, cnt)) > 0 ||
+	    rk->rk_conf.producer.outq_block_ms == RD_POLL_NOWAIT)
+		return fits;
+
+	abs_timeout = rd_kafka_q_abs_timeout(rk->rk_conf.producer.
+					     outq_block_ms);
+
+	(void)rd_atomic_add(&rk->rk_outq_waiters, 1);
+
+	while (1) {
+		int space = rk->rk_outq_space;
+		int timeout_ms = RD_POLL_INFINITE;
+
+		__sync_synchronize();
+		if ((fits = rd_kafka_outq_fits(rk, msgs, len, cnt)) > 0)
+			break;
+
+		if (abs_timeout != RD_POLL_INFINITE) {
+			rd_ts_t now = rd_clock();
+			if (now >= abs_timeout)
+				break;
+			timeout_ms = (abs_timeout - now + 999) / 1000;
+		}
+
+		rd_futex_wait_ms(&rk->rk_outq_space, space, timeout_ms);
+	}
+
+	(void)rd_atomic_sub(&rk->rk_outq_waiters, 1);
+
+	return fits;
+}
+
+
 /**
  * Produce one single message and send it off to the broker.
+ * 'topic' is the op's rko_topic, which RD_KAFKA_OP_F_FREE_TOPIC applies to.
  *
  * See rdkafka.h for 'msgflags'.
  *
  * Locality: application thread
  */
-int rd_kafka_produce (rd_kafka_t *rk, char *topic, uint32_t partition,
-		      int msgflags,
-		      char *payload, size_t len) {
+static int rd_kafka_produce0 (rd_kafka_topic_t *rkt, char *topic,
+			      uint32_t partition, int msgflags,
+			      char *payload, size_t len) {
+	rd_kafka_t *rk = rkt->rkt_rk;
 	rd_kafka_op_t *rko;
 
-	if (rk->rk_conf.producer.max_outq_msg_cnt &&
-	    rk->rk_op.rkq_qlen >= rk->rk_conf.producer.max_outq_msg_cnt) {
+	if ((rk->rk_conf.producer.max_outq_msg_cnt ||
+	     rk->rk_conf.producer.max_outq_bytes) &&
+	    !rd_kafka_outq_wait(rk, NULL, len, 1)) {
 		errno = ENOBUFS;
 		return -1;
 	}
 
-	rko = calloc(1, sizeof(*rko));
+	if (rk->rk_conf.producer.max_outq_bytes)
+		(void)rd_atomic_add(&rk->rk_outq_bytes, len);
+
+	if (partition == RD_KAFKA_PARTITION_UA)
+		partition = rd_kafka_topic_partition(rkt, NULL, 0, len);
+
+	rko = rd_kafka_op_new(rk);
 
 	rko->rko_type      = RD_KAFKA_OP_PRODUCE;
+	rko->rko_rkt       = rkt;
 	rko->rko_topic     = topic;
 	rko->rko_partition = partition;
 	rko->rko_flags    |= msgflags;
 	rko->rko_payload   = payload;
 	rko->rko_len       = len;
+	rko->rko_free_cb   = rk->rk_conf.producer.free_cb;
+	rko->rko_opaque    = rk->rk_conf.producer.free_cb_opaque;
 
-	rd_kafka_q_enq(&rk->rk_op, rko);
+	rd_kafka_q_enq(&rd_kafka_conn(rk, partition)->rk_op, rko);
 
 	return 0;
 }
 
 
+int rd_kafka_produce (rd_kafka_t *rk, char *topic, uint32_t partition,
+		      int msgflags,
+		      char *payload, size_t len) {
+	return rd_kafka_produce0(rd_kafka_topic_new(rk, topic), topic,
+				 partition, msgflags, payload, len);
+}
+
+
+int rd_kafka_topic_produce (rd_kafka_topic_t *rkt, uint32_t partition,
+			    int msgflags, char *payload, size_t len) {
+	return rd_kafka_produce0(rkt, rkt->rkt_topic, partition,
+				 msgflags & ~RD_KAFKA_OP_F_FREE_TOPIC,
+				 payload, len);
+}
+
+
+/**
+ * See rd_kafka_produce_batch() in rdkafka.h, and rd_kafka_produce0()
+ * for 'topic'.
+ *
+ * Locality: application thread
+ */
+static int rd_kafka_produce_batch0 (rd_kafka_topic_t *rkt, char *topic,
+				    uint32_t partition, int msgflags,
+				    rd_kafka_message_t *msgs, int cnt) {
+	rd_kafka_t *rk = rkt->rkt_rk;
+	rd_kafka_t *rkc = NULL;
+	rd_kafka_op_t *newest = NULL, *oldest = NULL;
+	int accepted = cnt;
+	int run = 0;
+	int i;
+
+	if (rk->rk_conf.producer.max_outq_msg_cnt ||
+	    rk->rk_conf.producer.max_outq_bytes)
+		accepted = rd_kafka_outq_wait(rk, msgs, 0, cnt);
+
+	if (rk->rk_conf.producer.max_outq_bytes) {
+		int64_t bytes = 0;
+		for (i = 0 ; i < accepted ; i++)
+			bytes += msgs[i].len;
+		(void)rd_atomic_add(&rk->rk_outq_bytes, bytes);
+	}
+
+	for (i = 0 ; i < accepted ; i++) {
+		rd_kafka_op_t *rko;
+		uint32_t part = partition;
+
+		if (part == RD_KAFKA_PARTITION_UA)
+			part = rd_kafka_topic_partition(rkt, msgs[i].key,
+							msgs[i].key_len,
+							msgs[i].len);
+
+		/* Enqueue the run so far when the connection changes. */
+		if (rd_kafka_conn(rk, part) != rkc) {
+			if (run > 0)
+				rd_kafka_q_enq_list(&rkc->rk_op,
+						    newest, oldest, run);
+			rkc = rd_kafka_conn(rk, part);
+			newest = oldest = NULL;
+			run = 0;
+		}
+
+		rko = rd_kafka_op_new(rk);
+
+		rko->rko_type      = RD_KAFKA_OP_PRODUCE;
+		rko->rko_rkt       = rkt;
+		rko->rko_topic     = topic;
+		rko->rko_partition = part;
+		rko->rko_flags    |= msgflags;
+		rko->rko_payload   = msgs[i].payload;
+		rko->rko_len       = msgs[i].len;
+		rko->rko_free_cb   = msgs[i].free_cb ? :
+			rk->rk_conf.producer.free_cb;
+		rko->rko_opaque    = msgs[i].opaque ? :
+			rk->rk_conf.producer.free_cb_opaque;
+		msgs[i].err = 0;
+
+		rko->rko_link.tqe_next = newest;
+		newest = rko;
+		if (!oldest)
+			oldest = rko;
+		run++;
+	}
+
+	for ( ; i < cnt ; i++)
+		msgs[i].err = ENOBUFS;
+
+	if (run > 0)
+		rd_kafka_q_enq_list(&rkc->rk_op, newest, oldest, run);
+
+	if (accepted < cnt)
+		errno = ENOBUFS;
+
+	return accepted;
+}
+
+
+int rd_kafka_produce_batch (rd_kafka_t *rk, char *topic, uint32_t partition,
+			    int msgflags, rd_kafka_message_t *msgs, int cnt) {
+	return rd_kafka_produce_batch0(rd_kafka_topic_new(rk, topic), topic,
+				       partition, msgflags, msgs, cnt);
+}
+
 
+int rd_kafka_topic_produce_batch (rd_kafka_topic_t *rkt, uint32_t partition,
+				  int msgflags, rd_kafka_message_t *msgs,
+				  int cnt) {
+	return rd_kafka_produce_batch0(rkt, rkt->rkt_topic, partition,
+				       msgflags & ~RD_KAFKA_OP_F_FREE_TOPIC,
+				       msgs, cnt);
+}
 
 
 /**
  * Decompress message payload.
+ * Received compressed messages are decompressed by the Kafka thread
+ * before they reach the application, this is for ops with
+ * rko_compression set that were obtained otherwise.
  */
 void rd_kafka_op_inflate (rd_kafka_t *rk, rd_kafka_op_t *rko) {
-	uint64_t offset_len = rko->rko_len + sizeof(struct rd_kafkap_msg);
 	uint64_t declen = 0;
 	char *buf, *origbuf = NULL;
 	int len = 0;
 	rd_kafka_op_t *rko2;
 
-	switch (rko->rko_compression)
-	{
-	case RD_KAFKAP_MSG_COMPRESSION_GZIP:
-
-		if (!(buf = rd_gz_decompress(rko->rko_payload,
-					     rko->rko_len, &declen))) {
-			/* FIXME: How to interact with application on this? */
-			rd_kafka_log(rk, LOG_WARNING, "GUNZIP",
-				     "GZ-decompression of %i bytes failed for "
-				     "message payload", rko->rko_len);
-			goto fail;
-		}
-		break;
-
-	case RD_KAFKAP_MSG_COMPRESSION_SNAPPY:
-		rd_kafka_log(rk, LOG_WARNING, "INFLATE",
-			     "FIXME: use application callback to "
-			     "perform decompression");
-		goto fail;
-
-	default:
-		rd_kafka_log(rk, LOG_WARNING, "INFLATE",
-			     "FIXME: unknown compression type %i: "
-			     "dropping message",
-			     rko->rko_compression);
+	if (!(buf = rd_kafka_decompress(rk, rko->rko_compression,
+					rko->rko_payload, rko->rko_len,
+					&declen)))
 		goto fail;
-	}
 
 	len = declen;
 	origbuf = buf;
@@ -1338,15 +3912,17 @@ void rd_kafka_op_inflate (rd_kafka_t *rk, rd_kafka_op_t *rko) {
 
 	/* Decompressed data is now in 'buf' with 'len' bytes,
 	 * it will consist of one or more messages that we need to parse
-	 * and enqueue for the application. */
+	 * and enqueue for the application.
+	 * The op's offset was already accounted for when it was consumed. */
 	while (len > 0) {
 		int r;
 
-		if ((r = rd_kafka_msg_parse(rk, buf, len,
-					    rko2, offset_len)) == -1) {
+		if ((r = rd_kafka_msg_parse(rk, buf, len, rko2, 0)) == -1) {
 			/* Message formatting errors are serious, we cant
 			 * decode the rest of the buffer now. */
-			goto fail;
+			if (rko2)
+				goto fail;
+			break;
 		}
 
 		rko2 = NULL;
@@ -47,6 +47,9 @@
 #define RD_POLL_INFINITE  -1
 #define RD_POLL_NOWAIT     0
 #define RD_KAFKA_TOPIC_MAXLEN  256
+#define RD_KAFKA_PARTITION_UA  ((uint32_t)-1)  /* Unassigned partition:
+						* let the topic's
+						* partitioner pick one. */
 
 char* getcurenttime();
 typedef enum {
@@ -76,6 +79,41 @@ typedef enum {
 } rd_kafka_resp_err_t;
 
 
+/**
+ * Message compression codecs.
+ * The values are those of the Kafka message's compression attribute.
+ */
+typedef enum {
+	RD_KAFKA_COMPRESSION_NONE,
+	RD_KAFKA_COMPRESSION_GZIP,
+	RD_KAFKA_COMPRESSION_SNAPPY,
+} rd_kafka_compression_t;
+
+
+/**
+ * Payload release callback for messages produced with
+ * RD_KAFKA_OP_F_FREE_CB, see conf.producer.free_cb.
+ */
+struct rd_kafka_s;
+typedef void (rd_kafka_free_cb_t) (struct rd_kafka_s *rk,
+				   void *payload, size_t len, void *opaque);
+
+
+/**
+ * Partitioner: returns the partition (0..partition_cnt-1) for a message
+ * of 'len' bytes produced with RD_KAFKA_PARTITION_UA, 'key' (may be NULL)
+ * being the message's partitioning key.
+ * See conf.producer.partitioner and the built-in rd_kafka_partitioner_*().
+ *
+ * Locality: application thread
+ */
+struct rd_kafka_topic_s;
+typedef uint32_t (rd_kafka_partitioner_t) (struct rd_kafka_topic_s *rkt,
+					   const void *key, size_t keylen,
+					   size_t len, uint32_t partition_cnt,
+					   void *opaque);
+
+
 /**
  * Optional configuration struct passed to rd_kafka_new*().
  * See head of rdkafka.c for defaults.
@@ -87,6 +125,63 @@ typedef struct rd_kafka_conf_s {
 				       * avoid memory exhaustion in case of
 				       * protocol hickups. */
 
+	int op_pool_max;              /* Maximum number of free ops kept
+				       * in the handle's op pool for reuse
+				       * (in addition to a small per-thread
+				       * cache). 0 disables op pooling. */
+
+	int connect_timeout_ms;       /* Give up on a connection attempt
+				       * to one of the broker's addresses
+				       * after this long and move on to
+				       * the next address. */
+
+	int reconnect_backoff_ms;     /* Once all of the broker's addresses
+				       * failed, wait this long before
+				       * trying them again, doubling with
+				       * each round that fails up to
+				       * reconnect_backoff_max_ms.
+				       * The wait is randomized down to
+				       * half of that so that handles don't
+				       * reconnect in lockstep. */
+	int reconnect_backoff_max_ms;
+
+	/* Broker socket options, applied on each (re)connect.
+	 * A value of 0 leaves the system default in place. */
+	struct {
+		int sndbuf_size;       /* SO_SNDBUF: socket send buffer size
+					* in bytes. Large windows help
+					* throughput on long round trip
+					* (cross-datacenter) links. */
+
+		int rcvbuf_size;       /* SO_RCVBUF: socket receive buffer
+					* size in bytes. */
+
+		int nodelay;           /* Set TCP_NODELAY: disable Nagle's
+					* algorithm. */
+
+		int cork;              /* Producer: set TCP_CORK while
+					* writing out produce requests so
+					* that small requests leave in full
+					* sized segments, the socket is
+					* uncorked once the requests at hand
+					* are written. With I/O threads only
+					* a pass writing several requests
+					* corks it. */
+
+		int keepalive;         /* Enable TCP keepalive (SO_KEEPALIVE)
+					* to detect dead brokers on idle
+					* connections. */
+
+		int keepalive_idle;    /* TCP_KEEPIDLE: seconds of idleness
+					* before the first keepalive probe. */
+
+		int keepalive_intvl;   /* TCP_KEEPINTVL: seconds between
+					* keepalive probes. */
+
+		int keepalive_cnt;     /* TCP_KEEPCNT: unanswered probes
+					* before the connection is dropped. */
+	} socket;
+
 	int flags;
 #define RD_KAFKA_CONF_F_APP_OFFSET_STORE  0x1  /* No automatic offset storage
 						* will be performed. The
@@ -147,13 +242,147 @@ typedef struct rd_kafka_conf_s {
 					* If this number is exceeded the
 					* rd_kafka_produce() call will
 					* return with -1 and errno
-					* set to ENOBUFS. */
+					* set to ENOBUFS, see
+					* outq_block_ms. */
+
+		int64_t max_outq_bytes; /* Maximum number of payload bytes
+					* of the messages in the output queue,
+					* counted until they are written to
+					* the broker. A message is accepted
+					* into an empty queue regardless.
+					* Exceeding it is handled as for
+					* max_outq_msg_cnt. */
+
+		int outq_block_ms;     /* Time in milliseconds the produce
+					* calls block waiting for room in the
+					* output queue when max_outq_msg_cnt
+					* or max_outq_bytes is reached, before
+					* failing with ENOBUFS.
+					* 0 fails right away,
+					* RD_POLL_INFINITE blocks until
+					* there is room. */
+
+		int linger_ms;         /* Time in milliseconds to wait for
+					* more messages before sending
+					* a produce request that is not full.
+					* 0 sends as soon as the output queue
+					* runs dry. */
+
+		int batch_msg_cnt;     /* Maximum number of messages in
+					* one produce request. */
+
+		int batch_size;        /* Maximum number of bytes (message
+					* sets) in one produce request.
+					* A single message larger than this
+					* is still sent. */
+
+		rd_kafka_compression_t compression_codec;
+		                       /* Compress each message set in
+					* a produce request into a single
+					* wrapper message using this codec.
+					* Can be overridden per topic with
+					* rd_kafka_topic_compression_set() */
+
+		int compression_level; /* Codec specific compression level,
+					* for gzip: 0..9, or -1 for the
+					* zlib default. */
+
+		rd_kafka_free_cb_t *free_cb;
+		                       /* Called when librdkafka is done
+					* with the payload of a message
+					* produced with RD_KAFKA_OP_F_FREE_CB,
+					* i.e., once it has been written to
+					* the socket, or when the message's
+					* op is destroyed otherwise.
+					* Called from the Kafka thread or
+					* the thread destroying the op.
+					* Can be overridden per message,
+					* see rd_kafka_message_t. */
+
+		void *free_cb_opaque;  /* Default 'opaque' for free_cb. */
+
+		int io_threads;        /* 0: the handle gets its own Kafka
+					* thread, blocking on the op queue
+					* and the broker socket.
+					* >0: the handle is instead served
+					* by one of a process-wide pool of
+					* epoll driven I/O threads, each
+					* serving many handles with
+					* non-blocking sockets, of which
+					* the first 'io_threads' are used.
+					* The pool grows to the largest
+					* 'io_threads' asked for, up to
+					* RD_KAFKA_IO_THREADS_MAX, and is
+					* never shrunk.
+					* Consumers always get their own
+					* Kafka thread. */
+#define RD_KAFKA_IO_THREADS_MAX  64
+
+		int connections;       /* Number of TCP connections to the
+					* broker, each with its own out
+					* queue, produce batch and Kafka
+					* thread (or I/O thread slot).
+					* A partition is pinned to
+					* connection 'partition %
+					* connections', which keeps the
+					* messages of a partition in order.
+					* 0 or 1: a single connection. */
+#define RD_KAFKA_CONNECTIONS_MAX  64
+
+		rd_kafka_partitioner_t *partitioner;
+		                       /* Picks the partition of messages
+					* produced with RD_KAFKA_PARTITION_UA,
+					* out of partition_cnt partitions.
+					* NULL: rd_kafka_partitioner_random.
+					* Can be overridden per topic with
+					* rd_kafka_topic_partitioner_set() */
+
+		void *partitioner_opaque; /* Passed to the partitioner. */
+
+		uint32_t partition_cnt; /* Number of partitions of each topic
+					* for the partitioner, the broker
+					* does not tell. 0 is taken as 1. */
 	} producer;
 
 } rd_kafka_conf_t;
 
 
 
+/**
+ * Producer: a topic's protocol encoded message set header
+ * (TOPIC_LEN, TOPIC, PARTITION) for one partition.
+ */
+typedef struct rd_kafka_topic_part_s {
+	int  rktp_hdr_len;
+	char rktp_hdr[2 + RD_KAFKA_TOPIC_MAXLEN + 4];
+} rd_kafka_topic_part_t;
+
+/**
+ * Topic handle, see rd_kafka_topic_new().
+ */
+typedef struct rd_kafka_topic_s {
+	struct rd_kafka_topic_s *rkt_next;    /* rk_topics link, rk_lock */
+	struct rd_kafka_s       *rkt_rk;
+	char                    *rkt_topic;
+	int                      rkt_topic_len; /* Encoded (truncated) length */
+	rd_kafka_compression_t   rkt_compression; /* Producer: codec */
+	/* Producer: message set header templates indexed by partition,
+	 * set up by the Kafka thread on first use. */
+	rd_kafka_topic_part_t  **rkt_parts;
+	uint32_t                 rkt_part_cnt;
+	/* Producer: RD_KAFKA_PARTITION_UA partitioning. */
+	rd_kafka_partitioner_t  *rkt_partitioner;
+	uint32_t                 rkt_partition_cnt;
+	uint32_t                 rkt_rr;        /* Round-robin counter */
+	struct {
+		uint32_t         partition;
+		int              msgcnt;        /* Since partition was picked */
+		int64_t          bytes;
+		rd_ts_t          ts_start;
+	} rkt_sticky;
+} rd_kafka_topic_t;
+
+
 typedef enum {
 	RD_KAFKA_OP_PRODUCE,  /* Application  -> Kafka thread */
 	RD_KAFKA_OP_FETCH,    /* Kafka thread -> Application */
@@ -164,10 +393,13 @@ typedef struct rd_kafka_op_s {
 	TAILQ_ENTRY(rd_kafka_op_s) rko_link;
 	rd_kafka_op_type_t rko_type;
 	char     *rko_topic;
+	rd_kafka_topic_t *rko_rkt;  /* For PRODUCE */
 	uint32_t  rko_partition;
 	int       rko_flags;
 #define RD_KAFKA_OP_F_FREE       0x1  /* Free the payload when done with it. */
 #define RD_KAFKA_OP_F_FREE_TOPIC 0x2  /* Free the topic when done with it. */
+#define RD_KAFKA_OP_F_FREE_CB    0x4  /* Release the payload through
+				       * rko_free_cb when done with it. */
 	/* For PRODUCE and ERR */
 	char     *rko_payload;
 	int       rko_len;
@@ -178,17 +410,54 @@ typedef struct rd_kafka_op_s {
 	rd_kafka_resp_err_t rko_err;
 	int8_t    rko_compression;
 	int64_t   rko_offset_len;  /* Length to use to advance the offset. */
+	/* For PRODUCE with RD_KAFKA_OP_F_FREE_CB */
+	rd_kafka_free_cb_t *rko_free_cb;
+	void     *rko_opaque;
 } rd_kafka_op_t;
 
 
+/**
+ * Multi-producer op queue, see rd_kafka_q_enq() and rd_kafka_q_pop().
+ */
 typedef struct rd_kafka_q_s {
-	pthread_mutex_t rkq_lock;
-	pthread_cond_t  rkq_cond;
-	TAILQ_HEAD(, rd_kafka_op_s) rkq_q;
-	int             rkq_qlen;
+	rd_kafka_op_t * volatile rkq_lifo; /* Newly enqueued ops, newest first,
+					    * linked by rko_link.tqe_next */
+	pthread_mutex_t rkq_lock;          /* Serializes consumers */
+	TAILQ_HEAD(rd_kafka_op_head_s, rd_kafka_op_s) rkq_q; /* Consumer side */
+	int             rkq_qcnt;          /* Ops in rkq_q */
+	int             rkq_qlen;          /* Ops in rkq_lifo and rkq_q */
+	int             rkq_waiters;       /* Consumers parked on rkq_wseq */
+	int             rkq_wseq;          /* Wake sequence, bumped by
+					    * wakeups and yields */
+	int             rkq_yield;         /* Interrupt waiting consumer */
+	int             rkq_efd;           /* eventfd to signal along with
+					    * waking consumers, or -1 */
 } rd_kafka_q_t;
 
 
+/**
+ * Connection output buffer: a ring of iovecs referencing request data
+ * owned by the caller, which is written out without copying, resuming
+ * partial writes where they left off.
+ * The ring is compacted rather than wrapped so that the unwritten
+ * iovecs are always contiguous for sendmsg().
+ *
+ * Locality: Kafka thread
+ */
+typedef struct rd_kafka_obuf_s {
+	struct iovec   *rkob_iov;
+	int             rkob_size;     /* iovecs allocated */
+	int             rkob_head;     /* First unwritten iovec */
+	int             rkob_cnt;      /* Unwritten iovecs */
+	size_t          rkob_off;      /* Bytes written of the head iovec */
+	uint64_t        rkob_queued;   /* Request bytes queued, in total */
+	uint64_t        rkob_written;  /* Request bytes written, in total.
+					* A request queued when rkob_queued
+					* was N is written once rkob_written
+					* reaches N plus its length. */
+} rd_kafka_obuf_t;
+
+
 
 
 
@@ -203,13 +472,63 @@ typedef struct rd_kafka_s {
 		rd_sockaddr_list_t *rsal;
 		int                 curr_addr;
 		int                 s;  /* TCP socket */
+		rd_kafka_obuf_t     obuf;  /* Output buffer for 's' */
+		int                 addr_tries;    /* Addresses tried in
+						    * this round */
+		int                 connect_fails; /* Failed rounds */
 		struct {
 			uint64_t tx_bytes;
 			uint64_t tx;    /* Kafka-messages (not payload msgs) */
 			uint64_t rx_bytes;
 			uint64_t rx;    /* Kafka messages (not payload msgs) */
+			int64_t  tx_latency; /* Producer: moving average of
+					      * the time (microseconds)
+					      * it takes to write a
+					      * request to the socket */
+			rd_ts_t  ts_tx_latency; /* Last tx_latency sample */
 		} stats;
 	} rk_broker;
+	struct rd_kafka_batch_s *rk_batch; /* Producer: ops being sent */
+	int              rk_batch_msgcnt;  /* Producer: ops in rk_batch,
+					    * atomic: read by any thread */
+	struct rd_kafka_op_head_s rk_opq;  /* Producer: ops drained from
+					    * rk_op, not yet in rk_batch */
+	int              rk_opq_cnt;
+	struct {
+		struct rd_kafka_io_thread_s *thr; /* NULL: own Kafka thread */
+		TAILQ_ENTRY(rd_kafka_s) link;     /* I/O thread's handles */
+		int              efd;      /* eventfd: rk_op or rk_terminate */
+		int              events;   /* Socket's registered events */
+		int              revents;  /* Pending events */
+		rd_ts_t          ts_timer; /* Serve at this time (or 0) */
+		rd_ts_t          ts_retry; /* Next connection attempt */
+		rd_ts_t          ts_connect; /* Connection attempt times out */
+		int              stopped;  /* Handle detached from thread */
+	} rk_io;
+	rd_kafka_topic_t *rk_topics;        /* Topic handles, rk_lock */
+	struct rd_kafka_s **rk_conns;       /* Producer: connection handles,
+					     * rk_conns[0] is the handle
+					     * itself, the others are
+					     * internal handles of their own
+					     * holding a reference to it. */
+	int              rk_conn_cnt;
+	struct rd_kafka_s *rk_parent;       /* Connection handle: owner */
+	struct rd_kafka_peers_s *rk_peers;  /* Producer: work stealing peers,
+					     * see rd_kafka_peers_set() */
+	int64_t          rk_outq_bytes;     /* Producer: payload bytes in the
+					     * out queues, if max_outq_bytes */
+	int              rk_outq_space;     /* Producer: futex, bumped when
+					     * room frees up in the out
+					     * queues with rk_outq_waiters */
+	int              rk_outq_waiters;   /* Producer: application threads
+					     * blocking for outq room */
+	struct {
+		pthread_mutex_t lock;
+		rd_kafka_op_t  *free;   /* Linked through rko_link.tqe_next */
+		int             cnt;
+		uint64_t        hits;   /* Ops reused from a cache or pool */
+		uint64_t        misses; /* Ops that had to be allocated */
+	} rk_op_pool;
 	rd_kafka_conf_t  rk_conf;
 	int              rk_flags;
 	int              rk_terminate;
@@ -257,6 +576,64 @@ typedef struct rd_kafka_s {
 void        rd_kafka_destroy (rd_kafka_t *rk);
 
 
+/**
+ * Stops the handle's Kafka thread, or detaches it from its I/O thread,
+ * and waits for it to exit. Likewise for each of a producer's
+ * connections.
+ * A producer's Kafka thread first sends, or if it is not connected puts
+ * back at the head of the out queue (rk_op), the messages it was holding
+ * for the current produce request.
+ * After this call no other thread touches the out queues, which the
+ * application may then take over with rd_kafka_outq_drain() to save
+ * any unsent messages.
+ *
+ * Must be called at most once, prior to rd_kafka_destroy().
+ *
+ * Locality: application thread
+ */
+void        rd_kafka_stop (rd_kafka_t *rk);
+
+
+/**
+ * Moves the unsent messages of all of a stopped producer's out queues
+ * to the tail of 'rkoq', connection by connection, so that the messages
+ * of each partition stay in order.
+ * The ops are owned by the caller and are destroyed with
+ * rd_kafka_op_destroy().
+ *
+ * Returns the number of ops moved.
+ *
+ * Locality: application thread, after rd_kafka_stop()
+ */
+int         rd_kafka_outq_drain (rd_kafka_t *rk,
+				 struct rd_kafka_op_head_s *rkoq);
+
+
+/**
+ * Makes the 'cnt' producer handles in 'rks', typically one per broker,
+ * peers that share their load: a connection that is up and has run out
+ * of messages of its own takes over messages queued on a peer's
+ * connection that is not up (down or connecting), or that is up but has
+ * more than a full produce request (conf.producer.batch_msg_cnt) backed
+ * up, up to a produce request's worth at a time and half of a backlog.
+ * Idle connections look for such messages every
+ * RD_KAFKA_STEAL_INTERVAL_MS.
+ *
+ * Taken over messages keep their partition number and are sent to the
+ * taking handle's broker, in order among themselves but not with
+ * respect to the messages left on the original handle.
+ * Messages of a handle that was stopped are left alone.
+ *
+ * A handle can be in one set of peers, for its lifetime.
+ * Returns 0 on success, or -1 if a handle is not a producer or already
+ * has peers (errno EINVAL).
+ *
+ * Locality: application thread
+ */
+#define RD_KAFKA_STEAL_INTERVAL_MS  100
+int         rd_kafka_peers_set (rd_kafka_t **rks, int cnt);
+
+
 /**
  * Creates a new Kafka handle and starts its operation according to the
  * specified 'type'.
@@ -338,6 +715,21 @@ rd_kafka_op_t *rd_kafka_consume (rd_kafka_t *rk, int timeout_ms);
 rd_kafka_op_t *rd_kafka_q_read(rd_kafka_q_t *rkq, int timeout_ms );
 
 
+/**
+ * Moves all ops in the queue 'rkq', in order, to the tail of 'rkoq'
+ * in one operation, waiting up to 'timeout_ms' (milliseconds,
+ * RD_POLL_NOWAIT or RD_POLL_INFINITE) for the queue to become non-empty.
+ * The ops are owned by the caller and are destroyed with
+ * rd_kafka_op_destroy().
+ *
+ * Returns the number of ops moved.
+ *
+ * Locality: any thread
+ */
+int rd_kafka_q_drain (rd_kafka_q_t *rkq, struct rd_kafka_op_head_s *rkoq,
+		      int timeout_ms);
+
+
 
 
 /**
@@ -351,31 +743,166 @@ int rd_kafka_offset_store (rd_kafka_t *rk, uint64_t offset);
 
 
 
+/**
+ * Returns the handle for 'topic', creating it on first use.
+ * Producing through a topic handle (rd_kafka_topic_produce*()) avoids
+ * looking up and encoding the topic name for every message.
+ * The handle holds the per-topic settings, see
+ * rd_kafka_topic_compression_set().
+ *
+ * Topic handles are owned by 'rk' and remain valid until
+ * rd_kafka_destroy().
+ *
+ * Locality: any thread
+ */
+rd_kafka_topic_t *rd_kafka_topic_new (rd_kafka_t *rk, const char *topic);
+
+/**
+ * Topic handle accessors.
+ *
+ * Locality: any thread
+ */
+#define rd_kafka_topic_name(rkt)     ((rkt)->rkt_topic)
+#define rd_kafka_topic_handle(rkt)   ((rkt)->rkt_rk)
+
 /**
  * Produce and send a single message to the broker.
  *
- * There are two alternatives for 'payload':
+ * There are three alternatives for 'payload':
  *   1) static data that will not change or go away during the lifetime
  *      of the rd_kafka_t handle. *This is uncommon*.
  *
  *   2) malloc():ed data that librdkafka will free when done with it,
  *      this requires the RD_KAFKA_OP_F_FREE flag to be set in msgflags.
  *
- * There is currently no way for the application to know when librdkafka is
- * done with the payload, so the control of freeing the payload must be left
- * to librdkafka as described in alternative 2) above.
+ *   3) application owned data that librdkafka hands back through the
+ *      conf.producer.free_cb callback when done with it,
+ *      this requires the RD_KAFKA_OP_F_FREE_CB flag to be set in msgflags.
+ *      This allows zero-copy producing from e.g. slices of a larger,
+ *      reference counted, buffer.
+ *      rd_kafka_produce() uses the handle's free_cb and free_cb_opaque,
+ *      rd_kafka_produce_batch() allows setting them per message.
  *
+ * 'partition' RD_KAFKA_PARTITION_UA lets the topic's partitioner pick the
+ * partition (without key).
  *
  * Returns 0 on success or -1 on error (see errno for details)
  *
  * errno:
- *   ENOBUFS - The conf.producer.max_outq_msg_cnt would be exceeded.
+ *   ENOBUFS - The conf.producer.max_outq_msg_cnt or max_outq_bytes
+ *             limit would be exceeded, and no room freed up within
+ *             conf.producer.outq_block_ms.
  *
  * Locality: application thread
  */
 int         rd_kafka_produce (rd_kafka_t *rk, char *topic, uint32_t partition,
 			      int msgflags, char *payload, size_t len);
 
+/**
+ * Same as rd_kafka_produce() but for the topic handle 'rkt'.
+ * RD_KAFKA_OP_F_FREE_TOPIC does not apply.
+ *
+ * Locality: application thread
+ */
+int         rd_kafka_topic_produce (rd_kafka_topic_t *rkt, uint32_t partition,
+				    int msgflags, char *payload, size_t len);
+
+/**
+ * A message for rd_kafka_produce_batch().
+ */
+typedef struct rd_kafka_message_s {
+	char   *payload;
+	size_t  len;
+	int     err;      /* Set by rd_kafka_produce_batch():
+			   * 0 if the message was accepted, else an errno. */
+	rd_kafka_free_cb_t *free_cb; /* RD_KAFKA_OP_F_FREE_CB: overrides
+				      * conf.producer.free_cb if set. */
+	void   *opaque;   /* RD_KAFKA_OP_F_FREE_CB: overrides
+			   * conf.producer.free_cb_opaque if set. */
+	const void *key;  /* RD_KAFKA_PARTITION_UA: partitioning key passed
+			   * to the partitioner, or NULL. Kafka 0.7 messages
+			   * have no key, it is not sent. */
+	size_t  key_len;
+} rd_kafka_message_t;
+
+/**
+ * Produce and send the 'cnt' messages in 'msgs' to the broker,
+ * all to the same 'topic' and 'partition'.
+ * With 'partition' RD_KAFKA_PARTITION_UA each message is partitioned by
+ * the topic's partitioner, passing it the message's 'key'.
+ *
+ * The accepted messages are enqueued, in order, with a single queue
+ * operation (per run of messages that go to the same connection).
+ * 'payload' and 'msgflags' are treated as for rd_kafka_produce(), for
+ * every accepted message, with RD_KAFKA_OP_F_FREE_CB each message's
+ * 'free_cb' and 'opaque' override the handle's.
+ *
+ * If the conf.producer.max_outq_msg_cnt or max_outq_bytes limit is hit
+ * only the leading messages that fit are accepted, the remaining messages
+ * get 'err' set to ENOBUFS and are left to the application (including
+ * their payload). If not even the first message fits the call blocks for
+ * up to conf.producer.outq_block_ms for room to free up.
+ *
+ * Returns the number of accepted messages, i.e., the index of the first
+ * message that was not accepted.
+ *
+ * Locality: application thread
+ */
+int         rd_kafka_produce_batch (rd_kafka_t *rk, char *topic,
+				    uint32_t partition, int msgflags,
+				    rd_kafka_message_t *msgs, int cnt);
+
+/**
+ * Same as rd_kafka_produce_batch() but for the topic handle 'rkt'.
+ * RD_KAFKA_OP_F_FREE_TOPIC does not apply.
+ *
+ * Locality: application thread
+ */
+int         rd_kafka_topic_produce_batch (rd_kafka_topic_t *rkt,
+					  uint32_t partition, int msgflags,
+					  rd_kafka_message_t *msgs, int cnt);
+
+/**
+ * Sets the compression codec for messages produced to the topic,
+ * overriding conf.producer.compression_codec for that topic.
+ * Applies to message sets started after the call.
+ *
+ * Locality: any thread
+ */
+void        rd_kafka_topic_compression_set (rd_kafka_topic_t *rkt,
+					    rd_kafka_compression_t codec);
+
+/**
+ * Sets the partitioner for messages produced to the topic with
+ * RD_KAFKA_PARTITION_UA, and the topic's number of partitions,
+ * overriding conf.producer.partitioner and partition_cnt for that topic.
+ * 'partitioner' NULL keeps the current one, 'partition_cnt' 0 the current
+ * number of partitions.
+ *
+ * Locality: application thread, before producing to the topic
+ */
+void        rd_kafka_topic_partitioner_set (rd_kafka_topic_t *rkt,
+					    rd_kafka_partitioner_t *partitioner,
+					    uint32_t partition_cnt);
+
+/**
+ * Built-in partitioners, see rd_kafka_partitioner_t.
+ *
+ * random:      a random partition for each message.
+ * round_robin: the partitions in turn, message by message.
+ * sticky:      stays on one randomly picked partition until
+ *              conf.producer.batch_msg_cnt messages or batch_size bytes
+ *              went to it, or it was picked linger_ms ago (if not 0),
+ *              so that messages add up to full size produce requests
+ *              rather than being spread thinly over all partitions.
+ * consistent:  a hash (CRC32) of the key, so messages with the same key
+ *              go to the same partition; random for messages without key.
+ */
+rd_kafka_partitioner_t rd_kafka_partitioner_random;
+rd_kafka_partitioner_t rd_kafka_partitioner_round_robin;
+rd_kafka_partitioner_t rd_kafka_partitioner_sticky;
+rd_kafka_partitioner_t rd_kafka_partitioner_consistent;
+
 /**
  * Destroys an op as returned by rd_kafka_consume().
  *
@@ -391,16 +918,38 @@ const char *rd_kafka_err2str (rd_kafka_resp_err_t err);
 
 
 /**
- * Returns the current out queue length (ops waiting to be sent to the broker).
+ * Returns the current out queue length (ops waiting to be sent to the broker),
+ * including ops lingering in the produce batch, of all the handle's
+ * connections.
  *
  * Locality: any thread
  */
 static inline int rd_kafka_outq_len (rd_kafka_t *rk) __attribute__((unused));
 static inline int rd_kafka_outq_len (rd_kafka_t *rk) {
-	return rk->rk_op.rkq_qlen;
+	int len = 0;
+	int i;
+
+	for (i = 0 ; i < rk->rk_conn_cnt ; i++) {
+		rd_kafka_t *rkc = rk->rk_conns[i];
+		len += rkc->rk_op.rkq_qlen + rkc->rk_opq_cnt +
+			rd_atomic_get(&rkc->rk_batch_msgcnt);
+	}
+
+	return len;
 }
 
 
+/**
+ * Returns the recent send latency (microseconds) of the handle's slowest
+ * connection, see rk_broker.stats.tx_latency.
+ * A connection's latency halves for every second it has not sent
+ * anything, so a broker that was slow once is tried again eventually.
+ *
+ * Locality: any thread
+ */
+int64_t rd_kafka_tx_latency (rd_kafka_t *rk);
+
+
 /**
  * Returns the current reply queue length (messages from the broker waiting
  * for the application thread to consume).
@@ -488,14 +1037,14 @@ struct rd_kafkap_req {
 
 /**
  * Generic Multi-Request header.
+ * Each of the 'rkpmr_topicpart_cnt' parts that follow is laid out
+ * like a single request without the generic request header:
+ * TOPIC_LEN (16 bits), TOPIC, PARTITION and the request specific part.
  */
 struct rd_kafkap_multireq {
 	uint32_t rkpmr_len;
 	uint16_t rkpmr_type;
 	uint16_t rkpmr_topicpart_cnt;
-
-	uint32_t rkpr_topic_len;
-	char     rkpr_topic[0]; /* TOPIC and PARTITION follows */
 } RD_PACKED;
 
 
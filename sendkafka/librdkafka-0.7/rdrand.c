@@ -30,6 +30,28 @@
 #include "rdrand.h"
 
 
+__thread uint64_t rd_rand_state;
+
+
+uint64_t rd_rand_seed (void) {
+	struct timespec ts;
+	uint64_t x;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	/* Mix in what tells threads and processes apart. */
+	x = ((uint64_t)ts.tv_sec * 1000000000llu + ts.tv_nsec) ^
+		((uint64_t)getpid() << 32) ^
+		(uint64_t)(uintptr_t)&rd_rand_state;
+
+	/* splitmix64 finalizer: spread the bits, and avoid 0. */
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9llu;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebllu;
+	x ^= x >> 31;
+
+	return rd_rand_state = x ? : 1;
+}
+
 
 void rd_array_shuffle (void *base, size_t nmemb, size_t entry_size) {
 	int i;
@@ -39,6 +39,38 @@ static inline int rd_jitter (int low, int high) {
 }
 
 
+/**
+ * Per-thread state of rd_rand(), 0 until seeded.
+ */
+extern __thread uint64_t rd_rand_state;
+
+/**
+ * Seeds the calling thread's rd_rand() state, returns it (never 0).
+ */
+uint64_t rd_rand_seed (void);
+
+/**
+ * Returns a 32-bit pseudo random number from a per-thread xorshift64*
+ * generator, seeded on first use.
+ * Unlike rand(3) it takes no lock and needs no srand(3).
+ * Not for cryptographic use.
+ */
+static inline uint32_t rd_rand (void) RD_UNUSED;
+static inline uint32_t rd_rand (void) {
+	uint64_t x = rd_rand_state;
+
+	if (unlikely(!x))
+		x = rd_rand_seed();
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	rd_rand_state = x;
+
+	return (uint32_t)((x * 2685821657736338717ULL) >> 32);
+}
+
+
 /**
  * Shuffles (randomizes) an array using the modern Fisher-Yates algorithm.
  */
@@ -0,0 +1,421 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2012, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Snappy codec, see rdsnappy.h.
+ */
+
+#include "rd.h"
+#include "rdsnappy.h"
+
+#include <arpa/inet.h>
+
+
+#define RD_SNAPPY_BLOCK_SIZE     (1 << 16)
+#define RD_SNAPPY_HASH_BITS_MAX  14
+
+/* Element tags */
+#define RD_SNAPPY_LITERAL   0
+#define RD_SNAPPY_COPY_1    1  /* 1 byte offset */
+#define RD_SNAPPY_COPY_2    2  /* 2 byte offset */
+#define RD_SNAPPY_COPY_4    3  /* 4 byte offset */
+
+/* snappy-java (SnappyOutputStream) stream header */
+static const char rd_snappy_java_magic[8] = { 0x82, 'S','N','A','P','P','Y',0 };
+#define RD_SNAPPY_JAVA_HDR_SIZE  (8 + 4 + 4) /* magic, version, compat */
+
+
+static inline uint32_t rd_snappy_load32 (const char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t rd_snappy_hash (const char *p, int shift) {
+	return (rd_snappy_load32(p) * 0x1e35a7bd) >> shift;
+}
+
+
+static char *rd_snappy_emit_literal (char *op, const char *lit, int len) {
+	int n = len - 1;
+
+	if (n < 60)
+		*op++ = RD_SNAPPY_LITERAL | (n << 2);
+	else {
+		char *base = op++;
+		int cnt = 0;
+
+		while (n > 0) {
+			*op++ = n & 0xff;
+			n >>= 8;
+			cnt++;
+		}
+		*base = RD_SNAPPY_LITERAL | ((59 + cnt) << 2);
+	}
+
+	memcpy(op, lit, len);
+	return op + len;
+}
+
+
+/* Emits a copy of 4..64 bytes. */
+static char *rd_snappy_emit_copy64 (char *op, size_t offset, int len) {
+	if (len < 12 && offset < 2048) {
+		*op++ = RD_SNAPPY_COPY_1 | ((len - 4) << 2) | ((offset >> 8) << 5);
+		*op++ = offset & 0xff;
+	} else {
+		*op++ = RD_SNAPPY_COPY_2 | ((len - 1) << 2);
+		*op++ = offset & 0xff;
+		*op++ = (offset >> 8) & 0xff;
+	}
+	return op;
+}
+
+static char *rd_snappy_emit_copy (char *op, size_t offset, int len) {
+	/* Emit 64 byte copies but keep at least four bytes for the last. */
+	while (len >= 68) {
+		op = rd_snappy_emit_copy64(op, offset, 64);
+		len -= 64;
+	}
+
+	if (len > 64) {
+		op = rd_snappy_emit_copy64(op, offset, 60);
+		len -= 60;
+	}
+
+	return rd_snappy_emit_copy64(op, offset, len);
+}
+
+
+/**
+ * Compress one block (at most RD_SNAPPY_BLOCK_SIZE bytes) of input.
+ * Copies only reference data within the block.
+ */
+static char *rd_snappy_compress_block (const char *in, size_t len, char *op,
+				       uint16_t *table) {
+	const char *ip = in;
+	const char *ip_end = in + len;
+	const char *next_emit = in;
+	const int margin = 15; /* Room for the 4 byte hash loads. */
+	int bits = 8;
+	int shift;
+
+	while (bits < RD_SNAPPY_HASH_BITS_MAX && (1u << bits) < len)
+		bits++;
+	shift = 32 - bits;
+	memset(table, 0, sizeof(*table) << bits);
+
+	if (len >= margin) {
+		const char *ip_limit = in + len - margin;
+		uint32_t next_hash = rd_snappy_hash(++ip, shift);
+
+		while (1) {
+			/* Look for a match, skipping ahead faster the longer
+			 * we go without one (incompressible data). */
+			uint32_t skip = 32;
+			const char *next_ip = ip;
+			const char *candidate;
+
+			do {
+				uint32_t hash = next_hash;
+
+				ip = next_ip;
+				next_ip = ip + (skip++ >> 5);
+				if (unlikely(next_ip > ip_limit))
+					goto emit_remainder;
+
+				next_hash = rd_snappy_hash(next_ip, shift);
+				candidate = in + table[hash];
+				table[hash] = ip - in;
+			} while (rd_snappy_load32(ip) !=
+				 rd_snappy_load32(candidate));
+
+			op = rd_snappy_emit_literal(op, next_emit,
+						    ip - next_emit);
+
+			/* Emit copies for as long as the data keeps
+			 * matching directly after the previous copy. */
+			do {
+				const char *base = ip;
+				uint32_t hash;
+
+				ip += 4;
+				candidate += 4;
+				while (ip < ip_end && *ip == *candidate) {
+					ip++;
+					candidate++;
+				}
+
+				op = rd_snappy_emit_copy(op, base -
+							 (candidate -
+							  (ip - base)),
+							 ip - base);
+				next_emit = ip;
+				if (unlikely(ip >= ip_limit))
+					goto emit_remainder;
+
+				table[rd_snappy_hash(ip - 1, shift)] =
+					ip - in - 1;
+				hash = rd_snappy_hash(ip, shift);
+				candidate = in + table[hash];
+				table[hash] = ip - in;
+			} while (rd_snappy_load32(ip) ==
+				 rd_snappy_load32(candidate));
+
+			next_hash = rd_snappy_hash(++ip, shift);
+		}
+	}
+
+emit_remainder:
+	if (next_emit < ip_end)
+		op = rd_snappy_emit_literal(op, next_emit, ip_end - next_emit);
+
+	return op;
+}
+
+
+size_t rd_snappy_compress (const char *in, size_t len, char *out) {
+	uint16_t table[1 << RD_SNAPPY_HASH_BITS_MAX];
+	char *op = out;
+	size_t n = len;
+
+	/* Preamble: uncompressed length as a varint */
+	do {
+		*op++ = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+		n >>= 7;
+	} while (n > 0);
+
+	while (len > 0) {
+		size_t blen = RD_MIN(len, RD_SNAPPY_BLOCK_SIZE);
+
+		op = rd_snappy_compress_block(in, blen, op, table);
+		in += blen;
+		len -= blen;
+	}
+
+	return op - out;
+}
+
+
+/**
+ * Reads the uncompressed length preamble of a raw Snappy buffer.
+ * Returns the preamble size, or -1 on error.
+ */
+static int rd_snappy_uncompressed_length (const char *in, size_t len,
+					  size_t *declenp) {
+	size_t declen = 0;
+	int i;
+
+	for (i = 0 ; i < len && i < 5 ; i++) {
+		declen |= (size_t)(in[i] & 0x7f) << (7 * i);
+		if (!(in[i] & 0x80)) {
+			/* A copy element of at most 5 bytes yields at most
+			 * 64 bytes: reject impossible lengths from
+			 * malformed input before allocating them. */
+			if (declen > len * 64)
+				return -1;
+			*declenp = declen;
+			return i + 1;
+		}
+	}
+
+	return -1;
+}
+
+
+/**
+ * Decompress raw Snappy data (without its preamble) into 'out' which
+ * must be exactly 'outlen' (the preamble's length) bytes.
+ * Returns 0 on success or -1 on malformed input.
+ */
+static int rd_snappy_uncompress (const unsigned char *ip, size_t len,
+				 char *out, size_t outlen) {
+	const unsigned char *ip_end = ip + len;
+	char *op = out;
+	char *op_end = out + outlen;
+
+	while (ip < ip_end) {
+		unsigned char tag = *ip++;
+		size_t n;
+		size_t offset;
+
+		if ((tag & 3) == RD_SNAPPY_LITERAL) {
+			n = tag >> 2;
+			if (n >= 60) {
+				int bytes = n - 59;
+				int i;
+
+				if (ip + bytes > ip_end)
+					return -1;
+				for (n = 0, i = 0 ; i < bytes ; i++)
+					n |= (size_t)ip[i] << (8 * i);
+				ip += bytes;
+			}
+			n++;
+
+			if (ip + n > ip_end || op + n > op_end)
+				return -1;
+			memcpy(op, ip, n);
+			ip += n;
+			op += n;
+			continue;
+		}
+
+		switch (tag & 3)
+		{
+		case RD_SNAPPY_COPY_1:
+			if (ip + 1 > ip_end)
+				return -1;
+			n = ((tag >> 2) & 7) + 4;
+			offset = ((size_t)(tag >> 5) << 8) | ip[0];
+			ip += 1;
+			break;
+		case RD_SNAPPY_COPY_2:
+			if (ip + 2 > ip_end)
+				return -1;
+			n = (tag >> 2) + 1;
+			offset = ip[0] | ((size_t)ip[1] << 8);
+			ip += 2;
+			break;
+		default:
+			if (ip + 4 > ip_end)
+				return -1;
+			n = (tag >> 2) + 1;
+			offset = ip[0] | ((size_t)ip[1] << 8) |
+				((size_t)ip[2] << 16) | ((size_t)ip[3] << 24);
+			ip += 4;
+			break;
+		}
+
+		if (offset == 0 || offset > op - out || op + n > op_end)
+			return -1;
+
+		/* Copies may overlap their own output (run-length style),
+		 * so copy byte by byte unless they are far enough apart. */
+		if (offset >= n)
+			memcpy(op, op - offset, n);
+		else {
+			const char *src = op - offset;
+			size_t i;
+
+			for (i = 0 ; i < n ; i++)
+				op[i] = src[i];
+		}
+		op += n;
+	}
+
+	return op == op_end ? 0 : -1;
+}
+
+
+void *rd_snappy_decompress (const void *compressed, int compressed_len,
+			    uint64_t *decompressed_lenp) {
+	const char *in = compressed;
+	int pass;
+	char *decompressed = NULL;
+	size_t declen = 0;
+
+	if (compressed_len < sizeof(rd_snappy_java_magic) ||
+	    memcmp(in, rd_snappy_java_magic, sizeof(rd_snappy_java_magic))) {
+		/* Raw Snappy */
+		int r;
+
+		if ((r = rd_snappy_uncompressed_length(in, compressed_len,
+						       &declen)) == -1 ||
+		    !(decompressed = malloc(declen + 1)))
+			return NULL;
+
+		if (rd_snappy_uncompress((const unsigned char *)in + r,
+					 compressed_len - r,
+					 decompressed, declen) == -1) {
+			free(decompressed);
+			return NULL;
+		}
+
+		decompressed[declen] = '\0';
+		*decompressed_lenp = declen;
+		return decompressed;
+	}
+
+	/* snappy-java framing: a sequence of raw Snappy blocks, each
+	 * prefixed by its 32-bit big endian compressed length.
+	 * First pass (1): calculate decompressed size.
+	 * Second pass (2): perform actual decompression. */
+	for (pass = 1 ; pass <= 2 ; pass++) {
+		const char *p = in + RD_SNAPPY_JAVA_HDR_SIZE;
+		const char *end = in + compressed_len;
+		size_t of = 0;
+
+		if (p > end)
+			goto fail;
+
+		while (p < end) {
+			uint32_t blen;
+			size_t bdeclen;
+			int r;
+
+			if (p + sizeof(blen) > end)
+				goto fail;
+			memcpy(&blen, p, sizeof(blen));
+			blen = ntohl(blen);
+			p += sizeof(blen);
+
+			if (blen > end - p ||
+			    (r = rd_snappy_uncompressed_length(p, blen,
+							       &bdeclen)) == -1)
+				goto fail;
+
+			if (pass == 2 &&
+			    (of + bdeclen > declen ||
+			     rd_snappy_uncompress((const unsigned char *)p + r,
+						  blen - r, decompressed + of,
+						  bdeclen) == -1))
+				goto fail;
+
+			of += bdeclen;
+			p += blen;
+		}
+
+		if (pass == 1) {
+			declen = of;
+			if (!(decompressed = malloc(declen + 1)))
+				return NULL;
+			/* For convenience of the caller we nul-terminate
+			 * the buffer. */
+			decompressed[declen] = '\0';
+		}
+	}
+
+	*decompressed_lenp = declen;
+	return decompressed;
+
+fail:
+	if (decompressed)
+		free(decompressed);
+	return NULL;
+}
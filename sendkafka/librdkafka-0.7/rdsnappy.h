@@ -0,0 +1,69 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2012, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/**
+ * Snappy compression and decompression.
+ * Implements the raw Snappy block format
+ * (https://code.google.com/p/snappy/source/browse/trunk/format_description.txt)
+ * and, for decompression only, the framing used by snappy-java's
+ * SnappyOutputStream (which is what the Kafka JVM clients produce).
+ */
+
+
+/**
+ * Returns the maximum compressed size of 'len' bytes of input.
+ */
+static inline size_t rd_snappy_max_compressed_length (size_t len) {
+	return 32 + len + len / 6;
+}
+
+/**
+ * Compresses 'len' bytes of 'in' to 'out' in the raw Snappy format.
+ * 'out' must be at least rd_snappy_max_compressed_length(len) bytes.
+ *
+ * Returns the compressed length.
+ */
+size_t rd_snappy_compress (const char *in, size_t len, char *out);
+
+
+/**
+ * Snappy decompression returning the uncompressed data in a malloced
+ * buffer, for either raw Snappy or snappy-java framed input.
+ * The returned buffer is nul-terminated (the actual allocated length
+ * is '*decompressed_lenp'+1).
+ *
+ * The decompressed length is returned in '*decompressed_lenp'.
+ * Returns NULL on malformed input.
+ */
+void *rd_snappy_decompress (const void *compressed, int compressed_len,
+			    uint64_t *decompressed_lenp);
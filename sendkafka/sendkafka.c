@@ -31,7 +31,9 @@
  * (https://github.com/edenhill/librdkafka)
  */
 
+#define _GNU_SOURCE
 #include <ctype.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <string.h>
 #include <fcntl.h>
@@ -39,9 +41,24 @@
 #include <syslog.h>
 #include <sys/stat.h>
 #include<dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 /* Typical include path would be <librdkafka/rdkafkah>, but this program
  * is builtin from within the librdkafka source tree and thus differs. */
 #include "librdkafka-0.7/rdkafka.h"	/* for Kafka driver */
+#include "librdkafka-0.7/rdrand.h"
 
 /*
  *  declare function area
@@ -49,6 +66,7 @@
  */
 char *getcurrenttime();
 int read_config(const char *key, char *value, int size, const char *file);
+void read_producer_config(const char *file);
 
 void save_liberr_tolocal(const rd_kafka_t * rk, int level, const char *fac,
 	      const char *buf);
@@ -58,6 +76,7 @@ extern void rd_kafka_set_logger(void (*func)
 				  const char *fac, const char *buf));
 int save_log_tosyslog(int facility, int level, char *markname, char *loginfo);
 int save_error(int state, int level, char *info);
+void save_errorf(int level, const char *fmt, ...);
 
 void check_queuedata_size(rd_kafka_t ** rks, int num, char *pathname);
 
@@ -66,13 +85,16 @@ off_t get_file_size(char *pathname);
 void rename_file(char *pathname, int num);
 int rotate_logs(char *pathname);
 
-int  rotate_send_toqueue(rd_kafka_t * *rks, char *topic, int partitions, int tag,
-		     char *opbuf, int len, int rkcount);
-void producer(rd_kafka_t ** rks, char *topic, int partitions, int tag,
-	      char *buf, int len, int rkcount);
+int64_t broker_load(rd_kafka_t *rk);
+int select_broker(rd_kafka_topic_t **rkts, int rkcount);
+int  rotate_send_toqueue(rd_kafka_topic_t **rkts,
+		     int tag, rd_kafka_message_t *msgs, int cnt, int rkcount);
+void producer(rd_kafka_t ** rks, rd_kafka_topic_t **rkts,
+	      int tag, rd_kafka_message_t *msgs, int cnt, int rkcount);
+void set_partition_keys(rd_kafka_message_t *msgs, int cnt);
 
 void save_queuedata_tofile(rd_kafka_t ** rks, int rkcount);
-void save_snddata_tofile(char *opbuf);
+void save_snddata_tofile(const char *topic, rd_kafka_message_t *msgs, int cnt);
 static void stop(int sig);
 void usage(const char *cmd);
 size_t get_executable_path( char* processdir,char* processname, size_t len);
@@ -86,6 +108,20 @@ size_t get_executable_path( char* processdir,char* processname, size_t len);
  * g_run_tag is means run tages ,if 0 will exit, others run
  * g_logfilesize_max is means one errlog file max size
  * g_monitor_period is default  very 10 senconds will run mointorfunction(check queue size)
+ * g_conf is librdkafka producer configure, based on rd_kafka_defaultconf
+ * g_work_stealing if not 0 makes the broker handles peers, see rd_kafka_peers_set
+ * g_partition_key_field is the field of a line (1-based, blank separated, 0 the
+ * whole line) the consistent partitioner hashes
+ * g_max_record_size is the longest line sent as one message, longer lines are split
+ * g_read_buffer_size is the input buffer size, at least twice g_max_record_size
+ * g_framer_threads is the number of threads splitting stdin in lines (see
+ * pipeline_t), 0 reads and splits stdin on the main thread
+ * g_tail_files are the comma separated files followed instead of reading
+ * stdin, their offsets are saved in g_tail_offset_path (see tail_files)
+ * g_syslog_listen is the [host:]port syslog messages are received on
+ * instead of reading stdin, by g_syslog_threads threads, datagrams are
+ * cut at g_syslog_max_msg_size, and g_unix_listen the path of a Unix
+ * socket local programs send records to (see listen_worker_t)
  */
 static char  g_queue_data_filepath[1024] = "/var/log/sendkafka/queue.data";
 static char  g_error_logpath[1024] = "/var/log/sendkafka/error.log";
@@ -95,6 +131,80 @@ static int   g_logfilenum_max = 5;
 static int   g_run_tag = 1;
 static off_t g_logfilesize_max = 1000*1000;
 static int   g_monitor_period = 10;
+static rd_kafka_conf_t g_conf;
+static int   g_work_stealing = 1;
+static int   g_partition_key_field = 0;
+static int   g_max_record_size = 1000000;
+static int   g_read_buffer_size = 2*1000*1000;
+static int   g_framer_threads = 1;
+static char  g_tail_files[1024] = "";
+static char  g_tail_offset_path[1024] = "/var/log/sendkafka/tail.offsets";
+static char  g_syslog_listen[1024] = "";
+static int   g_syslog_threads = 2;
+static int   g_syslog_max_msg_size = 8192;
+static int   g_syslog_rcvbuf_size = 0;
+static char  g_unix_listen[1024] = "";
+
+/*
+ * line_chunk_t is a reference counted input buffer of g_read_buffer_size
+ * bytes, the messages are slices of it handed to librdkafka without
+ * copying, every message holds a reference that librdkafka drops
+ * through line_chunk_release (conf free_cb) once the message is sent,
+ * the reader holds one too, so a chunk stays until its last line is
+ * sent, however few of its lines are left
+ * LINE_CHUNK_FREE_MAX unreferenced chunks are kept for reuse, enough
+ * for the reader and the framers to go on without malloc, more
+ * would only hold on to memory a slow broker once needed
+ */
+#define LINE_CHUNK_FREE_MAX  4
+typedef struct line_chunk_s {
+	struct line_chunk_s *next;	/* free list link */
+	int  refcnt;
+	char buf[0];
+} line_chunk_t;
+
+/*
+ * line_reader_t reads input in chunks with read(2) and splits them in
+ * lines: a message is a line including its newline, lines longer than
+ * g_max_record_size are split
+ * newlines are looked for LINE_SCAN_BLOCK bytes at a time, the newline
+ * positions of the last block scanned are kept as a bit mask
+ * LINE_CHUNK_MSGS is the max number of lines handed over at once
+ */
+#define LINE_SCAN_BLOCK  64
+#define LINE_CHUNK_MSGS  1024
+typedef struct line_reader_s {
+	int  fd;
+	int  start;		/* first unconsumed byte in chunk */
+	int  end;		/* end of data in chunk */
+	int  scan;		/* end of the scanned block */
+	uint64_t nlmask;	/* newlines in the block ending at scan,
+				 * none before start */
+	line_chunk_t *chunk;
+} line_reader_t;
+
+void line_chunk_release(rd_kafka_t *rk, void *payload, size_t len,
+			void *opaque);
+void line_reader_init(line_reader_t *lr, int fd);
+int  read_lines(line_reader_t *lr, rd_kafka_message_t *msgs, int max_msgs);
+int  tail_files(rd_kafka_t **rks, rd_kafka_topic_t **rkts, int rkcount);
+
+/*
+ * topic_t is a topic lines are sent to, with a handle per broker
+ * g_topics[0] is the configured topic, the others are named by the
+ * Unix socket streams, see topic_get
+ */
+#define TOPICS_MAX  64
+typedef struct topic_s {
+	char *name;
+	rd_kafka_topic_t **rkts;	/* created by the main thread */
+} topic_t;
+
+static pthread_mutex_t g_topic_lock = PTHREAD_MUTEX_INITIALIZER;
+static topic_t g_topics[TOPICS_MAX];
+static int g_topic_cnt = 1;
+
+static int topic_get(const char *name, int len);
 
 /*
  * function signal function,if signal ,it will
@@ -169,6 +279,144 @@ int read_config(const char *key, char *value, int size, const char *file)
 	}
 }
 
+/*
+ * function read librdkafka producer configure
+ * (batching) from usr configure file to g_conf
+ */
+void read_producer_config(const char *file)
+{
+	char value[1024] = { 0 };
+
+	if (read_config("linger_ms", value, sizeof(value), file) > 0) {
+		g_conf.producer.linger_ms = atoi(value);
+	}
+	if (read_config("batch_msg_cnt", value, sizeof(value), file) > 0) {
+		g_conf.producer.batch_msg_cnt = atoi(value);
+	}
+	if (read_config("batch_size", value, sizeof(value), file) > 0) {
+		g_conf.producer.batch_size = atoi(value);
+	}
+	if (read_config("compression", value, sizeof(value), file) > 0) {
+		if (!strcasecmp(value, "gzip")) {
+			g_conf.producer.compression_codec =
+			    RD_KAFKA_COMPRESSION_GZIP;
+		} else if (!strcasecmp(value, "snappy")) {
+			g_conf.producer.compression_codec =
+			    RD_KAFKA_COMPRESSION_SNAPPY;
+		} else {
+			g_conf.producer.compression_codec =
+			    RD_KAFKA_COMPRESSION_NONE;
+		}
+	}
+	if (read_config("compression_level", value, sizeof(value), file) > 0) {
+		g_conf.producer.compression_level = atoi(value);
+	}
+	if (read_config("io_threads", value, sizeof(value), file) > 0) {
+		g_conf.producer.io_threads = atoi(value);
+	}
+	if (read_config("connections", value, sizeof(value), file) > 0) {
+		g_conf.producer.connections = atoi(value);
+	}
+	if (read_config("partitioner", value, sizeof(value), file) > 0) {
+		if (!strcasecmp(value, "random")) {
+			g_conf.producer.partitioner =
+			    rd_kafka_partitioner_random;
+		} else if (!strcasecmp(value, "round_robin")) {
+			g_conf.producer.partitioner =
+			    rd_kafka_partitioner_round_robin;
+		} else if (!strcasecmp(value, "consistent")) {
+			g_conf.producer.partitioner =
+			    rd_kafka_partitioner_consistent;
+		} else if (!strcasecmp(value, "sticky")) {
+			g_conf.producer.partitioner =
+			    rd_kafka_partitioner_sticky;
+		} else {
+			save_errorf(LOG_ERR, "unknown partitioner %s, "
+				    "sticky used\n", value);
+			g_conf.producer.partitioner =
+			    rd_kafka_partitioner_sticky;
+		}
+	}
+	if (read_config("partition_key_field", value, sizeof(value), file) > 0) {
+		g_partition_key_field = atoi(value);
+	}
+	if (read_config("work_stealing", value, sizeof(value), file) > 0) {
+		g_work_stealing = atoi(value);
+	}
+	if (read_config("max_record_size", value, sizeof(value), file) > 0) {
+		g_max_record_size = atoi(value);
+	}
+	if (read_config("read_buffer_size", value, sizeof(value), file) > 0) {
+		g_read_buffer_size = atoi(value);
+	}
+	if (read_config("framer_threads", value, sizeof(value), file) > 0) {
+		g_framer_threads = atoi(value);
+	}
+	if (read_config("tail_files", value, sizeof(value), file) > 0) {
+		strcpy(g_tail_files, value);
+	}
+	if (read_config("tail_offset_path", value, sizeof(value), file) > 0) {
+		strcpy(g_tail_offset_path, value);
+	}
+	if (read_config("syslog_listen", value, sizeof(value), file) > 0) {
+		strcpy(g_syslog_listen, value);
+	}
+	if (read_config("syslog_threads", value, sizeof(value), file) > 0) {
+		g_syslog_threads = atoi(value);
+	}
+	if (read_config("syslog_max_msg_size", value, sizeof(value), file) > 0) {
+		g_syslog_max_msg_size = atoi(value);
+	}
+	if (read_config("syslog_rcvbuf_size", value, sizeof(value), file) > 0) {
+		g_syslog_rcvbuf_size = atoi(value);
+	}
+	if (read_config("unix_listen", value, sizeof(value), file) > 0) {
+		strcpy(g_unix_listen, value);
+	}
+	if (read_config("max_outq_msg_cnt", value, sizeof(value), file) > 0) {
+		g_conf.producer.max_outq_msg_cnt = atoi(value);
+	}
+	if (read_config("max_outq_bytes", value, sizeof(value), file) > 0) {
+		g_conf.producer.max_outq_bytes = atoll(value);
+	}
+	if (read_config("outq_block_ms", value, sizeof(value), file) > 0) {
+		g_conf.producer.outq_block_ms = atoi(value);
+	}
+	if (read_config("connect_timeout_ms", value, sizeof(value), file) > 0) {
+		g_conf.connect_timeout_ms = atoi(value);
+	}
+	if (read_config("reconnect_backoff_ms", value, sizeof(value), file) > 0) {
+		g_conf.reconnect_backoff_ms = atoi(value);
+	}
+	if (read_config("reconnect_backoff_max_ms", value, sizeof(value), file) > 0) {
+		g_conf.reconnect_backoff_max_ms = atoi(value);
+	}
+	if (read_config("socket_sndbuf_size", value, sizeof(value), file) > 0) {
+		g_conf.socket.sndbuf_size = atoi(value);
+	}
+	if (read_config("socket_rcvbuf_size", value, sizeof(value), file) > 0) {
+		g_conf.socket.rcvbuf_size = atoi(value);
+	}
+	if (read_config("socket_nodelay", value, sizeof(value), file) > 0) {
+		g_conf.socket.nodelay = atoi(value);
+	}
+	if (read_config("socket_cork", value, sizeof(value), file) > 0) {
+		g_conf.socket.cork = atoi(value);
+	}
+	if (read_config("socket_keepalive", value, sizeof(value), file) > 0) {
+		g_conf.socket.keepalive = atoi(value);
+	}
+	if (read_config("socket_keepalive_idle", value, sizeof(value), file) > 0) {
+		g_conf.socket.keepalive_idle = atoi(value);
+	}
+	if (read_config("socket_keepalive_intvl", value, sizeof(value), file) > 0) {
+		g_conf.socket.keepalive_intvl = atoi(value);
+	}
+	if (read_config("socket_keepalive_cnt", value, sizeof(value), file) > 0) {
+		g_conf.socket.keepalive_cnt = atoi(value);
+	}
+}
+
 /*
  * function show some help info for usr when the 
  * usr not expertly
@@ -197,6 +445,38 @@ void usage(const char *cmd)
 		"   err_filelibrdkafkalogpath = <erflogpath>   path+name example: /var/log/sendkafka/error.log\n"
 		"   g_logsavelocal_tag = <g_logsavelocal_tag>   default 0 means write log in local others rersyslog\n"
 		"   g_logfilenum_max = <g_logfilenum_max>   default 5  , must between 0--9\n"
+		"   linger_ms = <ms>   wait for more lines before sending a batch, default 0\n"
+		"   batch_msg_cnt = <cnt>   max lines in one produce request, default 10000\n"
+		"   batch_size = <bytes>   max bytes in one produce request, default 1000000\n"
+		"   compression = <none|gzip|snappy>   compress each batch, default none\n"
+		"   compression_level = <level>   gzip level 0--9, default -1 (zlib default)\n"
+		"   io_threads = <cnt>   serve all broker connections from <cnt> epoll threads, default 0 (a thread per connection)\n"
+		"   connections = <cnt>   TCP connections per broker, partitions are spread over them, default 1\n"
+		"   partitioner = random|round_robin|sticky|consistent   how lines are spread over the partitions, default sticky\n"
+		"   partition_key_field = <n>   consistent partitioner: hash the n-th blank separated field of a line, 0 the whole line, default 0\n"
+		"   work_stealing = 0|1   brokers that are up take over lines queued for brokers that are down or backed up, default 1\n"
+		"   max_record_size = <bytes>   longest line sent as one message, longer lines are split, default 1000000\n"
+		"   read_buffer_size = <bytes>   input is read in chunks of this size, at least twice max_record_size, default 2000000\n"
+		"   framer_threads = <cnt>   threads splitting stdin in lines between the reader thread and the sending thread, 0 does it all on one thread, default 1\n"
+		"   tail_files = <path1[,path2...]>   follow these files (rotation included) instead of reading stdin\n"
+		"   tail_offset_path = <path>   where the offsets of the tailed files are saved, default /var/log/sendkafka/tail.offsets\n"
+		"   syslog_listen = <[host:]port>   receive syslog over UDP and TCP (octet counted or newline framed) instead of reading stdin\n"
+		"   syslog_threads = <cnt>   threads receiving syslog, each with its own sockets, default 2\n"
+		"   syslog_max_msg_size = <bytes>   longer datagrams are truncated, default 8192\n"
+		"   syslog_rcvbuf_size = <bytes>   UDP socket receive buffer size, default 0 (system default)\n"
+		"   unix_listen = <path>   receive length prefixed records from local programs on this Unix socket, each stream naming its topic first\n"
+		"   max_outq_msg_cnt = <cnt>   max lines queued per broker, default 0 (unlimited)\n"
+		"   max_outq_bytes = <bytes>   max bytes of lines queued per broker, default 0 (unlimited)\n"
+		"   outq_block_ms = <ms>   wait this long for room in a full broker queue before trying the next broker, -1 waits forever, default 0\n"
+		"   connect_timeout_ms = <ms>   give up on a broker address after this long, default 1000\n"
+		"   reconnect_backoff_ms = <ms>   first wait once all broker addresses failed, doubling up to reconnect_backoff_max_ms, default 100\n"
+		"   reconnect_backoff_max_ms = <ms>   longest wait between reconnect rounds, default 10000\n"
+		"   socket_sndbuf_size = <bytes>   broker socket send buffer size, default 0 (system default)\n"
+		"   socket_rcvbuf_size = <bytes>   broker socket receive buffer size, default 0 (system default)\n"
+		"   socket_nodelay = 0|1   disable Nagle's algorithm on the broker socket, default 0\n"
+		"   socket_cork = 0|1   cork the broker socket while writing produce requests, default 0\n"
+		"   socket_keepalive = 0|1   enable TCP keepalive on the broker socket, default 0\n"
+		"   socket_keepalive_idle|intvl|cnt = <n>   keepalive idle time (s), probe interval (s), probe count, default 0 (system default)\n"
 		"\n", cmd);
 	exit(2);
 }
@@ -464,6 +744,22 @@ void save_error_tolocal(char *errlogpath, char *errinfo)
 
 
 
+/*
+ * function save_error a printf formatted message
+ */
+void save_errorf(int level, const char *fmt, ...)
+{
+	char *buf = NULL;
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (vasprintf(&buf, fmt, ap) != -1) {
+		save_error(g_logsavelocal_tag, level, buf);
+		free(buf);
+	}
+	va_end(ap);
+}
+
 /*
  * function it will write some log info to rsyslog 
  * facility: log  type,level: log priority,markname 
@@ -508,10 +804,30 @@ int save_error(int state, int level, char *info)
 	return 0;
 }
 
+/*
+ * function append a record to fd framed like the Unix socket records,
+ * by its length, 4 bytes big-endian, as it may hold newlines
+ */
+static void write_record(int fd, const void *payload, size_t len)
+{
+	unsigned char hdr[4] = { len >> 24, len >> 16, len >> 8, len };
+	struct iovec iov[2] = {
+		{ iov_base: hdr, iov_len: sizeof(hdr) },
+		{ iov_base: (void *)payload, iov_len: len },
+	};
+
+	writev(fd, iov, 2);
+}
+
 /*
  * function: check librdkafka queue and write it to  
  * local file if the queue not empty,the path will
  * depend on usr configure, default /var/log/sendkafka
+ * the kafka threads are stopped first, so that no message is
+ * in flight between a queue and a thread while saving, the
+ * handles can then only be destroyed
+ * messages of other topics than the configured one (see topic_t)
+ * go to data_path.<topic>, as records (see write_record)
  */
 void save_queuedata_tofile(rd_kafka_t ** rks, int rkcount)
 {
@@ -527,107 +843,193 @@ void save_queuedata_tofile(rd_kafka_t ** rks, int rkcount)
 		exit(5);
 	}
 
+	struct rd_kafka_op_head_s rkoq = TAILQ_HEAD_INITIALIZER(rkoq);
 	rd_kafka_op_t *rko = NULL;
+	rd_kafka_op_t *next = NULL;
+	int fds[TOPICS_MAX];
+	char *path = NULL;
 	int i = 0;
+	int t = 0;
+
+	fds[0] = fd;
+	for (t = 1; t < TOPICS_MAX; t++)
+		fds[t] = -1;
+
 	for (i = 0; i < rkcount; i++) {
-		while (rd_kafka_outq_len(rks[i]) > 0) {
-			rko =
-			    rd_kafka_q_read(&(rks[i]->rk_op), RD_POLL_INFINITE);
-			write(fd, rko->rko_payload, rko->rko_len);
+		rd_kafka_stop(rks[i]);
+		rd_kafka_outq_drain(rks[i], &rkoq);
+		for (rko = TAILQ_FIRST(&rkoq); rko; rko = next) {
+			next = TAILQ_NEXT(rko, rko_link);
+			t = rko->rko_rkt ?
+				topic_get(rko->rko_rkt->rkt_topic,
+					  strlen(rko->rko_rkt->rkt_topic)) : 0;
+			if (t > 0 && fds[t] == -1 &&
+			    asprintf(&path, "%s.%s", g_queue_data_filepath,
+				     g_topics[t].name) != -1) {
+				fds[t] = open(path, O_WRONLY | O_APPEND | O_CREAT,
+					      0666);
+				if (fds[t] == -1)
+					save_errorf(LOG_CRIT, "open %s fail: %s\n",
+						    path, strerror(errno));
+				free(path);
+			}
+			if (t > 0 && fds[t] != -1)
+				write_record(fds[t], rko->rko_payload,
+					     rko->rko_len);
+			else
+				write(fds[0], rko->rko_payload, rko->rko_len);
+			rd_kafka_op_destroy(rks[i], rko);
 		}
+		TAILQ_INIT(&rkoq);
 	}
 
-	close(fd);
+	for (t = 0; t < TOPICS_MAX; t++)
+		if (fds[t] != -1)
+			close(fds[t]);
 
 }
 
 /*
- * function save opbuf to local file when error exit
- * and the file path will depends on usr configure
- * default /var/log/sendkafka
+ * function save the cnt messages msgs that could not be queued
+ * to local file when error exit, appended to the queue data
+ * file that depends on usr configure, default /var/log/sendkafka
+ * messages of other topics than the configured one go to
+ * data_path.<topic> as records, like in save_queuedata_tofile
  */
-void save_snddata_tofile(char *opbuf)
+void save_snddata_tofile(const char *topic, rd_kafka_message_t *msgs, int cnt)
 {
-	if (opbuf == NULL || strlen(opbuf))
-		return;
-	if (access(g_queue_data_filepath,F_OK) ==  0) {
-		unlink(g_queue_data_filepath);
-	}
+	char *path = g_queue_data_filepath;
+	int records = strcmp(topic, g_topics[0].name) != 0;
+	int i = 0;
+	int fd = -1;
 
-	int fd = open(g_queue_data_filepath, O_WRONLY | O_APPEND | O_CREAT, 0666);
+	if (records &&
+	    asprintf(&path, "%s.%s", g_queue_data_filepath, topic) == -1) {
+		path = g_queue_data_filepath;
+		records = 0;
+	}
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0666);
 
 	if (fd == -1) {
-		char buf[100] = { 0 };
-		sprintf(buf, "%d  line open %s file  fail...", __LINE__ - 4,g_queue_data_filepath);
-
-		perror(buf);
-		save_error(g_logsavelocal_tag, LOG_CRIT, buf);
-
+		save_errorf(LOG_CRIT, "open %s fail: %s\n", path, strerror(errno));
 		exit(6);
 	}
-
-	write(fd, opbuf, strlen(opbuf));
+	if (path != g_queue_data_filepath)
+		free(path);
+
+	for (i = 0; i < cnt; i++) {
+		if (records)
+			write_record(fd, msgs[i].payload, msgs[i].len);
+		else
+			write(fd, msgs[i].payload, msgs[i].len);
+	}
 
 	close(fd);
 
 }
 
 /*
- * function get stdin or local file opbuf to librdkafka queue
- * if fail will roate very broker queue,if success return 0
- * else will return 1 
+ * function score how loaded a broker handle is, lower is better:
+ * its queued messages weighted by its recent send latency.
+ * a handle with no connection up scores behind every healthy one.
+ */
+int64_t broker_load(rd_kafka_t *rk)
+{
+	int64_t outq = rd_kafka_outq_len(rk);
+	int up = 0;
+	int i;
+
+	for (i = 0; i < rk->rk_conn_cnt; i++)
+		if (rk->rk_conns[i]->rk_state == RD_KAFKA_STATE_UP)
+			up++;
+
+	if (!up)
+		return INT64_MAX / 2 + outq;
+
+	/* the 1ms floor keeps a near zero latency from making the
+	 * queue depth moot */
+	return (rd_kafka_tx_latency(rk) + 1000) * (outq + 1) / up;
+}
+
+/*
+ * function pick the broker handle to try first: the less loaded of
+ * two picked at random (power of two choices), which steers away
+ * from slow brokers without herding every chunk onto one broker.
+ */
+int select_broker(rd_kafka_topic_t **rkts, int rkcount)
+{
+	int a, b;
+
+	if (rkcount < 2)
+		return 0;
+
+	a = rd_rand() % rkcount;
+	b = rd_rand() % (rkcount - 1);
+	if (b >= a)
+		b++;
+
+	return broker_load(rd_kafka_topic_handle(rkts[b])) <
+		broker_load(rd_kafka_topic_handle(rkts[a])) ? b : a;
+}
+
+/*
+ * function hand a chunk of stdin or local file messages over to
+ * librdkafka queue at once, starting with the broker select_broker
+ * picks, messages a broker queue did not accept are rotated to the
+ * next broker queue.
+ * returns the number of messages no broker queue accepted (0 if all
+ * were sent), these are the last ones in msgs
  */
-int rotate_send_toqueue(rd_kafka_t ** rks, char *topic, int partitions, int tag,
-	      char *opbuf, int len, int rkcount)
+int rotate_send_toqueue(rd_kafka_topic_t **rkts,
+		int tag, rd_kafka_message_t *msgs, int cnt, int rkcount)
 {
 	int i = 0;
-	int partition = 0;
 	int rk = 0;
 	int ret = 0;
-	srand(time(NULL));
-	rk = rand() % rkcount;
+	rk = select_broker(rkts, rkcount);
 
-	for (; i < rkcount; ++i, ++rk) {
+	for (; i < rkcount && cnt > 0; ++i, ++rk) {
 		rk %= rkcount;
-		partition = rand() % partitions;
-		ret =
-		    rd_kafka_produce(rks[rk], topic, partition, tag, opbuf, len);
-		if (ret == 0) {
-			return 0;
-		} else {
-			char *buf = calloc(1, strlen(opbuf) + 128);
-			sprintf(buf, "sendkafka[%d]: failed: %s\n",
-				getpid(),opbuf);
+		ret = rd_kafka_topic_produce_batch(rkts[rk],
+						   RD_KAFKA_PARTITION_UA, tag,
+						   msgs, cnt);
+		msgs += ret;
+		cnt -= ret;
+		if (cnt > 0) {
+			char buf[128] = { 0 };
+			sprintf(buf, "sendkafka[%d]: failed: %d messages\n",
+				getpid(), cnt);
 			save_error(g_logsavelocal_tag, LOG_INFO, buf);
-			free(buf);
-			buf = NULL;
-			continue;
 		}
 	}
 
-	return 1;
+	return cnt;
 
 }
 
 /*
- * function circle roate send opbuf to librdkafka queue ,
+ * function circle roate send a chunk of messages to librdkafka queue ,
  * if the five time all failed it  will exit , at the
  * same time will write some error info  to local file 
  * and check librdkafka queue data if it not empty then
  * will write queuedata file
  *
  */
-void producer(rd_kafka_t * *rks, char *topic, int partitions, int tag,
-		     char *opbuf, int len, int rkcount)
+void producer(rd_kafka_t * *rks, rd_kafka_topic_t **rkts,
+		     int tag, rd_kafka_message_t *msgs, int cnt, int rkcount)
 {
 	int failnum = 0;
-	int s = 1;
+	int s = cnt;
+
 	while (s) {
-		s = rotate_send_toqueue(rks, topic, partitions, RD_KAFKA_OP_F_FREE, opbuf,
-			      len, rkcount);
+		s = rotate_send_toqueue(rkts, tag,
+				msgs + cnt - s, s, rkcount);
 		check_queuedata_size(rks, rkcount, g_monitor_qusizelogpath);
-		if (s == 1) {
-			sleep(1);
+		if (s > 0) {
+			/* produce calls that block for queue room already
+			 * waited */
+			if (!g_conf.producer.outq_block_ms)
+				sleep(1);
 			if (++failnum == 5) {
 				char timebuf[50] = { 0 };
 				strcpy(timebuf, getcurrenttime());
@@ -638,7 +1040,8 @@ void producer(rd_kafka_t * *rks, char *topic, int partitions, int tag,
 				char buf[]="all broker down";
 				save_error(g_logsavelocal_tag, LOG_INFO, buf);
 
-				save_snddata_tofile(opbuf);
+				save_snddata_tofile(rkts[0]->rkt_topic,
+						    msgs + cnt - s, s);
 				save_queuedata_tofile(rks, rkcount);
 				exit(7);
 			}
@@ -646,114 +1049,1905 @@ void producer(rd_kafka_t * *rks, char *topic, int partitions, int tag,
 	}
 }
 
+/*
+ * function point each line's partitioning key at its
+ * g_partition_key_field-th blank separated field, or the whole line,
+ * lines without that field get no key (a random partition)
+ */
+void set_partition_keys(rd_kafka_message_t *msgs, int cnt)
+{
+	int i, f;
 
+	for (i = 0; i < cnt; i++) {
+		const char *p = msgs[i].payload;
+		const char *end = p + msgs[i].len;
+		const char *key = NULL;
 
+		if (end > p && end[-1] == '\n')
+			end--;
 
+		if (g_partition_key_field <= 0) {
+			msgs[i].key = p;
+			msgs[i].key_len = end - p;
+			continue;
+		}
 
-int main(int argc, char *argv[],char *envp[])
-{
-	rd_kafka_t *rks[1024] = { 0 };
-	int rkcount = 0;
-	char value[1024] = { 0 };
-	char brokers[1024] = "localhost:9092";
-	char *broker = NULL;
-	char topic[1024] = "topic";
-	int sendcnt = 0;
-	int partitions = 4;
-	int opt;
-	int len = 0;
-	char *opbuf = NULL;
-	char config_file[1024] = "";
-	char path[PATH_MAX] = {0};
-	char processname[1024] = {0};
+		for (f = 0; f < g_partition_key_field && p < end; f++) {
+			while (p < end && (*p == ' ' || *p == '\t'))
+				p++;
+			key = p;
+			while (p < end && *p != ' ' && *p != '\t')
+				p++;
+		}
 
-	get_executable_path(path,processname,sizeof(processname));
-	snprintf(config_file, sizeof(config_file), "/etc/sendkafka/%s.conf", processname);
+		if (f == g_partition_key_field && p > key) {
+			msgs[i].key = key;
+			msgs[i].key_len = p - key;
+		} else {
+			msgs[i].key = NULL;
+			msgs[i].key_len = 0;
+		}
+	}
+}
 
+static pthread_mutex_t g_chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static line_chunk_t *g_chunk_free = NULL;
+static int g_chunk_freecnt = 0;
 
-	if (read_config("brokers", value, sizeof(value), config_file)
-	    > 0) {
-		strcpy(brokers, value);
+/*
+ * function get an unused chunk, holding one reference
+ */
+static line_chunk_t *line_chunk_get(void)
+{
+	line_chunk_t *chunk;
+
+	pthread_mutex_lock(&g_chunk_lock);
+	if ((chunk = g_chunk_free)) {
+		g_chunk_free = chunk->next;
+		g_chunk_freecnt--;
 	}
-	if (read_config("topic", value, sizeof(value),config_file) >
-	    0) {
-		strcpy(topic, value);
+	pthread_mutex_unlock(&g_chunk_lock);
+
+	if (!chunk &&
+	    !(chunk = malloc(sizeof(*chunk) + g_read_buffer_size))) {
+		save_error(g_logsavelocal_tag, LOG_CRIT,
+			   "line chunk malloc fail...");
+		exit(10);
 	}
-	if (read_config
-	    ("partitions", value, sizeof(value), config_file) > 0) {
-		partitions = atoi(value);
-		if (partitions <= 0 || partitions > 256) {
-			partitions = 4;
-		}
+	chunk->refcnt = 1;
+	return chunk;
+}
+
+/*
+ * function drop a reference to chunk, the last one puts it back
+ * on the free list (or frees it), any thread
+ */
+static void line_chunk_put(line_chunk_t *chunk)
+{
+	if (__sync_sub_and_fetch(&chunk->refcnt, 1) > 0)
+		return;
+
+	pthread_mutex_lock(&g_chunk_lock);
+	if (g_chunk_freecnt < LINE_CHUNK_FREE_MAX) {
+		chunk->next = g_chunk_free;
+		g_chunk_free = chunk;
+		g_chunk_freecnt++;
+		chunk = NULL;
 	}
+	pthread_mutex_unlock(&g_chunk_lock);
 
-	if (read_config
-	    		("data_path", value, sizeof(value),
-	     		config_file) > 0) {
-		strcpy(g_queue_data_filepath, value);
+	free(chunk);
+}
+
+/*
+ * function librdkafka free_cb, called once a message is sent,
+ * opaque is the message's chunk
+ */
+void line_chunk_release(rd_kafka_t *rk, void *payload, size_t len,
+			void *opaque)
+{
+	line_chunk_put(opaque);
+}
+
+void line_reader_init(line_reader_t *lr, int fd)
+{
+	/* messages from the previous input may still be queued,
+	 * they keep the old chunk until sent */
+	if (lr->chunk)
+		line_chunk_put(lr->chunk);
+	lr->chunk = line_chunk_get();
+	lr->fd = fd;
+	lr->start = 0;
+	lr->end = 0;
+	lr->scan = 0;
+	lr->nlmask = 0;
+}
+
+/*
+ * function bit mask of the newlines in the LINE_SCAN_BLOCK bytes at p
+ */
+static inline uint64_t scan_block(const char *p)
+{
+#ifdef __SSE2__
+	const __m128i nl = _mm_set1_epi8('\n');
+	uint64_t m0 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		_mm_loadu_si128((const __m128i *)p), nl));
+	uint64_t m1 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		_mm_loadu_si128((const __m128i *)(p + 16)), nl));
+	uint64_t m2 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		_mm_loadu_si128((const __m128i *)(p + 32)), nl));
+	uint64_t m3 = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		_mm_loadu_si128((const __m128i *)(p + 48)), nl));
+
+	return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+#else
+	uint64_t mask = 0;
+	int i;
+
+	for (i = 0; i < LINE_SCAN_BLOCK; i++)
+		if (p[i] == '\n')
+			mask |= 1ULL << i;
+	return mask;
+#endif
+}
+
+/*
+ * function find the first newline in lr's chunk from lr->start up to
+ * limit, returns its offset or -1
+ * whole blocks are scanned once, however many lines they hold, the
+ * tail of the data that is not a whole block yet goes to memchr
+ */
+static int next_newline(line_reader_t *lr, int limit)
+{
+	const char *buf = lr->chunk->buf;
+	char *nl;
+
+	if (lr->scan <= lr->start) {
+		lr->scan = lr->start;
+		lr->nlmask = 0;
 	}
-	if (read_config
-			("error_path", value, sizeof(value),
-			 config_file) > 0) {
-		strcpy(g_error_logpath, value);
+
+	while (!lr->nlmask) {
+		if (lr->scan >= limit || lr->scan + LINE_SCAN_BLOCK > lr->end) {
+			if (lr->scan >= limit)
+				return -1;
+			nl = memchr(buf + lr->scan, '\n', limit - lr->scan);
+			return nl ? nl - buf : -1;
+		}
+		lr->nlmask = scan_block(buf + lr->scan);
+		lr->scan += LINE_SCAN_BLOCK;
 	}
 
-	if (read_config
-			("logsavelocal_tag", value, sizeof(value),
-			 config_file) > 0) {
-		g_logsavelocal_tag = atoi(value);
+	limit -= lr->scan - LINE_SCAN_BLOCK;
+	return __builtin_ctzll(lr->nlmask) < limit ?
+		lr->scan - LINE_SCAN_BLOCK + __builtin_ctzll(lr->nlmask) : -1;
+}
+
+/*
+ * function split the complete lines buffered in lr to msgs (slices
+ * of lr's chunk, each holding a chunk reference), at most max_msgs,
+ * returns the number of lines
+ */
+static int split_lines(line_reader_t *lr, rd_kafka_message_t *msgs,
+		       int max_msgs, int eof)
+{
+	int cnt = 0;
+	while (cnt < max_msgs && lr->start < lr->end) {
+		char *p = lr->chunk->buf + lr->start;
+		int avail = lr->end - lr->start;
+		int len = avail < g_max_record_size ? avail : g_max_record_size;
+		int nl = next_newline(lr, lr->start + len);
+
+		if (nl != -1) {
+			len = nl - lr->start + 1;
+			/* drop it from the mask, if it came from there */
+			if (nl < lr->scan)
+				lr->nlmask &= lr->nlmask - 1;
+		} else if (len < g_max_record_size && !eof)
+			break;	/* wait for the rest of the line */
+
+		msgs[cnt].payload = p;
+		msgs[cnt].len = len;
+		msgs[cnt].err = 0;
+		msgs[cnt].opaque = lr->chunk;
+		cnt++;
+		lr->start += len;
 	}
-	if (read_config
-			("lognum_max", value, sizeof(value),
-			 config_file) > 0) {
-		g_logfilenum_max = atoi(value);
+	if (cnt > 0) {
+		__sync_add_and_fetch(&lr->chunk->refcnt, cnt);
+		if (g_conf.producer.partitioner ==
+		    rd_kafka_partitioner_consistent)
+			set_partition_keys(msgs, cnt);
 	}
+	return cnt;
+}
 
-	if (read_config
-			("monitor_period", value, sizeof(value),
-			 config_file) > 0) {
-		g_monitor_period = atoi(value);
-	}
+/*
+ * function make room in a full chunk: move the partial line to the
+ * front, or to a new chunk if queued messages still use this one
+ */
+static void line_reader_renew(line_reader_t *lr)
+{
+	line_chunk_t *old = lr->chunk;
+	int len = lr->end - lr->start;
+
+	if (old->refcnt > 1) {
+		lr->chunk = line_chunk_get();
+		memcpy(lr->chunk->buf, old->buf + lr->start, len);
+		line_chunk_put(old);
+	} else
+		memmove(old->buf, old->buf + lr->start, len);
+
+	lr->start = 0;
+	lr->end = len;
+	lr->scan = 0;
+	lr->nlmask = 0;
+}
 
-	if (read_config
-			("logsize_max", value, sizeof(value),
-			 config_file) > 0) {
-		g_logfilesize_max = atoi(value);
+/*
+ * function read the next chunk of lines from lr's fd to msgs,
+ * returns the number of lines, 0 at end of input and -1 on error
+ */
+int read_lines(line_reader_t *lr, rd_kafka_message_t *msgs, int max_msgs)
+{
+	int cnt = 0;
+	ssize_t r;
+
+	while (!(cnt = split_lines(lr, msgs, max_msgs, 0))) {
+		/* fill the chunk before starting another one, the
+		 * lines already handed out stay where they are */
+		if (lr->end == g_read_buffer_size)
+			line_reader_renew(lr);
+
+		r = read(lr->fd, lr->chunk->buf + lr->end,
+			 g_read_buffer_size - lr->end);
+		if (r <= 0) {
+			/* pass on a last line without newline */
+			if ((cnt = split_lines(lr, msgs, max_msgs, 1)) > 0)
+				return cnt;
+			return r == 0 ? 0 : -1;
+		}
+		lr->end += r;
 	}
 
-	if (read_config
-			("queue_sizepath", value, sizeof(value),
-			 config_file) > 0) {
-		strcpy(g_monitor_qusizelogpath, value);
-	}
+	return cnt;
+}
 
-	while ((opt = getopt(argc, argv, "hb:c:d:p:t:o:m:n:l:x:")) != -1) {
-		switch (opt) {
-			case 'b':
-				strncpy(brokers, optarg, sizeof(brokers));
-				brokers[sizeof(brokers) - 1] = '\0';
+/*
+ * function read the next records written by write_record from lr's fd
+ * to msgs, like read_lines, a record cut by the end of the input or
+ * longer than g_max_record_size ends it, returns the number of records,
+ * 0 at end of input and -1 on error
+ */
+static int read_records(line_reader_t *lr, rd_kafka_message_t *msgs,
+			int max_msgs)
+{
+	int cnt = 0;
+	ssize_t r;
+
+	for (;;) {
+		while (cnt < max_msgs && lr->end - lr->start >= 4) {
+			unsigned char *p = (unsigned char *)lr->chunk->buf +
+				lr->start;
+			uint32_t len = (p[0] << 24) | (p[1] << 16) |
+				(p[2] << 8) | p[3];
+
+			if (len > (uint32_t)g_max_record_size)
+				return cnt ? cnt : -1;
+			if ((uint32_t)(lr->end - lr->start) - 4 < len)
 				break;
-			case 'c':
-				if (read_config("brokers", value, sizeof(value), optarg)
-						> 0) {
-					strcpy(brokers, value);
-				}
+			msgs[cnt].payload = (char *)p + 4;
+			msgs[cnt].len = len;
+			msgs[cnt].err = 0;
+			msgs[cnt].opaque = lr->chunk;
+			cnt++;
+			lr->start += 4 + len;
+		}
+		if (cnt > 0)
+			break;
 
-				if (read_config("topic", value, sizeof(value), optarg) >
-						0) {
-					strcpy(topic, value);
-				}
+		if (lr->end == g_read_buffer_size)
+			line_reader_renew(lr);
+		r = read(lr->fd, lr->chunk->buf + lr->end,
+			 g_read_buffer_size - lr->end);
+		if (r <= 0)
+			return r == 0 ? 0 : -1;
+		lr->end += r;
+	}
 
-				if (read_config
-						("partitions", value, sizeof(value), optarg) > 0) {
-					partitions = atoi(value);
-					if (partitions <= 0 || partitions > 256) {
-						partitions = 4;
-					}
-				}
+	__sync_add_and_fetch(&lr->chunk->refcnt, cnt);
+	if (g_conf.producer.partitioner == rd_kafka_partitioner_consistent)
+		set_partition_keys(msgs, cnt);
+	return cnt;
+}
 
-				if (read_config
-						("data_path", value, sizeof(value),
+/*
+ * ring_t is a bounded single producer single consumer ring of pointers
+ * connecting two pipeline stages, a stage finding it full (pushing)
+ * or empty (popping) yields a few times and then sleeps on cond until
+ * the other stage moves
+ */
+#define RING_SIZE   16		/* power of 2 */
+#define RING_SPIN   64
+typedef struct ring_s {
+	volatile unsigned int head;	/* next slot to pop */
+	volatile unsigned int tail;	/* next slot to push */
+	volatile int sleeping;		/* stages waiting on cond */
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	void *slots[RING_SIZE];
+} ring_t;
+
+static void ring_init(ring_t *ring)
+{
+	memset(ring, 0, sizeof(*ring));
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+}
+
+static inline int ring_blocked(ring_t *ring, int push)
+{
+	return push ? ring->tail - ring->head == RING_SIZE :
+		ring->tail == ring->head;
+}
+
+/*
+ * function wait until ring has room (push) or an item (pop)
+ */
+static void ring_wait(ring_t *ring, int push)
+{
+	int spins = 0;
+
+	while (ring_blocked(ring, push)) {
+		if (spins++ < RING_SPIN) {
+			sched_yield();
+			continue;
+		}
+		pthread_mutex_lock(&ring->lock);
+		/* a full barrier: the other stage either sees us
+		 * sleeping or we see it moved */
+		__sync_add_and_fetch(&ring->sleeping, 1);
+		if (ring_blocked(ring, push))
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		__sync_sub_and_fetch(&ring->sleeping, 1);
+		pthread_mutex_unlock(&ring->lock);
+	}
+}
+
+static void ring_wake(ring_t *ring)
+{
+	__sync_synchronize();
+	if (ring->sleeping) {
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+}
+
+static void ring_push(ring_t *ring, void *item)
+{
+	ring_wait(ring, 1);
+	__sync_synchronize();
+	ring->slots[ring->tail & (RING_SIZE - 1)] = item;
+	__sync_synchronize();
+	ring->tail++;
+	ring_wake(ring);
+}
+
+/*
+ * function take the oldest item off ring, waiting for one if wait,
+ * else returns NULL if there is none
+ */
+static void *ring_pop(ring_t *ring, int wait)
+{
+	void *item;
+
+	if (!wait && ring_blocked(ring, 0))
+		return NULL;
+
+	ring_wait(ring, 0);
+	__sync_synchronize();
+	item = ring->slots[ring->head & (RING_SIZE - 1)];
+	__sync_synchronize();
+	ring->head++;
+	ring_wake(ring);
+	return item;
+}
+
+/*
+ * pipe_batch_t is what goes through the pipeline: the reader hands a
+ * span of whole lines of a chunk (holding a chunk reference) to a
+ * framer, which splits it into one or more batches of messages for
+ * the sending thread, the last of them marked last
+ * a batch without chunk marks the end of the input
+ */
+typedef struct pipe_batch_s {
+	struct pipe_batch_s *next;	/* free list link */
+	line_chunk_t *chunk;
+	int  start;			/* span offset in chunk */
+	int  len;			/* span length */
+	int  cnt;			/* messages */
+	int  last;			/* last batch of its span */
+	int  topic;			/* g_topics index (listeners) */
+	rd_kafka_message_t msgs[LINE_CHUNK_MSGS];
+} pipe_batch_t;
+
+/*
+ * pipeline_t reads stdin on a reader thread, splits it in lines (and
+ * sets their partitioning keys) on g_framer_threads framer threads,
+ * and leaves handing the lines to librdkafka, which may block, to the
+ * main thread, so that reading never waits for a slow broker until
+ * the rings are full
+ * the reader hands out spans to the framers in turn and the main
+ * thread takes the framers' batches in the same turn, which keeps the
+ * lines in order
+ */
+#define PIPE_FRAMERS_MAX  16
+#define PIPE_POLL_MS      1000
+typedef struct pipe_framer_s {
+	pthread_t thread;
+	ring_t    in;			/* spans from the reader */
+	ring_t    out;			/* batches to the main thread */
+} pipe_framer_t;
+
+typedef struct pipeline_s {
+	line_reader_t reader;
+	pthread_t     thread;		/* reader thread */
+	int           framer_cnt;
+	int           next_in;		/* framer the next span goes to */
+	int           next_out;		/* framer the next batch is from */
+	pipe_batch_t *cur;		/* batch being sent */
+	int           eof;		/* end of input was seen */
+	pipe_framer_t framers[PIPE_FRAMERS_MAX];
+} pipeline_t;
+
+static pthread_mutex_t g_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pipe_batch_t *g_batch_free = NULL;
+
+static pipe_batch_t *pipe_batch_get(void)
+{
+	pipe_batch_t *batch;
+
+	pthread_mutex_lock(&g_batch_lock);
+	if ((batch = g_batch_free))
+		g_batch_free = batch->next;
+	pthread_mutex_unlock(&g_batch_lock);
+
+	if (!batch && !(batch = calloc(1, sizeof(*batch)))) {
+		save_error(g_logsavelocal_tag, LOG_CRIT,
+			   "pipeline batch calloc fail...");
+		exit(10);
+	}
+	batch->chunk = NULL;
+	batch->cnt = 0;
+	batch->topic = 0;
+	return batch;
+}
+
+/*
+ * function put batch on the free list, there are no more of them
+ * than fit in the rings and the listeners' batch queue
+ */
+static void pipe_batch_put(pipe_batch_t *batch)
+{
+	pthread_mutex_lock(&g_batch_lock);
+	batch->next = g_batch_free;
+	g_batch_free = batch;
+	pthread_mutex_unlock(&g_batch_lock);
+}
+
+/*
+ * function hand the reader's data up to cut to the next framer
+ */
+static void pipe_span(pipeline_t *pl, int cut)
+{
+	line_reader_t *lr = &pl->reader;
+	pipe_batch_t *batch = pipe_batch_get();
+
+	__sync_add_and_fetch(&lr->chunk->refcnt, 1);
+	batch->chunk = lr->chunk;
+	batch->start = lr->start;
+	batch->len = cut - lr->start;
+	lr->start = cut;
+
+	ring_push(&pl->framers[pl->next_in].in, batch);
+	pl->next_in = (pl->next_in + 1) % pl->framer_cnt;
+}
+
+/*
+ * function reader thread: read the input and cut it after the last
+ * newline read, or in g_max_record_size pieces if there is none, the
+ * framers see whole lines only
+ * a stop (g_run_tag cleared) ends the input like its end does, the
+ * input is polled so that a stop is seen while none comes
+ */
+static void *pipe_reader_main(void *arg)
+{
+	pipeline_t *pl = arg;
+	line_reader_t *lr = &pl->reader;
+	struct pollfd pfd = { fd: lr->fd, events: POLLIN };
+	ssize_t r;
+	int i;
+
+	while (g_run_tag) {
+		int old, cut;
+
+		if (lr->end == g_read_buffer_size)
+			line_reader_renew(lr);
+
+		if (poll(&pfd, 1, PIPE_POLL_MS) <= 0)
+			continue;
+		r = read(lr->fd, lr->chunk->buf + lr->end,
+			 g_read_buffer_size - lr->end);
+		if (r <= 0)
+			break;
+
+		old = lr->end;
+		lr->end += r;
+		for (cut = lr->end;
+		     cut > old && lr->chunk->buf[cut - 1] != '\n'; cut--)
+			;
+
+		if (cut == old) {
+			/* no newline, the data before has none either */
+			if (lr->end - lr->start < g_max_record_size)
+				continue;
+			cut = lr->start + (lr->end - lr->start) /
+				g_max_record_size * g_max_record_size;
+		}
+
+		pipe_span(pl, cut);
+	}
+
+	/* a last line without newline */
+	if (lr->end > lr->start)
+		pipe_span(pl, lr->end);
+
+	/* end of input, to every framer, in turn */
+	for (i = 0; i < pl->framer_cnt; i++) {
+		ring_push(&pl->framers[pl->next_in].in, pipe_batch_get());
+		pl->next_in = (pl->next_in + 1) % pl->framer_cnt;
+	}
+
+	return NULL;
+}
+
+/*
+ * function framer thread: split spans in batches of lines
+ */
+static void *pipe_framer_main(void *arg)
+{
+	pipe_framer_t *fr = arg;
+	pipe_batch_t *batch;
+
+	while ((batch = ring_pop(&fr->in, 1))->chunk) {
+		line_chunk_t *chunk = batch->chunk;
+		line_reader_t lr = {
+			chunk: chunk,
+			start: batch->start,
+			end: batch->start + batch->len,
+		};
+
+		while (1) {
+			/* the span ends in a newline, or is cut where
+			 * split_lines would cut it at end of input */
+			batch->cnt = split_lines(&lr, batch->msgs,
+						 LINE_CHUNK_MSGS, 1);
+			batch->last = lr.start == lr.end;
+			ring_push(&fr->out, batch);
+			if (lr.start == lr.end)
+				break;
+			batch = pipe_batch_get();
+			batch->chunk = chunk;
+		}
+
+		line_chunk_put(chunk);
+	}
+
+	ring_push(&fr->out, batch);
+	return NULL;
+}
+
+/*
+ * function start a pipeline reading fd with g_framer_threads framers
+ */
+static pipeline_t *pipeline_start(int fd)
+{
+	pipeline_t *pl = calloc(1, sizeof(*pl));
+	int i;
+
+	pl->framer_cnt = g_framer_threads < PIPE_FRAMERS_MAX ?
+		g_framer_threads : PIPE_FRAMERS_MAX;
+	line_reader_init(&pl->reader, fd);
+
+	for (i = 0; i < pl->framer_cnt; i++) {
+		pipe_framer_t *fr = &pl->framers[i];
+		ring_init(&fr->in);
+		ring_init(&fr->out);
+		if (pthread_create(&fr->thread, NULL,
+				   pipe_framer_main, fr) ||
+		    pthread_detach(fr->thread)) {
+			save_error(g_logsavelocal_tag, LOG_CRIT,
+				   "pipeline framer thread fail...");
+			exit(11);
+		}
+	}
+
+	if (pthread_create(&pl->thread, NULL, pipe_reader_main, pl) ||
+	    pthread_detach(pl->thread)) {
+		save_error(g_logsavelocal_tag, LOG_CRIT,
+			   "pipeline reader thread fail...");
+		exit(11);
+	}
+
+	return pl;
+}
+
+/*
+ * function the next batch of lines from pl to msgsp, waiting for one
+ * if wait, returns the number of lines, 0 at end of input, -1 if
+ * there is none ready (!wait)
+ * the previous batch is given back
+ */
+static int pipeline_next(pipeline_t *pl, rd_kafka_message_t **msgsp,
+			 int wait)
+{
+	pipe_batch_t *batch;
+
+	if (pl->cur) {
+		if (pl->cur->last)
+			pl->next_out = (pl->next_out + 1) % pl->framer_cnt;
+		pipe_batch_put(pl->cur);
+		pl->cur = NULL;
+	}
+
+	if (pl->eof)
+		return 0;
+
+	if (!(batch = ring_pop(&pl->framers[pl->next_out].out, wait)))
+		return -1;
+
+	if (!batch->chunk) {
+		pipe_batch_put(batch);
+		pl->eof = 1;
+		return 0;
+	}
+
+	pl->cur = batch;
+	*msgsp = batch->msgs;
+	return batch->cnt;
+}
+
+/*
+ * tail_file_t is a log file followed by tail_files(): new data is read
+ * with large pread(2)s from pos into the file's line reader, the path
+ * is reopened once it names another file that has been written to
+ * (rotated by rename) and the file is read from the start again when it
+ * shrinks below pos (truncated in place)
+ * the offset saved for a file is that of its first byte not queued yet,
+ * pos less the partial line buffered
+ */
+#define TAIL_FILES_MAX     64
+#define TAIL_POLL_MS       1000
+#define TAIL_SAVE_PERIOD   1	/* seconds between offset saves */
+typedef struct tail_file_s {
+	char  path[PATH_MAX];
+	const char *name;	/* last path component, in path */
+	int   wd;		/* inotify watch of its directory */
+	int   dirty;		/* has an event pending */
+	dev_t dev;		/* of the open file */
+	ino_t ino;
+	off_t pos;		/* next byte to read */
+	line_reader_t lr;	/* lr.fd is -1 while the file is missing */
+} tail_file_t;
+
+static inline off_t tail_offset(tail_file_t *tf)
+{
+	return tf->pos - (tf->lr.end - tf->lr.start);
+}
+
+/*
+ * function copy the directory part of path to dir
+ */
+static void tail_dirname(const char *path, char *dir, size_t size)
+{
+	const char *slash = strrchr(path, '/');
+
+	if (!slash)
+		snprintf(dir, size, ".");
+	else if (slash == path)
+		snprintf(dir, size, "/");
+	else
+		snprintf(dir, size, "%.*s", (int)(slash - path), path);
+}
+
+/*
+ * function open tf's path for reading from the start,
+ * returns -1 if it cannot
+ */
+static int tail_open(tail_file_t *tf)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(tf->path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	line_reader_init(&tf->lr, fd);
+	tf->dev = st.st_dev;
+	tf->ino = st.st_ino;
+	tf->pos = 0;
+	return 0;
+}
+
+/*
+ * function queue the lines appended to tf since the last call, with
+ * eof a last line without newline too, returns the number of lines
+ */
+static int tail_read(tail_file_t *tf, int eof, rd_kafka_t **rks,
+		     rd_kafka_topic_t **rkts, int rkcount)
+{
+	static rd_kafka_message_t msgs[LINE_CHUNK_MSGS];
+	line_reader_t *lr = &tf->lr;
+	int sent = 0;
+	int cnt;
+	ssize_t r;
+
+	do {
+		while ((cnt = split_lines(lr, msgs, LINE_CHUNK_MSGS, 0)) > 0) {
+			producer(rks, rkts, RD_KAFKA_OP_F_FREE_CB,
+				 msgs, cnt, rkcount);
+			sent += cnt;
+		}
+		if (lr->end == g_read_buffer_size)
+			line_reader_renew(lr);
+
+		r = pread(lr->fd, lr->chunk->buf + lr->end,
+			  g_read_buffer_size - lr->end, tf->pos);
+		if (r > 0) {
+			lr->end += r;
+			tf->pos += r;
+		}
+	} while (r > 0 && g_run_tag);
+
+	if (r == -1)
+		save_errorf(LOG_ERR, "read %s fail: %s\n",
+			    tf->path, strerror(errno));
+
+	while (eof && (cnt = split_lines(lr, msgs, LINE_CHUNK_MSGS, 1)) > 0) {
+		producer(rks, rkts, RD_KAFKA_OP_F_FREE_CB, msgs, cnt, rkcount);
+		sent += cnt;
+	}
+	return sent;
+}
+
+/*
+ * function follow tf: queue what was appended, start over if it was
+ * truncated, move on to the new file if it was rotated,
+ * returns the number of lines queued
+ */
+static int tail_check(tail_file_t *tf, rd_kafka_t **rks,
+		      rd_kafka_topic_t **rkts, int rkcount)
+{
+	struct stat st;
+	int sent = 0;
+
+	if (tf->lr.fd == -1) {
+		if (tail_open(tf) == -1)
+			return 0;
+		save_errorf(LOG_INFO, "tailing new file %s\n", tf->path);
+	}
+
+	sent += tail_read(tf, 0, rks, rkts, rkcount);
+
+	if (fstat(tf->lr.fd, &st) == 0 && st.st_size < tf->pos) {
+		/* truncated in place (copytruncate) */
+		sent += tail_read(tf, 1, rks, rkts, rkcount);
+		line_reader_init(&tf->lr, tf->lr.fd);
+		tf->pos = 0;
+		save_errorf(LOG_INFO, "%s truncated, reading from start\n",
+			    tf->path);
+		sent += tail_read(tf, 0, rks, rkts, rkcount);
+	}
+
+	/* rotated: the writer may still append to the old file until it
+	 * reopens the path, it has once the new file has data */
+	if (stat(tf->path, &st) == 0 && st.st_size > 0 &&
+	    (st.st_dev != tf->dev || st.st_ino != tf->ino)) {
+		sent += tail_read(tf, 1, rks, rkts, rkcount);
+		close(tf->lr.fd);
+		tf->lr.fd = -1;
+		save_errorf(LOG_INFO, "%s rotated, reading new file\n",
+			    tf->path);
+		if (tail_open(tf) == 0)
+			sent += tail_read(tf, 0, rks, rkts, rkcount);
+	}
+
+	return sent;
+}
+
+/*
+ * function queue the rest of tf's file as it was when the offsets were
+ * saved (dev, ino, off), if it was rotated within the same directory
+ * while we were not running, returns the number of lines queued
+ */
+static int tail_rotated(tail_file_t *tf, dev_t dev, ino_t ino, off_t off,
+			rd_kafka_t **rks, rd_kafka_topic_t **rkts,
+			int rkcount)
+{
+	static tail_file_t old;
+	char dir[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	int found = 0;
+	int sent;
+	DIR *dp;
+
+	tail_dirname(tf->path, dir, sizeof(dir));
+	if (!(dp = opendir(dir)))
+		return 0;
+	while (!found && (de = readdir(dp))) {
+		if (snprintf(old.path, sizeof(old.path), "%s/%s",
+			     dir, de->d_name) >= sizeof(old.path))
+			continue;
+		found = stat(old.path, &st) == 0 && S_ISREG(st.st_mode) &&
+			st.st_dev == dev && st.st_ino == ino;
+	}
+	closedir(dp);
+
+	if (!found || tail_open(&old) == -1)
+		return 0;
+	old.pos = off;
+	sent = tail_read(&old, 1, rks, rkts, rkcount);
+	close(old.lr.fd);
+
+	save_errorf(LOG_INFO, "%s rotated to %s, read its rest\n",
+		    tf->path, old.path);
+	return sent;
+}
+
+/*
+ * function open the tailed files at their saved offsets, or at their
+ * end if none is saved, returns the number of lines queued
+ */
+static int tail_resume(tail_file_t *tfs, int cnt, rd_kafka_t **rks,
+		       rd_kafka_topic_t **rkts, int rkcount)
+{
+	char line[PATH_MAX + 128];
+	char path[sizeof(line)];
+	unsigned long long dev;
+	unsigned long long ino;
+	long long off;
+	struct stat st;
+	int sent = 0;
+	FILE *fp;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if (tail_open(&tfs[i]) == 0 && fstat(tfs[i].lr.fd, &st) == 0)
+			tfs[i].pos = st.st_size;
+	}
+
+	if (!(fp = fopen(g_tail_offset_path, "r")))
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		tail_file_t *tf;
+
+		if (sscanf(line, "%llu %llu %lld %[^\n]",
+			   &dev, &ino, &off, path) != 4)
+			continue;
+		for (i = 0; i < cnt && strcmp(tfs[i].path, path); i++)
+			;
+		if (i == cnt)
+			continue;
+		tf = &tfs[i];
+
+		if (tf->lr.fd != -1 && tf->dev == dev && tf->ino == ino) {
+			if (off <= tf->pos)
+				tf->pos = off;
+			else
+				tf->pos = 0;	/* truncated */
+			continue;
+		}
+		/* rotated while we were not running */
+		sent += tail_rotated(tf, dev, ino, off, rks, rkts, rkcount);
+		tf->pos = 0;
+	}
+	fclose(fp);
+	return sent;
+}
+
+/*
+ * function save the offsets of the tailed files to g_tail_offset_path,
+ * atomically: written to a temporary file renamed over it
+ */
+static void tail_save(tail_file_t *tfs, int cnt)
+{
+	char tmp[PATH_MAX + 8];
+	FILE *fp;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", g_tail_offset_path);
+	if (!(fp = fopen(tmp, "w"))) {
+		save_errorf(LOG_ERR, "open %s fail: %s\n",
+			    tmp, strerror(errno));
+		return;
+	}
+	for (i = 0; i < cnt; i++) {
+		if (tfs[i].lr.fd == -1)
+			continue;
+		fprintf(fp, "%llu %llu %lld %s\n",
+			(unsigned long long)tfs[i].dev,
+			(unsigned long long)tfs[i].ino,
+			(long long)tail_offset(&tfs[i]), tfs[i].path);
+	}
+	if (fflush(fp) || fsync(fileno(fp)) || fclose(fp) ||
+	    rename(tmp, g_tail_offset_path)) {
+		save_errorf(LOG_ERR, "save %s fail: %s\n",
+			    g_tail_offset_path, strerror(errno));
+	}
+}
+
+/*
+ * function follow the comma separated g_tail_files until stopped by a
+ * signal, their directories are watched with inotify for appended,
+ * created and renamed files, and all of them are checked every
+ * TAIL_POLL_MS in case an event was missed
+ * returns the number of lines queued
+ */
+int tail_files(rd_kafka_t **rks, rd_kafka_topic_t **rkts, int rkcount)
+{
+	static tail_file_t tfs[TAIL_FILES_MAX];
+	static char evbuf[16 * 1024]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	char paths[sizeof(g_tail_files)];
+	char dir[PATH_MAX];
+	char *path;
+	char *save = NULL;
+	struct pollfd pfd;
+	time_t saved = 0;
+	off_t offset;
+	ssize_t r;
+	int changed = 0;
+	int sent = 0;
+	int cnt = 0;
+	int i;
+
+	if ((pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		perror("inotify_init1");
+		save_error(g_logsavelocal_tag, LOG_CRIT, "inotify init fail...");
+		exit(12);
+	}
+	pfd.events = POLLIN;
+
+	strcpy(paths, g_tail_files);
+	for (path = strtok_r(paths, ",", &save);
+	     path && cnt < TAIL_FILES_MAX;
+	     path = strtok_r(NULL, ",", &save)) {
+		tail_file_t *tf = &tfs[cnt];
+
+		while (isspace(*path))
+			path++;
+		if (!*path)
+			continue;
+		snprintf(tf->path, sizeof(tf->path), "%s", path);
+		tf->name = strrchr(tf->path, '/') ?
+			strrchr(tf->path, '/') + 1 : tf->path;
+		tf->lr.fd = -1;
+
+		tail_dirname(tf->path, dir, sizeof(dir));
+		tf->wd = inotify_add_watch(pfd.fd, dir,
+					   IN_MODIFY | IN_CREATE | IN_MOVED_TO);
+		if (tf->wd == -1)
+			save_errorf(LOG_ERR, "watch %s fail: %s\n",
+				    dir, strerror(errno));
+		cnt++;
+	}
+
+	sent += tail_resume(tfs, cnt, rks, rkts, rkcount);
+	for (i = 0; i < cnt; i++)
+		tfs[i].dirty = 1;
+
+	while (g_run_tag) {
+		for (i = 0; i < cnt; i++) {
+			if (!tfs[i].dirty)
+				continue;
+			tfs[i].dirty = 0;
+			offset = tail_offset(&tfs[i]);
+			sent += tail_check(&tfs[i], rks, rkts, rkcount);
+			changed |= tail_offset(&tfs[i]) != offset;
+		}
+
+		/* the lines read are queued by now */
+		if (changed && time(NULL) - saved >= TAIL_SAVE_PERIOD) {
+			tail_save(tfs, cnt);
+			saved = time(NULL);
+			changed = 0;
+		}
+
+		if (poll(&pfd, 1, TAIL_POLL_MS) <= 0) {
+			for (i = 0; i < cnt; i++)
+				tfs[i].dirty = 1;
+			continue;
+		}
+
+		while ((r = read(pfd.fd, evbuf, sizeof(evbuf))) > 0) {
+			char *p;
+			for (p = evbuf; p < evbuf + r;
+			     p += sizeof(struct inotify_event) +
+				     ((struct inotify_event *)p)->len) {
+				struct inotify_event *ev = (void *)p;
+				for (i = 0; i < cnt; i++) {
+					if ((ev->mask & IN_Q_OVERFLOW) ||
+					    (ev->wd == tfs[i].wd && ev->len &&
+					     !strcmp(ev->name, tfs[i].name)))
+						tfs[i].dirty = 1;
+				}
+			}
+		}
+	}
+
+	tail_save(tfs, cnt);
+	return sent;
+}
+
+/*
+ * function the g_topics index of the topic name (len bytes), added if
+ * new, returns -1 if name is no topic name or there are TOPICS_MAX
+ * topics already, any thread
+ */
+static int topic_get(const char *name, int len)
+{
+	int i;
+
+	if (len == 0)
+		return 0;
+	if (len > RD_KAFKA_TOPIC_MAXLEN)
+		return -1;
+	for (i = 0; i < len; i++)
+		if (!name[i] || (!isalnum((unsigned char)name[i]) &&
+				 !strchr("._-", name[i])))
+			return -1;
+
+	pthread_mutex_lock(&g_topic_lock);
+	for (i = 0; i < g_topic_cnt; i++)
+		if (!strncmp(g_topics[i].name, name, len) &&
+		    !g_topics[i].name[len])
+			break;
+	if (i == g_topic_cnt) {
+		if (i < TOPICS_MAX)
+			g_topics[g_topic_cnt++].name = strndup(name, len);
+		else
+			i = -1;
+	}
+	pthread_mutex_unlock(&g_topic_lock);
+
+	return i;
+}
+
+/*
+ * function the broker handles of topic t, created on first use,
+ * main thread
+ */
+static rd_kafka_topic_t **topic_rkts(rd_kafka_t **rks, int rkcount, int t)
+{
+	topic_t *topic = &g_topics[t];
+	int i;
+
+	if (!topic->rkts) {
+		topic->rkts = calloc(rkcount, sizeof(*topic->rkts));
+		for (i = 0; i < rkcount; i++)
+			topic->rkts[i] = rd_kafka_topic_new(rks[i],
+							    topic->name);
+	}
+	return topic->rkts;
+}
+
+/*
+ * function queue the records saved by save_queuedata_tofile for the
+ * topics other than the configured one, data_path.<topic> files,
+ * returns the number of records
+ */
+static int topic_queuedata_replay(rd_kafka_t **rks, int rkcount)
+{
+	static line_reader_t reader;
+	static rd_kafka_message_t msgs[LINE_CHUNK_MSGS];
+	char dir[PATH_MAX];
+	char *path;
+	const char *base = strrchr(g_queue_data_filepath, '/');
+	struct dirent *de;
+	DIR *dp;
+	int sent = 0;
+	int baselen;
+	int cnt;
+	int fd;
+	int t;
+
+	base = base ? base + 1 : g_queue_data_filepath;
+	baselen = strlen(base);
+	tail_dirname(g_queue_data_filepath, dir, sizeof(dir));
+	if (!(dp = opendir(dir)))
+		return 0;
+
+	while ((de = readdir(dp))) {
+		if (strncmp(de->d_name, base, baselen) ||
+		    de->d_name[baselen] != '.' ||
+		    (t = topic_get(de->d_name + baselen + 1,
+				   strlen(de->d_name + baselen + 1))) <= 0)
+			continue;
+		if (asprintf(&path, "%s/%s", dir, de->d_name) == -1)
+			continue;
+		if ((fd = open(path, O_RDONLY)) != -1) {
+			line_reader_init(&reader, fd);
+			while ((cnt = read_records(&reader, msgs,
+						   LINE_CHUNK_MSGS)) > 0) {
+				sent += cnt;
+				producer(rks, topic_rkts(rks, rkcount, t),
+					 RD_KAFKA_OP_F_FREE_CB,
+					 msgs, cnt, rkcount);
+			}
+			if (cnt == -1)
+				save_errorf(LOG_ERR, "replay %s fail, the rest "
+					    "is dropped\n", path);
+			close(fd);
+			unlink(path);
+		}
+		free(path);
+	}
+	closedir(dp);
+
+	return sent;
+}
+
+/*
+ * batch_queue_t hands the batches of the listener threads to the main
+ * thread, the only one calling producer(), pushing waits while
+ * BATCH_QUEUE_MAX batches are queued so that a slow broker pushes
+ * back on the senders (UDP datagrams are then dropped by the kernel)
+ * until stopped by a signal, the threads then handing their last
+ * batches over without waiting so that they can be joined
+ */
+#define BATCH_QUEUE_MAX  64
+#define BATCH_QUEUE_POLL_MS 1000
+typedef struct batch_queue_s {
+	pthread_mutex_t lock;
+	pthread_cond_t  nonempty;
+	pthread_cond_t  nonfull;
+	pipe_batch_t   *head;
+	pipe_batch_t   *tail;
+	int             cnt;
+} batch_queue_t;
+
+/*
+ * function set ts to wait_ms from now
+ */
+static void batch_queue_deadline(struct timespec *ts, int wait_ms)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += wait_ms / 1000;
+	ts->tv_nsec += (wait_ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void batch_queue_push(batch_queue_t *q, pipe_batch_t *batch)
+{
+	struct timespec ts;
+
+	if (g_conf.producer.partitioner == rd_kafka_partitioner_consistent)
+		set_partition_keys(batch->msgs, batch->cnt);
+
+	batch->next = NULL;
+	pthread_mutex_lock(&q->lock);
+	/* the wait is timed to see a stop, no signal wakes it */
+	while (q->cnt >= BATCH_QUEUE_MAX && g_run_tag) {
+		batch_queue_deadline(&ts, BATCH_QUEUE_POLL_MS);
+		pthread_cond_timedwait(&q->nonfull, &q->lock, &ts);
+	}
+	if (q->tail)
+		q->tail->next = batch;
+	else
+		q->head = batch;
+	q->tail = batch;
+	q->cnt++;
+	pthread_cond_signal(&q->nonempty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * function take the oldest batch, waiting up to wait_ms for one,
+ * returns NULL if there is none
+ */
+static pipe_batch_t *batch_queue_pop(batch_queue_t *q, int wait_ms)
+{
+	pipe_batch_t *batch;
+	struct timespec ts;
+
+	pthread_mutex_lock(&q->lock);
+	if (!q->head && wait_ms > 0) {
+		batch_queue_deadline(&ts, wait_ms);
+		while (!q->head &&
+		       pthread_cond_timedwait(&q->nonempty, &q->lock, &ts) == 0)
+			;
+	}
+	if ((batch = q->head)) {
+		if (!(q->head = batch->next))
+			q->tail = NULL;
+		q->cnt--;
+		pthread_cond_signal(&q->nonfull);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return batch;
+}
+
+/*
+ * the listeners receive lines on sockets instead of reading stdin,
+ * on listen_worker_t threads that push batches to g_listen_queue
+ *
+ * syslog is received on g_syslog_listen, UDP and TCP on the same port
+ * like rsyslog, by g_syslog_threads workers each with its own sockets
+ * bound with SO_REUSEPORT, the kernel spreading datagrams and
+ * connections over them
+ * datagrams are received SYSLOG_DGRAM_BATCH at a time with recvmmsg(2)
+ * straight into a line chunk, a slot of g_syslog_max_msg_size bytes
+ * each, and packed in place behind one another
+ * TCP streams are read into a chunk per connection and framed by octet
+ * counting (RFC 6587 "LEN SP MSG") or by newline, told apart per
+ * message by a leading digit like rsyslog does
+ *
+ * local programs connect to the SOCK_STREAM Unix socket g_unix_listen,
+ * served by one more worker, and send records framed by a 4 byte
+ * big-endian length, the first record of a stream names the topic the
+ * others go to (empty for the configured topic)
+ *
+ * messages get a newline appended if they have none, lines from stdin
+ * being sent with theirs
+ */
+#define LISTEN_WORKERS_MAX   17
+#define SYSLOG_DGRAM_BATCH   64
+#define LISTEN_EVENTS        64
+#define LISTEN_POLL_MS       1000
+
+typedef struct listen_conn_s {
+	line_reader_t lr;
+	int  unix_stream;	/* a Unix socket stream */
+	int  topic;		/* g_topics index, -1 until named */
+	uint32_t skip;		/* bytes left of a truncated message */
+	TAILQ_ENTRY(listen_conn_s) link;
+} listen_conn_t;
+
+typedef struct listen_worker_s {
+	pthread_t      thread;
+	int            epfd;
+	int            stream_fd;	/* listening TCP or Unix socket */
+	int            unix_stream;	/* stream_fd is a Unix socket */
+	line_reader_t  udp;		/* udp.fd is the datagram socket */
+	pipe_batch_t  *batch;		/* being filled */
+	TAILQ_HEAD(, listen_conn_s) conns;	/* accepted, closed on a stop */
+	struct mmsghdr msgv[SYSLOG_DGRAM_BATCH];
+	struct iovec   iov[SYSLOG_DGRAM_BATCH];
+} listen_worker_t;
+
+static batch_queue_t g_listen_queue = {
+	lock: PTHREAD_MUTEX_INITIALIZER,
+	nonempty: PTHREAD_COND_INITIALIZER,
+	nonfull: PTHREAD_COND_INITIALIZER,
+};
+static listen_worker_t g_listen_workers[LISTEN_WORKERS_MAX];
+static int g_listen_worker_cnt = 0;
+static pipe_batch_t *g_listen_cur = NULL;	/* batch being sent */
+
+static void listen_flush(listen_worker_t *w)
+{
+	batch_queue_push(&g_listen_queue, w->batch);
+	w->batch = pipe_batch_get();
+}
+
+/*
+ * function add a message to w's batch, which holds the messages of
+ * one topic
+ */
+static inline void listen_msg(listen_worker_t *w, int topic,
+			      line_chunk_t *chunk, char *payload, int len)
+{
+	rd_kafka_message_t *msg;
+
+	if (w->batch->cnt == LINE_CHUNK_MSGS ||
+	    (w->batch->cnt > 0 && w->batch->topic != topic))
+		listen_flush(w);
+	w->batch->topic = topic;
+
+	msg = &w->batch->msgs[w->batch->cnt++];
+	msg->payload = payload;
+	msg->len = len;
+	msg->err = 0;
+	msg->opaque = chunk;
+	__sync_add_and_fetch(&chunk->refcnt, 1);
+}
+
+/*
+ * function receive up to SYSLOG_DGRAM_BATCH datagrams,
+ * returns the number received, -1 if none was waiting
+ */
+static int syslog_udp_read(listen_worker_t *w)
+{
+	line_reader_t *lr = &w->udp;
+	int slot = g_syslog_max_msg_size;
+	int vlen = (g_read_buffer_size - lr->end) / slot;
+	char *dst;
+	int i, n;
+
+	if (w->batch->cnt == LINE_CHUNK_MSGS)
+		listen_flush(w);
+	if (vlen == 0) {
+		line_reader_init(lr, lr->fd);
+		vlen = g_read_buffer_size / slot;
+	}
+	if (vlen > SYSLOG_DGRAM_BATCH)
+		vlen = SYSLOG_DGRAM_BATCH;
+	if (vlen > LINE_CHUNK_MSGS - w->batch->cnt)
+		vlen = LINE_CHUNK_MSGS - w->batch->cnt;
+
+	for (i = 0; i < vlen; i++) {
+		/* one byte is kept for the newline */
+		w->iov[i].iov_base = lr->chunk->buf + lr->end + i * slot;
+		w->iov[i].iov_len = slot - 1;
+		memset(&w->msgv[i].msg_hdr, 0, sizeof(w->msgv[i].msg_hdr));
+		w->msgv[i].msg_hdr.msg_iov = &w->iov[i];
+		w->msgv[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if ((n = recvmmsg(lr->fd, w->msgv, vlen, MSG_DONTWAIT, NULL)) <= 0)
+		return -1;
+
+	/* pack: each datagram moves down to the end of the one before,
+	 * never past the start of its own slot */
+	dst = lr->chunk->buf + lr->end;
+	for (i = 0; i < n; i++) {
+		int len = w->msgv[i].msg_len;
+
+		if (len == 0)
+			continue;
+		if (dst != w->iov[i].iov_base)
+			memmove(dst, w->iov[i].iov_base, len);
+		if (dst[len - 1] != '\n')
+			dst[len++] = '\n';
+		listen_msg(w, 0, lr->chunk, dst, len);
+		dst += len;
+	}
+	lr->end = dst - lr->chunk->buf;
+	lr->start = lr->end;
+
+	return n;
+}
+
+/*
+ * function frame the syslog messages buffered for c into w's batch,
+ * with eof a last message without end too
+ */
+static void syslog_tcp_frame(listen_worker_t *w, listen_conn_t *c, int eof)
+{
+	line_reader_t *lr = &c->lr;
+
+	while (lr->start < lr->end) {
+		char *p = lr->chunk->buf + lr->start;
+		int avail = lr->end - lr->start;
+		int hdr = 0;
+		int len = 0;
+		char *nl;
+
+		if (c->skip) {
+			uint32_t n = (uint32_t)avail < c->skip ?
+				(uint32_t)avail : c->skip;
+			lr->start += n;
+			c->skip -= n;
+			continue;
+		}
+
+		/* octet counting: LEN SP MSG, LEN has no leading zero */
+		while (hdr < avail && hdr < 9 && isdigit((unsigned char)p[hdr]))
+			len = len * 10 + p[hdr++] - '0';
+		if (hdr == avail && !eof)
+			break;
+		if (hdr > 0 && p[0] != '0' && hdr < avail && p[hdr] == ' ') {
+			int keep = len < g_max_record_size ?
+				len : g_max_record_size - 1;
+
+			if (avail - hdr - 1 < keep && !eof)
+				break;
+			if (avail - hdr - 1 >= keep) {
+				char *msg = p + hdr + 1;
+
+				if (msg[keep - 1] != '\n') {
+					/* move it onto the SP to make room
+					 * for the newline */
+					memmove(msg - 1, msg, keep);
+					msg--;
+					msg[keep++] = '\n';
+				}
+				listen_msg(w, 0, lr->chunk, msg, keep);
+				lr->start += hdr + 1 + len;
+				if (lr->start > lr->end) {
+					c->skip = lr->start - lr->end;
+					lr->start = lr->end;
+				}
+				continue;
+			}
+			/* a truncated frame at end of stream goes as is */
+		}
+
+		/* non-transparent framing */
+		len = avail < g_max_record_size ? avail : g_max_record_size;
+		if ((nl = memchr(p, '\n', len)))
+			len = nl - p + 1;
+		else if (len < g_max_record_size && !eof)
+			break;
+		listen_msg(w, 0, lr->chunk, p, len);
+		lr->start += len;
+	}
+}
+
+/*
+ * function frame the length prefixed records buffered for Unix socket
+ * stream c into w's batch, a record cut by the end of the stream is
+ * dropped, returns -1 if the stream names no valid topic
+ */
+static int unix_frame(listen_worker_t *w, listen_conn_t *c)
+{
+	line_reader_t *lr = &c->lr;
+
+	while (lr->start < lr->end) {
+		unsigned char *p = (unsigned char *)lr->chunk->buf + lr->start;
+		int avail = lr->end - lr->start;
+		uint32_t len;
+		int keep;
+		char *msg;
+
+		if (c->skip) {
+			uint32_t n = (uint32_t)avail < c->skip ?
+				(uint32_t)avail : c->skip;
+			lr->start += n;
+			c->skip -= n;
+			continue;
+		}
+
+		if (avail < 4)
+			break;
+		len = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		msg = (char *)p + 4;
+
+		if (c->topic == -1) {
+			if (len > RD_KAFKA_TOPIC_MAXLEN)
+				return -1;
+			if ((uint32_t)avail - 4 < len)
+				break;
+			if ((c->topic = topic_get(msg, len)) == -1)
+				return -1;
+			lr->start += 4 + len;
+			continue;
+		}
+
+		keep = len < (uint32_t)g_max_record_size ?
+			(int)len : g_max_record_size - 1;
+		if (avail - 4 < keep)
+			break;
+		if (keep > 0) {
+			if (msg[keep - 1] != '\n') {
+				/* move it onto the length to make room for
+				 * the newline */
+				memmove(msg - 1, msg, keep);
+				msg--;
+				msg[keep++] = '\n';
+			}
+			listen_msg(w, c->topic, lr->chunk, msg, keep);
+		}
+		if (len > (uint32_t)avail - 4) {
+			c->skip = len - ((uint32_t)avail - 4);
+			lr->start = lr->end;
+		} else
+			lr->start += 4 + len;
+	}
+
+	return 0;
+}
+
+static void listen_close(listen_worker_t *w, listen_conn_t *c)
+{
+	TAILQ_REMOVE(&w->conns, c, link);
+	close(c->lr.fd);
+	line_chunk_put(c->lr.chunk);
+	free(c);
+}
+
+/*
+ * function read what c's peer sent, closing c at end of stream
+ */
+static void listen_read(listen_worker_t *w, listen_conn_t *c)
+{
+	line_reader_t *lr = &c->lr;
+	ssize_t r;
+
+	/* a partial message is at most g_max_record_size plus header,
+	 * moved to the front it leaves room for at least as much */
+	if (lr->end == g_read_buffer_size)
+		line_reader_renew(lr);
+
+	r = read(lr->fd, lr->chunk->buf + lr->end,
+		 g_read_buffer_size - lr->end);
+	if (r == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (r > 0)
+		lr->end += r;
+	if (!c->unix_stream)
+		syslog_tcp_frame(w, c, r <= 0);
+	else if (unix_frame(w, c) == -1) {
+		save_errorf(LOG_ERR, "%s: stream names no valid topic, "
+			    "closed\n", g_unix_listen);
+		r = 0;
+	}
+
+	if (r <= 0)
+		listen_close(w, c);
+}
+
+static void listen_accept(listen_worker_t *w)
+{
+	struct epoll_event ev;
+	listen_conn_t *c;
+	int fd;
+
+	while ((fd = accept4(w->stream_fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		c = calloc(1, sizeof(*c));
+		line_reader_init(&c->lr, fd);
+		c->unix_stream = w->unix_stream;
+		c->topic = w->unix_stream ? -1 : 0;
+		TAILQ_INSERT_TAIL(&w->conns, c, link);
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+			listen_close(w, c);
+	}
+}
+
+static void *listen_worker_main(void *arg)
+{
+	listen_worker_t *w = arg;
+	struct epoll_event evs[LISTEN_EVENTS];
+	listen_conn_t *c;
+	int i, n;
+
+	while (g_run_tag) {
+		n = epoll_wait(w->epfd, evs, LISTEN_EVENTS, LISTEN_POLL_MS);
+		/* level triggered: a socket with more to read than one
+		 * call takes is back in the next round */
+		for (i = 0; i < n; i++) {
+			if (evs[i].data.ptr == &w->udp)
+				syslog_udp_read(w);
+			else if (evs[i].data.ptr == &w->stream_fd)
+				listen_accept(w);
+			else
+				listen_read(w, evs[i].data.ptr);
+		}
+		/* the last round's batch too, once stopped */
+		if (w->batch->cnt > 0)
+			listen_flush(w);
+	}
+
+	/* the messages TCP syslog streams still buffer end like at their
+	 * end of stream */
+	while ((c = TAILQ_FIRST(&w->conns))) {
+		if (!c->unix_stream)
+			syslog_tcp_frame(w, c, 1);
+		listen_close(w, c);
+	}
+	if (w->batch->cnt > 0)
+		listen_flush(w);
+
+	return NULL;
+}
+
+/*
+ * function start a worker serving the listening sockets udp_fd (or -1)
+ * and stream_fd
+ */
+static void listen_worker_start(int udp_fd, int stream_fd, int unix_stream)
+{
+	listen_worker_t *w = &g_listen_workers[g_listen_worker_cnt++];
+	struct epoll_event ev = { events: EPOLLIN };
+
+	w->batch = pipe_batch_get();
+	w->stream_fd = stream_fd;
+	w->unix_stream = unix_stream;
+	w->udp.fd = -1;
+	TAILQ_INIT(&w->conns);
+
+	if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		goto fail;
+	if (udp_fd != -1) {
+		line_reader_init(&w->udp, udp_fd);
+		ev.data.ptr = &w->udp;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, udp_fd, &ev) == -1)
+			goto fail;
+	}
+	ev.data.ptr = &w->stream_fd;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, stream_fd, &ev) == -1)
+		goto fail;
+
+	if (pthread_create(&w->thread, NULL, listen_worker_main, w))
+		goto fail;
+	return;
+
+fail:
+	save_error(g_logsavelocal_tag, LOG_CRIT, "listen worker fail...");
+	exit(12);
+}
+
+/*
+ * function open a socket of type bound to ai, shared by port with
+ * the other workers' sockets, exits if it cannot
+ */
+static int syslog_socket(struct addrinfo *ai, int type)
+{
+	int fd;
+	int on = 1;
+
+	if ((fd = socket(ai->ai_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			 0)) == -1)
+		goto fail;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+	if (type == SOCK_DGRAM && g_syslog_rcvbuf_size > 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+			   &g_syslog_rcvbuf_size, sizeof(g_syslog_rcvbuf_size));
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 ||
+	    (type == SOCK_STREAM && listen(fd, 128) == -1))
+		goto fail;
+	return fd;
+
+fail:
+	save_errorf(LOG_CRIT, "syslog listen on %s fail: %s\n",
+		    g_syslog_listen, strerror(errno));
+	exit(12);
+}
+
+/*
+ * function start listening for syslog on g_syslog_listen, [host:]port
+ */
+static void syslog_start(void)
+{
+	struct addrinfo hints = {
+		ai_flags: AI_PASSIVE,
+		ai_family: AF_UNSPEC,
+		ai_socktype: SOCK_DGRAM,
+	};
+	struct addrinfo *ai;
+	char buf[1024];
+	char *host = buf;
+	char *port;
+	int cnt;
+	int i;
+
+	strcpy(buf, g_syslog_listen);
+	if ((port = strrchr(buf, ':')))
+		*port++ = '\0';
+	else {
+		port = buf;
+		host = "";
+	}
+	/* [::1]:514 */
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = '\0';
+		host++;
+	}
+	if ((i = getaddrinfo(*host ? host : NULL, port, &hints, &ai))) {
+		save_errorf(LOG_CRIT, "syslog listen on %s fail: %s\n",
+			    g_syslog_listen, gai_strerror(i));
+		exit(12);
+	}
+
+	/* room for a datagram and its newline, within the record size */
+	if (g_syslog_max_msg_size < 2)
+		g_syslog_max_msg_size = 8192;
+	if (g_syslog_max_msg_size > g_max_record_size)
+		g_syslog_max_msg_size = g_max_record_size;
+
+	cnt = g_syslog_threads < 1 ? 1 :
+		g_syslog_threads < LISTEN_WORKERS_MAX - 1 ?
+		g_syslog_threads : LISTEN_WORKERS_MAX - 1;
+	for (i = 0; i < cnt; i++)
+		listen_worker_start(syslog_socket(ai, SOCK_DGRAM),
+				    syslog_socket(ai, SOCK_STREAM), 0);
+
+	freeaddrinfo(ai);
+}
+
+/*
+ * function start listening on the Unix socket g_unix_listen, replacing
+ * a socket left there by an earlier run
+ */
+static void unix_start(void)
+{
+	struct sockaddr_un addr = { sun_family: AF_UNIX };
+	struct stat st;
+	int fd;
+
+	if (strlen(g_unix_listen) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		goto fail;
+	}
+	strcpy(addr.sun_path, g_unix_listen);
+	if (stat(g_unix_listen, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(g_unix_listen);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			 0)) == -1 ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(fd, 128) == -1)
+		goto fail;
+
+	listen_worker_start(-1, fd, 1);
+	return;
+
+fail:
+	save_errorf(LOG_CRIT, "unix listen on %s fail: %s\n",
+		    g_unix_listen, strerror(errno));
+	exit(12);
+}
+
+/*
+ * function the next batch of received messages, msgs pointed at it and
+ * topic set to its g_topics index, returns the number of messages, 0
+ * once stopped by a signal, or -1 if wait is 0 and there is none
+ * the batch stays valid until the next call
+ */
+static int listen_next(rd_kafka_message_t **msgsp, int *topicp, int wait)
+{
+	if (g_listen_cur)
+		pipe_batch_put(g_listen_cur);
+
+	do {
+		g_listen_cur = batch_queue_pop(&g_listen_queue,
+					       wait ? LISTEN_POLL_MS : 0);
+	} while (!g_listen_cur && wait && g_run_tag);
+
+	if (!g_listen_cur)
+		return wait ? 0 : -1;
+	*msgsp = g_listen_cur->msgs;
+	*topicp = g_listen_cur->topic;
+	return g_listen_cur->cnt;
+}
+
+/*
+ * function wait for the listener workers to end once stopped by a
+ * signal, each having pushed its last batch to g_listen_queue
+ */
+static void listen_join(void)
+{
+	int i;
+
+	for (i = 0; i < g_listen_worker_cnt; i++)
+		pthread_join(g_listen_workers[i].thread, NULL);
+}
+
+int main(int argc, char *argv[],char *envp[])
+{
+	rd_kafka_t *rks[1024] = { 0 };
+	rd_kafka_topic_t *rkts[1024] = { 0 };
+	int rkcount = 0;
+	char value[1024] = { 0 };
+	char brokers[1024] = "localhost:9092";
+	char *broker = NULL;
+	char topic[1024] = "topic";
+	int sendcnt = 0;
+	int partitions = 4;
+	int opt;
+	char config_file[1024] = "";
+	char path[PATH_MAX] = {0};
+	char processname[1024] = {0};
+
+	get_executable_path(path,processname,sizeof(processname));
+	snprintf(config_file, sizeof(config_file), "/etc/sendkafka/%s.conf", processname);
+
+	g_conf = rd_kafka_defaultconf;
+	g_conf.producer.free_cb = line_chunk_release;
+	g_conf.producer.partitioner = rd_kafka_partitioner_sticky;
+
+
+	if (read_config("brokers", value, sizeof(value), config_file)
+	    > 0) {
+		strcpy(brokers, value);
+	}
+	if (read_config("topic", value, sizeof(value),config_file) >
+	    0) {
+		strcpy(topic, value);
+	}
+	if (read_config
+	    ("partitions", value, sizeof(value), config_file) > 0) {
+		partitions = atoi(value);
+		if (partitions <= 0 || partitions > 256) {
+			partitions = 4;
+		}
+	}
+
+	if (read_config
+	    		("data_path", value, sizeof(value),
+	     		config_file) > 0) {
+		strcpy(g_queue_data_filepath, value);
+	}
+	if (read_config
+			("error_path", value, sizeof(value),
+			 config_file) > 0) {
+		strcpy(g_error_logpath, value);
+	}
+
+	if (read_config
+			("logsavelocal_tag", value, sizeof(value),
+			 config_file) > 0) {
+		g_logsavelocal_tag = atoi(value);
+	}
+	if (read_config
+			("lognum_max", value, sizeof(value),
+			 config_file) > 0) {
+		g_logfilenum_max = atoi(value);
+	}
+
+	if (read_config
+			("monitor_period", value, sizeof(value),
+			 config_file) > 0) {
+		g_monitor_period = atoi(value);
+	}
+
+	if (read_config
+			("logsize_max", value, sizeof(value),
+			 config_file) > 0) {
+		g_logfilesize_max = atoi(value);
+	}
+
+	if (read_config
+			("queue_sizepath", value, sizeof(value),
+			 config_file) > 0) {
+		strcpy(g_monitor_qusizelogpath, value);
+	}
+	/* after error_path, as it may log */
+	read_producer_config(config_file);
+
+	while ((opt = getopt(argc, argv, "hb:c:d:p:t:o:m:n:l:x:")) != -1) {
+		switch (opt) {
+			case 'b':
+				strncpy(brokers, optarg, sizeof(brokers));
+				brokers[sizeof(brokers) - 1] = '\0';
+				break;
+			case 'c':
+				if (read_config("brokers", value, sizeof(value), optarg)
+						> 0) {
+					strcpy(brokers, value);
+				}
+
+				if (read_config("topic", value, sizeof(value), optarg) >
+						0) {
+					strcpy(topic, value);
+				}
+
+				if (read_config
+						("partitions", value, sizeof(value), optarg) > 0) {
+					partitions = atoi(value);
+					if (partitions <= 0 || partitions > 256) {
+						partitions = 4;
+					}
+				}
+
+				if (read_config
+						("data_path", value, sizeof(value),
 						 optarg) > 0) {
 
 					strcpy(g_queue_data_filepath, value);
@@ -795,6 +2989,7 @@ int main(int argc, char *argv[],char *envp[])
 
 				g_logfilesize_max = atoi(value);
 			}
+			read_producer_config(optarg);
 			break;
 
 		case 'o':
@@ -874,12 +3069,30 @@ int main(int argc, char *argv[],char *envp[])
 	char buf[4096];
 	//int sendcnt = 0;
 	int i = 0;
+	int cnt = 0;
+	static line_reader_t reader;
+	static rd_kafka_message_t msgs[LINE_CHUNK_MSGS];
+	rd_kafka_message_t *batch = msgs;
+	line_reader_t *lr = &reader;
+	pipeline_t *pl = NULL;
+	int batch_topic = 0;
+	g_conf.producer.partition_cnt = partitions;
+
+	if (g_max_record_size <= 0)
+		g_max_record_size = 1000000;
+	/* a partial line moved to the front of a full chunk leaves
+	 * room for at least as much to read */
+	if (g_read_buffer_size < 2 * g_max_record_size)
+		g_read_buffer_size = 2 * g_max_record_size;
+
 	/* Create Kafka handle */
 	for (broker = strtok(brokers, ","), rkcount = 0;
 	     broker && rkcount < sizeof(rks);
 	     broker = strtok(NULL, ","), ++rkcount) {
-		rks[rkcount] = rd_kafka_new(RD_KAFKA_PRODUCER, broker, NULL);
-		if (!rks[rkcount]) {
+		rks[rkcount] = rd_kafka_new(RD_KAFKA_PRODUCER, broker, &g_conf);
+		if (rks[rkcount])
+			rkts[rkcount] = rd_kafka_topic_new(rks[rkcount], topic);
+		else {
 			for (i = 0; i < rkcount; i++) {
 				rd_kafka_destroy(rks[i]);
 				rks[i] = NULL;
@@ -897,8 +3110,13 @@ int main(int argc, char *argv[],char *envp[])
 
 	}
 
+	if (g_work_stealing && rkcount > 1)
+		rd_kafka_peers_set(rks, rkcount);
+
+	g_topics[0].name = topic;
+	g_topics[0].rkts = rkts;
+
 	FILE *fp = NULL;
-	opbuf = NULL;
 	if (access(g_queue_data_filepath, F_OK) == 0) {
 		fp = fopen(g_queue_data_filepath, "r");
 
@@ -911,13 +3129,12 @@ int main(int argc, char *argv[],char *envp[])
 
 			exit(8);
 		}
-		while (fgets(buf, sizeof(buf), fp)) {
-			++sendcnt;
-			opbuf = strdup(buf);
-			len = strlen(opbuf);
-			producer(rks, topic, partitions,
-					RD_KAFKA_OP_F_FREE,
-					opbuf, len, rkcount);
+		line_reader_init(lr, fileno(fp));
+		while ((cnt = read_lines(lr, msgs, LINE_CHUNK_MSGS)) > 0) {
+			sendcnt += cnt;
+			producer(rks, rkts,
+					RD_KAFKA_OP_F_FREE_CB,
+					msgs, cnt, rkcount);
 		}
 
 		if (get_file_size(g_queue_data_filepath) > 0) {
@@ -928,23 +3145,39 @@ int main(int argc, char *argv[],char *envp[])
 	if(NULL!=fp) {
 		fclose(fp);
 	}
-	char *eptr = NULL;
+	sendcnt += topic_queuedata_replay(rks, rkcount);
+
+	/* tail_files returns once stopped by a signal */
+	if (g_tail_files[0])
+		sendcnt += tail_files(rks, rkts, rkcount);
+	else if (g_syslog_listen[0] || g_unix_listen[0]) {
+		if (g_syslog_listen[0])
+			syslog_start();
+		if (g_unix_listen[0])
+			unix_start();
+	} else if (g_framer_threads > 0)
+		pl = pipeline_start(STDIN_FILENO);
+	else
+		line_reader_init(lr, STDIN_FILENO);
 
 	while (g_run_tag) {
-		eptr = fgets(buf, sizeof(buf), stdin);
-		if (EINTR == errno || NULL == eptr) {
+		if (pl)
+			cnt = pipeline_next(pl, &batch, 1);
+		else if (g_listen_worker_cnt)
+			cnt = listen_next(&batch, &batch_topic, 1);
+		else
+			cnt = read_lines(lr, batch, LINE_CHUNK_MSGS);
+		if (cnt <= 0) {
 			g_run_tag = 0;
 			break;
 		}
-		++sendcnt;
-		opbuf = strdup(buf);
-		len = strlen(opbuf);
+		sendcnt += cnt;
 
-		producer(rks, topic, partitions,
-				RD_KAFKA_OP_F_FREE, opbuf, len, rkcount);
+		producer(rks, topic_rkts(rks, rkcount, batch_topic),
+				RD_KAFKA_OP_F_FREE_CB, batch, cnt, rkcount);
 
 
-		if ((sendcnt % 100000) == 0) {
+		if ((sendcnt / 100000) != ((sendcnt - cnt) / 100000)) {
 
 			char timebuf[50] = { 0 };
 			strcpy(timebuf, getcurrenttime());
@@ -964,6 +3197,24 @@ int main(int argc, char *argv[],char *envp[])
 
 	}
 
+	/* stopped by a signal: the lines the pipeline or the listener
+	 * threads hold are queued too, and saved with the rest, the
+	 * pipeline ends its input on the stop, the listener threads are
+	 * joined before their queue is drained */
+	while (pl && (cnt = pipeline_next(pl, &batch, 1)) > 0) {
+		sendcnt += cnt;
+		producer(rks, rkts,
+				RD_KAFKA_OP_F_FREE_CB, batch, cnt, rkcount);
+	}
+	if (g_listen_worker_cnt)
+		listen_join();
+	while (g_listen_worker_cnt &&
+	       (cnt = listen_next(&batch, &batch_topic, 0)) > 0) {
+		sendcnt += cnt;
+		producer(rks, topic_rkts(rks, rkcount, batch_topic),
+				RD_KAFKA_OP_F_FREE_CB, batch, cnt, rkcount);
+	}
+
 	printf("sendcnt num %d\n", sendcnt);
 	save_queuedata_tofile(rks, rkcount);
 